@@ -0,0 +1,401 @@
+#! /usr/bin/env bash
+
+# benchmark harness for wish; measures throughput and latency of the shell itself
+# needs only bash and coreutils: every workload is a generated batch file timed with date +%s%N; the
+# runner and server benchmarks also need python3, which stands in for a job runner
+
+# check if wish executable exists in current directory
+if ! [[ -x wish ]]; then
+    echo "wish executable does not exist"
+    exit 1
+fi
+
+GREEN='\033[0;32m'
+RED='\033[0;31m'
+NONE='\033[0m'
+
+# make_workloads workdir size
+#   writes one batch file per benchmark into workdir; size scales the amount of commands
+make_workloads () {
+    local workdir=$1
+    local size=$2
+
+    # commands per second for trivial programs
+    for (( i = 0; i < size; i++ )); do
+	echo "true"
+    done > $workdir/true.in
+
+    # built-in heavy script: no child is started at all
+    for (( i = 0; i < size / 4; i++ )); do
+	echo "cd /tmp"
+	echo "cd /"
+	echo "path /bin /usr/bin"
+	echo "path /bin"
+    done > $workdir/builtin.in
+
+    # wide & fan-outs around and beyond the old limit of 100 parallel commands per line
+    local fanout
+    for fanout in 100 500; do
+	local line="true"
+	for (( i = 1; i < fanout; i++ )); do
+	    line="$line & true"
+	done
+	local lines=$(( size / fanout > 0 ? size / fanout : 1 ))
+	for (( i = 0; i < lines; i++ )); do
+	    echo "$line"
+	done > $workdir/fanout$fanout.in
+    done
+
+    # redirection heavy: every command writes its own file
+    for (( i = 0; i < size; i++ )); do
+	echo "echo $i > $workdir/out$(( i % 16 ))"
+    done > $workdir/redirect.in
+
+    # pipelines of trivial stages
+    for (( i = 0; i < size / 4; i++ )); do
+	echo "echo $i | cat | cat | cat"
+    done > $workdir/pipeline.in
+
+    # fan-outs of programs with output, more than a pipe holds per line
+    local line="seq 2000"
+    for (( i = 1; i < 8; i++ )); do
+	line="$line & seq 2000"
+    done
+    for (( i = 0; i < size / 8; i++ )); do
+	echo "$line"
+    done > $workdir/output.in
+
+    # patterns: a fan-out over the same directory of 500 files on every line
+    mkdir -p $workdir/tree
+    for (( i = 0; i < 500; i++ )); do
+	: > $workdir/tree/file$i.log
+    done
+    for (( i = 0; i < size / 4; i++ )); do
+	echo "echo $workdir/tree/*.log & echo $workdir/tree/file1*.log & echo $workdir/tree/*[05].log"
+    done > $workdir/glob.in
+
+    # parse heavy: long lines for a built-in that ignores its arguments, as in generated scripts
+    local words=""
+    for (( i = 0; i < 64; i++ )); do
+	words="$words argument$i"
+    done
+    for (( i = 0; i < size; i++ )); do
+	echo "true$words"
+    done > $workdir/parse.in
+
+    # start-up: one shell launch per command, as when wish wraps a single task
+    echo "true" > $workdir/startup.in
+
+    # a job runner: runs a script jobs times and prints the microseconds it took, launching
+    # "wish options script" for every job or handing the request straight to the server on a socket
+    cat > $workdir/runner.py <<'EOF'
+import os, socket, sys, time
+jobs, script, path, wish = int(sys.argv[1]), sys.argv[2], sys.argv[3], sys.argv[4:]
+null = os.open("/dev/null", os.O_WRONLY)
+environment = b"".join(name + b"=" + value + b"\0" for name, value in os.environb.items())
+start = time.perf_counter()
+for _ in range(jobs):
+    if not path:
+        pid = os.posix_spawn(wish[0], wish + [script], os.environ, file_actions=[(os.POSIX_SPAWN_DUP2, null, 1)])
+        status = os.waitpid(pid, 0)[1]
+    else:
+        # one request per connection: the script and the environment, with the working directory,
+        # stdin, stdout and stderr of the job; the wait status of its shell comes back
+        with socket.socket(socket.AF_UNIX, socket.SOCK_SEQPACKET) as connection:
+            connection.connect(path)
+            directory = os.open(".", os.O_PATH | os.O_DIRECTORY)
+            socket.send_fds(connection, [script.encode() + b"\0" + environment], [directory, 0, null, 2])
+            os.close(directory)
+            reply = connection.recv(4)
+            status = int.from_bytes(reply, sys.byteorder) if len(reply) == 4 else -1
+    if status != 0:
+        sys.exit("job failed with wait status %d" % status)
+print(int((time.perf_counter() - start) * 1000000))
+EOF
+}
+
+# commands_in file
+#   amount of programs the shell runs for a workload (built-ins included)
+commands_in () {
+    local file=$1
+    local words
+    words=$(tr -s '&|' '\n\n' < $file | wc -l)
+    echo $words
+}
+
+# run_benchmark name file runs
+#   runs the workload runs times and prints "name median_us p99_us commands"
+run_benchmark () {
+    local name=$1
+    local file=$2
+    local runs=$3
+    local samples=$workdir/$name.samples
+
+    : > $samples
+    for (( r = 0; r < runs; r++ )); do
+	local start=$(date +%s%N)
+	./wish $wishopts $file > /dev/null 2> $workdir/$name.err
+	local end=$(date +%s%N)
+	if [[ -s $workdir/$name.err ]]; then
+	    echo -e "${RED}$name: wish reported errors${NONE}" >&2
+	    cat $workdir/$name.err >&2
+	    exit 1
+	fi
+	echo $(( (end - start) / 1000 )) >> $samples
+    done
+
+    # nearest-rank percentiles of the sorted samples
+    local median_rank=$(( (runs + 1) / 2 ))
+    local p99_rank=$(( (runs * 99 + 99) / 100 ))
+    local median=$(sort -n $samples | sed -n "${median_rank}p")
+    local p99=$(sort -n $samples | sed -n "${p99_rank}p")
+    echo "$name $median $p99 $(commands_in $file)"
+}
+
+# run_startup name file runs [socket]
+#   launches the shell size / 20 times per run on a one-line script, or hands the script as often to
+#   the server listening on socket, and prints the results like run_benchmark (a "command" is one
+#   launch); the -s reports of the last run are kept
+run_startup () {
+    local name=$1
+    local file=$2
+    local runs=$3
+    local socket=$4
+    local launches=$(( size / 20 > 0 ? size / 20 : 1 ))
+    local samples=$workdir/$name.samples
+
+    : > $samples
+    for (( r = 0; r < runs; r++ )); do
+	: > $workdir/$name.err
+	local start=$(date +%s%N)
+	for (( l = 0; l < launches; l++ )); do
+	    if [[ -n $socket ]]; then
+		./wish -c $socket $file > /dev/null 2>> $workdir/$name.err
+	    else
+		./wish -s $wishopts $file > /dev/null 2>> $workdir/$name.err
+	    fi
+	done
+	local end=$(date +%s%N)
+	if grep -v "^startup: " $workdir/$name.err >&2; then
+	    echo -e "${RED}$name: wish reported errors${NONE}" >&2
+	    exit 1
+	fi
+	echo $(( (end - start) / 1000 )) >> $samples
+    done
+
+    local median_rank=$(( (runs + 1) / 2 ))
+    local p99_rank=$(( (runs * 99 + 99) / 100 ))
+    local median=$(sort -n $samples | sed -n "${median_rank}p")
+    local p99=$(sort -n $samples | sed -n "${p99_rank}p")
+    echo "$name $median $p99 $launches"
+}
+
+# run_runner name file runs [socket]
+#   has the job runner run the one-line script size / 20 times per run, launching the shell for every
+#   job or sending the jobs to the server listening on socket, and prints the results like
+#   run_benchmark (a "command" is one job)
+run_runner () {
+    local name=$1
+    local file=$2
+    local runs=$3
+    local socket=$4
+    local jobs=$(( size / 20 > 0 ? size / 20 : 1 ))
+    local samples=$workdir/$name.samples
+
+    : > $samples
+    for (( r = 0; r < runs; r++ )); do
+	if ! python3 $workdir/runner.py $jobs $file "$socket" ./wish $wishopts >> $samples 2> $workdir/$name.err; then
+	    cat $workdir/$name.err >&2
+	    echo -e "${RED}$name: a job failed${NONE}" >&2
+	    exit 1
+	fi
+    done
+
+    local median_rank=$(( (runs + 1) / 2 ))
+    local p99_rank=$(( (runs * 99 + 99) / 100 ))
+    local median=$(sort -n $samples | sed -n "${median_rank}p")
+    local p99=$(sort -n $samples | sed -n "${p99_rank}p")
+    echo "$name $median $p99 $jobs"
+}
+
+# run_burst name runs
+#   feeds bursts of 16 short programs on one line to a single shell, with idle time in between as
+#   when a user or a tool drives it, and prints "name median_us p99_us commands" of the latency of
+#   a burst (from sending the line to the output of the next one)
+run_burst () {
+    local name=$1
+    local runs=$2
+    local bursts=$(( runs * 20 ))
+    local samples=$workdir/$name.samples
+    local line="sleep 0"
+    for (( i = 1; i < 16; i++ )); do
+	line="$line & sleep 0"
+    done
+
+    : > $samples
+    coproc shell { ./wish $wishopts 2> $workdir/$name.err; }
+    echo "path /bin /usr/bin" >&${shell[1]}
+    for (( b = 0; b < bursts; b++ )); do
+	local start=${EPOCHREALTIME/./}
+	echo "$line" >&${shell[1]}
+	echo "echo burst$b" >&${shell[1]}
+	local out
+	while read -r out <&${shell[0]}; do
+	    [[ $out == *burst$b ]] && break
+	done
+	local end=${EPOCHREALTIME/./}
+	echo $(( end - start )) >> $samples
+	sleep 0.02
+    done
+    echo "exit" >&${shell[1]}
+    wait $shell_PID
+    if [[ -s $workdir/$name.err ]]; then
+	echo -e "${RED}$name: wish reported errors${NONE}" >&2
+	cat $workdir/$name.err >&2
+	exit 1
+    fi
+
+    local median_rank=$(( (bursts + 1) / 2 ))
+    local p99_rank=$(( (bursts * 99 + 99) / 100 ))
+    local median=$(sort -n $samples | sed -n "${median_rank}p")
+    local p99=$(sort -n $samples | sed -n "${p99_rank}p")
+    echo "$name $median $p99 16"
+}
+
+# startup_report
+#   medians of the shell's own -s reports of the last startup run
+startup_report () {
+    local report=$workdir/startup.err
+    local rank=$(( ($(wc -l < $report) + 1) / 2 ))
+    local first=$(sed 's/.*first command \([0-9-]*\) us.*/\1/' $report | sort -n | sed -n "${rank}p")
+    local rss=$(sed 's/.*max rss \([0-9]*\) KB.*/\1/' $report | sort -n | sed -n "${rank}p")
+    local faults=$(sed 's/.*minor faults \([0-9]*\)$/\1/' $report | sort -n | sed -n "${rank}p")
+    echo "startup: first command ${first}us, max rss ${rss}KB, minor faults ${faults} (medians of -s)"
+}
+
+# report results baseline
+#   prints the results and, if a baseline is given, the change of the medians against it
+report () {
+    local results=$1
+    local baseline=$2
+
+    printf "%-12s %12s %12s %12s %10s\n" "benchmark" "median(us)" "p99(us)" "cmds/s" "vs base"
+    local name median p99 commands
+    while read name median p99 commands; do
+	local rate=$(( commands * 1000000 / (median > 0 ? median : 1) ))
+	local change=""
+	if [[ -n $baseline ]]; then
+	    local base=$(grep "^$name " $baseline | cut -d ' ' -f 2)
+	    if [[ -n $base ]] && (( base > 0 )); then
+		local percent=$(( (median - base) * 100 / base ))
+		if (( percent > 5 )); then
+		    change="${RED}+$percent%${NONE}"
+		elif (( percent < -5 )); then
+		    change="${GREEN}$percent%${NONE}"
+		else
+		    change="$percent%"
+		fi
+	    fi
+	fi
+	printf "%-12s %12s %12s %12s " $name $median $p99 $rate
+	echo -e "$change"
+    done < $results
+}
+
+# usage: call when args not parsed, or when help needed
+usage () {
+    echo "usage: run-benchmarks.sh [-h] [-r runs] [-n size] [-b benchmark] [-o options] [-s file] [-c file]"
+    echo "  -h                help message"
+    echo "  -r runs           repetitions of each benchmark (default 11)"
+    echo "  -n size           commands per workload (default 2000)"
+    echo "  -b benchmark      run only the named benchmark"
+    echo "  -o options        wish launch options, e.g. -o \"-e spawn\""
+    echo "  -s file           save the results as a baseline"
+    echo "  -c file           compare the medians against a saved baseline"
+    return 0
+}
+
+#
+# main program
+#
+runs=11
+size=2000
+only=""
+wishopts=""
+savefile=""
+comparefile=""
+
+while getopts "hr:n:b:o:s:c:" option; do
+    case "$option" in
+    h)
+	usage
+	exit 0;;
+    r)
+	runs=$OPTARG;;
+    n)
+	size=$OPTARG;;
+    b)
+	only=$OPTARG;;
+    o)
+	wishopts=$OPTARG;;
+    s)
+	savefile=$OPTARG;;
+    c)
+	comparefile=$OPTARG
+	if [[ ! -f $comparefile ]]; then
+	    echo "baseline $comparefile does not exist" >&2; exit 1
+	fi;;
+    *)
+	usage; exit 1;;
+    esac
+done
+
+number='^[1-9][0-9]*$'
+if ! [[ $runs =~ $number ]] || ! [[ $size =~ $number ]]; then
+    usage
+    echo "-r and -n must be followed by a positive number" >&2; exit 1
+fi
+
+workdir=$(mktemp -d)
+trap "rm -rf $workdir" EXIT
+make_workloads $workdir $size
+
+results=$workdir/results
+: > $results
+for name in true builtin fanout100 fanout500 redirect pipeline output glob parse startup runner server burst; do
+    if [[ -n $only ]] && [[ $only != $name ]]; then
+	continue
+    fi
+    if [[ $name == startup ]]; then
+	run_startup startup $workdir/startup.in $runs >> $results
+    elif [[ $name == runner || $name == server ]] && ! command -v python3 > /dev/null; then
+	echo "$name: skipped, the job runner needs python3" >&2
+    elif [[ $name == runner ]]; then
+	run_runner runner $workdir/startup.in $runs >> $results
+    elif [[ $name == server ]]; then
+	# the same jobs as runner, sent to a server started once with the options
+	./wish $wishopts -D $workdir/wish.sock &
+	server=$!
+	if ! timeout 5 bash -c "while ! [[ -S $workdir/wish.sock ]]; do sleep 0.01; done"; then
+	    echo "the server did not listen on $workdir/wish.sock within 5 seconds" >&2
+	    kill $server 2> /dev/null
+	    continue
+	fi
+	run_runner server $workdir/startup.in $runs $workdir/wish.sock >> $results
+	kill $server
+    elif [[ $name == burst ]]; then
+	run_burst burst $runs >> $results
+    else
+	run_benchmark $name $workdir/$name.in $runs >> $results
+    fi
+done
+
+report $results $comparefile
+if [[ -s $workdir/startup.err ]]; then
+    startup_report
+fi
+if [[ -n $savefile ]]; then
+    cp $results $savefile
+    echo "baseline saved to $savefile"
+fi
+exit 0
@@ -0,0 +1,5 @@
+#!/bin/bash
+# prints $1 after sleeping $2 seconds, then $3 without a newline (if given)
+sleep $2
+echo $1
+printf "%s" "$3"
@@ -0,0 +1,4 @@
+#!/bin/bash
+# kills the newest worker parked by the shell that started it after $1 seconds
+sleep $1
+pkill -n -P $PPID -x wish
@@ -0,0 +1,3 @@
+#!/bin/bash
+# prints the cpus a process started by this script may run on, without their numbers
+grep Cpus_allowed_list /proc/self/status | tr -d "0-9"
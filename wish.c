@@ -1,7 +1,10 @@
 // Author: Paulo Batitay
 // A shell with three built-in commands (cd, path, exit)
 // Other programs if not built-in are fetched from /bin or user specified path
-// Forks and pipes were implemented to run each command requested by the user
+// Built-in commands run inside the shell process, other programs are forked
+// Programs can be connected with pipes (|) and ran in parallel (&)
+
+#define _GNU_SOURCE                 // pipe2 and F_SETPIPE_SZ
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -11,117 +14,977 @@
 #include <sys/types.h>
 #include <fcntl.h>
 #include <ctype.h>
+#include <errno.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <limits.h>
+#include <stddef.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/file.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <sys/epoll.h>
+#include <sched.h>
 
 // shell modes
 #define INTERACTIVE_MODE      0      // user writes commands into shell
 #define BATCH_MODE            1      // user specifies files with commands
 
-// child messages to parent processes
-#define MESSAGE_TYPE_CD       1       // cd-specific messages via pipe
-#define MESSAGE_TYPE_PATH     2       // path-specific messages via pipe
+// launch engines for external programs (-e fork|spawn)
+#define LAUNCH_ENGINE_FORK    0      // fork, redirect and execv in the child
+#define LAUNCH_ENGINE_SPAWN   1      // posix_spawn with redirections prepared by the shell
+
+// output of the pipelines of a parallel line (-o group|tag)
+#define OUTPUT_DIRECT         0      // every pipeline writes to stdout itself
+#define OUTPUT_GROUP          1      // the output of each pipeline in one piece, in launch order
+#define OUTPUT_TAG            2      // lines as they come, each after the position of its pipeline
+
+// built-in command results
+#define BUILTIN_DONE          0       // built-in ran (or reported its own error)
+#define BUILTIN_EXIT_REQUEST  1       // user asked the shell to exit
+
+// fast built-in results besides exit statuses
+#define FAST_BUILTIN_DECLINED -1      // arguments only the program handles; it runs instead
+#define FAST_BUILTIN_SYSTEM_ERROR -2  // a file could not be opened or an fd not be swapped
+
+// backslash escapes of the fast built-ins
+#define ESCAPE_ECHO           0       // echo -e: octal as \0NNN or \NNN, unknown escapes are kept
+#define ESCAPE_FORMAT         1       // printf format: octal as \NNN
+#define ESCAPE_ARGUMENT       2       // printf %b: octal as \0NNN or \NNN
+
+// records of a precompiled script (-C)
+#define COMPILED_MAGIC        "wishc\0\0\0"  // first bytes of the file
+#define COMPILED_VERSION      3       // layout of the records; a file of another version is compiled again
+#define COMPILED_RECORD       5       // words every record starts with: kind, size in words, then the offset
+                                      // (low and high word) and length of its line in the script
+#define COMPILED_TEXT         0       // line kept as text, parsed when it runs
+#define COMPILED_PARSED       1       // parsed line: background flag, then its pipelines
+#define COMPILED_NONE         0xffffffffu   // string offset of a file that is not given
+
+// command line tokens
+#define TOKEN_END             0       // end of the line
+#define TOKEN_WORD            1       // program name, argument or file name
+#define TOKEN_PARALLEL        2       // '&'
+#define TOKEN_PIPE            3       // '|'
+#define TOKEN_REDIRECT        4       // '>'
+#define TOKEN_APPEND          5       // '>>'
+#define TOKEN_INPUT           6       // '<'
+#define TOKEN_ERROR           7       // '2>'
+#define TOKEN_ERROR_APPEND    8       // '2>>'
+#define TOKEN_ERROR_TO_OUTPUT 9       // '2>&1'
+#define TOKEN_ALL_OUTPUT      10      // '&>'
+
+// trace phases (-T or WISH_TRACE)
+#define TRACE_PARSE           0       // parsing a line
+#define TRACE_RESOLVE         1       // looking the programs of a pipeline up in the shell path
+#define TRACE_PIPE            2       // creating a pipe between two stages
+#define TRACE_FORK            3       // fork in the shell
+#define TRACE_SPAWN           4       // posix_spawn in the shell
+#define TRACE_CHILD           5       // forked child redirecting its fds until it calls execv
+#define TRACE_WAIT            6       // shell blocked waiting for a child
+#define TRACE_REAP            7       // accounting for a reaped child
+#define TRACE_RUN             8       // child from its launch until it was reaped
+#define TRACE_DISPATCH        9       // handing a command to a parked worker (-w)
+#define TRACE_BUILTIN         10      // fast built-in running in the shell
+#define TRACE_GLOB            11      // reading a directory to expand a pattern
+
+// background job states
+#define JOB_RUNNING           0
+#define JOB_STOPPED           1
+#define JOB_DONE              2
+
+// what a request to a parked worker carries besides the arguments (see worker_request)
+#define WORKER_FD_INPUT       1       // fd for stdin passed along
+#define WORKER_FD_OUTPUT      2       // fd for stdout passed along
+#define WORKER_FD_ERROR       4       // fd for stderr passed along
+#define WORKER_FD_DIRECTORY   8       // the shell's working directory passed along (it changed since the fork)
+#define WORKER_ERROR_TO_OUTPUT 16     // stderr goes wherever stdout goes
+#define WORKER_UNAVAILABLE    2       // no parked worker took the command, the engine launches it
+
+// keys of the line editor besides plain bytes
+#define EDITOR_KEY_NONE       -2      // no key is pending
+#define EDITOR_KEY_EOF        -1      // end of input
+#define EDITOR_KEY_UP         256
+#define EDITOR_KEY_DOWN       257
+#define EDITOR_KEY_LEFT       258
+#define EDITOR_KEY_RIGHT      259
+#define EDITOR_KEY_HOME       260
+#define EDITOR_KEY_END        261
+#define EDITOR_KEY_DELETE     262
+#define EDITOR_KEY_WORD_LEFT  263     // Alt-b, Ctrl-Left
+#define EDITOR_KEY_WORD_RIGHT 264     // Alt-f, Ctrl-Right
 
 // child exit types
-#define CHILD_EXIT_REQUEST    20 
 #define CHILD_SYSTEM_ERROR    21 
 
 // global definitions
-#define MAX_PARALLEL_COMMANDS 100   // max amount possible to execute parallel commands (&)
+#define JOB_TABLE_INIT_SIZE   16    // initial capacity of the table of children started by a line
+#define CMD_HASH_BUCKETS      64    // buckets of the program name -> executable path table
+#define VARIABLE_BUCKETS      256   // buckets of the variable table
+#define GLOB_BUCKETS          64    // buckets of the directory listing cache of patterns
+#define GLOB_RACY_SECONDS     0.05  // a listing taken closer than this to the directory's mtime is read again (-G)
+#define COMPILED_RACY_SECONDS 1.0   // a script compiled sooner than this after its last change is also checked by content (-C)
+#define ARENA_BLOCK_SIZE      4096  // default size of an arena block
+#define BATCH_BUFFER_SIZE     16384 // read buffer for input that cannot be mapped (grows for longer lines)
+#define JOB_COMMAND_SIZE      128   // command text kept per child for the stats log
+#define STATS_BUCKETS         40    // log2 buckets of the stats histograms
+#define TRACE_RING_SIZE       16384 // events the trace ring holds before the shell flushes it
+#define TRACE_DETAIL_SIZE     24    // program name kept per trace event
+#define WORKER_POOL_MAX       256   // largest pool of parked workers (-w)
+#define WORKER_MESSAGE_SIZE   65536 // executable path and arguments a worker request can carry
+#define SERVER_MESSAGE_SIZE   65536 // script and environment a client request can carry (-c)
+#define CACHE_COPY_SIZE       65536 // chunk in which cached output is copied
+#define OUTPUT_MOVE_SIZE      65536 // most output moved from a capture pipe at a time (-o)
+#define OUTPUT_EVENTS         16    // epoll events taken at once while draining the capture pipes
+#define OUTPUT_SIGCHLD        0xffffffffu   // epoll data of the SIGCHLD self-pipe (the others are capture indexes)
+#define OUTPUT_CAPTURES_INIT_SIZE 16    // initial capacity of the captured outputs of a line
+#define EDITOR_OUTPUT_SIZE    8192  // bytes of the line drawn at once by the line editor
+#define EDITOR_QUERY_SIZE     256   // longest history search query (Ctrl-R)
+#define TRIGRAM_TABLE_INIT_SIZE 4096    // initial slots of the history search index
+#define HISTORY_INDEX_CHUNK   1024  // entries indexed at a time while the prompt is idle
+#define HISTORY_SIZE          100000    // lines the history file keeps unless $WISH_HISTORY_SIZE says otherwise
+#define BUILTIN_OUTPUT_SIZE   4096  // output of a fast built-in written at once
+#define PRINTF_SPEC_SIZE      32    // printf directive rebuilt for snprintf
+#define PRINTF_WIDTH_MAX      4096  // widest field (and precision) printf formats in the shell
+
+// remembered location of a program found in the shell path (see "hash" built-in)
+struct cmd_hash_entry
+{
+    char *name;                     // program name as typed by the user
+    char *path;                     // resolved executable path
+    int hits;                       // times the entry was used to run the program
+    struct cmd_hash_entry *next;    // next entry in the same bucket
+};
+
+// shell variable, kept as "NAME=value" so that an exported one goes into the environment as is;
+// variables of the environment are looked up there the first time they are used
+struct variable
+{
+    char *text;                     // "NAME=value" (malloc'd), only "NAME" while the variable is not set
+    size_t name_length;
+    char exported;                  // passed to the programs the shell starts
+    struct variable *next;          // next entry in the same bucket
+};
+
+// block of an arena; allocations are carved from data in order
+struct arena_block
+{
+    struct arena_block *next;       // previously filled block
+    size_t size;                    // usable bytes of data
+    size_t used;                    // bytes of data handed out
+    char preallocated;              // block is static storage of the shell and is never freed
+    _Alignas(max_align_t) char data[];  // aligned for any allocation, whatever the header fields
+};
+
+// bump allocator: everything allocated from it is released at once when it is reset
+struct arena
+{
+    struct arena_block *blocks;     // block being filled first
+};
+
+// static room for the first block of an arena
+union arena_storage
+{
+    max_align_t align;
+    char bytes[sizeof(struct arena_block) + ARENA_BLOCK_SIZE];
+};
+
+// sorted names of a directory, read once to expand the patterns of a line (or of many lines, -G)
+struct glob_dir
+{
+    char *path;                     // as the pattern gives it, "." for the working directory
+    dev_t device;                   // of the directory when it was read
+    ino_t inode;
+    struct timespec mtime;
+    struct timespec scan_time;      // when it was read (realtime clock, as mtime)
+    char scanned;                   // names hold a listing that can be used again
+    char **names;                   // sorted, without "." and ".."
+    int count;
+    int capacity;
+    struct arena arena;             // names, released when the directory is read again
+    struct glob_dir *next;          // next entry in the same bucket
+};
+
+// buffered output of a fast built-in, written to the shell's (redirected) stdout
+struct builtin_output
+{
+    size_t used;                    // bytes of data not written yet
+    int error;                      // errno of a failed write, 0 while writing works
+    char data[BUILTIN_OUTPUT_SIZE];
+};
+
+// program that also runs in the shell itself when a pipeline is only that program (see -X)
+// run returns the exit status, or FAST_BUILTIN_DECLINED to have the program run instead
+struct fast_builtin
+{
+    const char *name;
+    int (*run)(int argc, char **args, struct builtin_output *output);
+};
+
+// one command (stage of a pipeline) of a parsed line
+struct command
+{
+    char **args;                    // NULL terminated program arguments
+    int argc;                       // amount of arguments (incl. program name)
+    int args_capacity;              // allocated length of args
+    char *output_file;              // file of '>', '>>' or '&>' (NULL if stdout is not redirected)
+    char *input_file;               // file of '<' (NULL if stdin is not redirected)
+    char *error_file;               // file of '2>' or '2>>' (NULL if stderr is not redirected)
+    char output_append;             // '>>': output_file is appended to instead of truncated
+    char error_append;              // '2>>'
+    char error_to_output;           // '2>&1' or '&>': stderr goes wherever stdout goes
+    char error_before_output;       // '2>&1' came before '>' or '>>': stderr goes where stdout went before its file
+    int output_fd;                  // output_file opened once by the shell for the whole line (-a), -1 otherwise
+    int error_fd;                   // same for error_file
+    char *executable_path;          // program resolved from the shell path when it is launched
+    char **assignments;             // "NAME=value" words in front of the program, for its environment only
+    int num_assignments;
+    int assignments_capacity;
+    char **environment;             // environment of the program if it has assignments (NULL keeps the shell's)
+};
+
+// commands connected with '|'; a malformed pipeline is reported when it would have run
+struct pipeline
+{
+    struct command *commands;       // stages in order
+    int count;                      // amount of stages
+    int capacity;                   // allocated length of commands
+    char malformed;                 // syntax error somewhere in the pipeline
+    char timed;                     // "time" prefix: report the cost of the pipeline once it finishes
+    char cached;                    // "cache" prefix: replay the output of an earlier identical run
+    char **cache_inputs;            // files declared with "cache -i" that the output depends on
+    int num_cache_inputs;
+    int cache_inputs_capacity;
+};
+
+// output file opened by the shell and shared by every command of a line writing to it (-a)
+struct shared_output
+{
+    char *file;
+    int fd;
+};
+
+// a parsed command line: pipelines separated by '&' that run in parallel
+struct command_line
+{
+    struct pipeline *pipelines;     // pipelines in order
+    int count;                      // amount of pipelines
+    int capacity;                   // allocated length of pipelines
+    struct shared_output *outputs;  // output files opened for the line (-a)
+    int num_outputs;
+    int outputs_capacity;
+    char background;                // the line ends with '&': it runs as a background job
+    char dynamic;                   // words depend on variables or files ($, patterns), so the line cannot be precompiled
+};
+
+// batch file mapped into memory; lines are handed out as views into the mapping instead of copies
+struct batch_file
+{
+    char *data;                     // read-only mapping of the file (NULL if not mapped)
+    size_t size;                    // length of the mapping
+    size_t offset;                  // start of the next line in data
+    int fd;                         // input that cannot be mapped (pipes, terminals, ...), -1 if none
+    char *buffer;                   // its reusable read buffer: batch_buffer, or a heap copy once a line did not fit
+    size_t buffer_size;             // capacity of buffer
+    size_t start;                   // unread input is buffer[start, end)
+    size_t end;
+    char *compiled;                 // mapping of the precompiled script (-C), NULL if lines are parsed from the text
+    size_t compiled_size;
+    unsigned int *words;            // its records, read in order
+    size_t num_words;
+    size_t word;                    // next word of the records (beyond num_words if they are damaged)
+    size_t record_end;              // first word of the record after the one being read
+    char *strings;                  // NUL terminated words and files the records refer to by offset
+    size_t strings_size;
+};
+
+// first bytes of a precompiled script, which tell the script it was made from; the records and
+// strings follow
+struct compiled_header
+{
+    char magic[8];
+    unsigned int version;
+    unsigned int verify;            // the content hash has to match too
+    unsigned long long script_size;
+    long long mtime_sec;
+    long long mtime_nsec;
+    unsigned long long inode;
+    unsigned long long hash;        // cache_key of the script
+    unsigned long long num_words;
+    unsigned long long strings_size;
+};
+
+// precompiled script being written
+struct compiled_writer
+{
+    unsigned int *words;
+    size_t num_words;
+    size_t words_capacity;
+    char *strings;
+    size_t strings_size;
+    size_t strings_capacity;
+};
+
+// a running child and what is needed to account for it once it is reaped
+struct job
+{
+    pid_t pid;
+    int job_id;                     // background job the child belongs to (0 for a foreground line)
+    struct timespec start;          // launch time, for the wall time of the child
+    int timer;                      // pipeline timer of a "time" pipeline (-1 if not timed)
+    int cache_fill;                 // cache fill the child's stdout is captured for (-1 if none)
+    char command[JOB_COMMAND_SIZE]; // program and arguments (truncated) for the stats log
+};
+
+// pipeline run with the "time" prefix; reported once all of its stages have been reaped
+struct pipeline_timer
+{
+    struct timespec start;          // launch time of the pipeline
+    double user;                    // cpu seconds of the reaped stages
+    double sys;
+    int running;                    // stages still running, 0 if the timer is free
+};
+
+// output of a "cache" pipeline captured until its last stage is reaped, then stored in the cache
+struct cache_fill
+{
+    char *material;                 // what the output depends on (see cache_material), NULL if the fill is free
+    size_t material_length;
+    unsigned long long key;         // hash of material, names the entry in the cache directory
+    int capture_fd;                 // memfd the last stage writes its stdout to
+    int output_fd;                  // where the output goes once it has been captured
+};
+
+// stdout of a pipeline of a parallel line, collected by the shell (-o)
+struct output_capture
+{
+    int fd;                         // read end of the pipe the last stage writes to, -1 once it ended
+    int held_fd;                    // memfd holding the output of a pipeline whose turn has not come (group), -1 if none
+    int number;                     // position of the pipeline in the line (from 1)
+    char *partial;                  // unfinished last line read so far (tag)
+    size_t partial_length;
+    size_t partial_capacity;
+};
+
+// line run in the background (trailing '&'); its children share a process group
+struct background_job
+{
+    int id;                         // job number used by jobs, wait, fg and bg (%id)
+    pid_t pgid;                     // process group of the children (0 until the first one starts)
+    pid_t last_pid;                 // last child started; its exit status is the job's status
+    int running;                    // children not reaped yet
+    int status;                     // exit status of last_pid once it was reaped
+    char state;                     // JOB_RUNNING, JOB_STOPPED or JOB_DONE
+    char command[JOB_COMMAND_SIZE]; // the line as it was parsed, for jobs
+};
+
+// running children of the shell; grows as needed
+struct job_table
+{
+    struct job *children;           // running children (in no particular order)
+    int count;                      // amount of running children
+    int capacity;                   // allocated length of children
+    char child_system_error;        // a reaped child hit a system error
+    struct pipeline_timer *timers;  // timers of "time" pipelines still running
+    int num_timers;                 // allocated length of timers
+    struct cache_fill *fills;       // outputs of "cache" pipelines still running
+    int num_fills;                  // allocated length of fills
+    int foreground;                 // children of foreground lines (a line waits for these)
+    struct background_job *background;  // background jobs in the order they were started
+    int num_background;
+    int background_capacity;
+    int launch_job;                 // background job the line being run starts its children in (0 if none)
+    int terminal_job;               // job holding the terminal (job control), 0 while the shell has it
+    pid_t status_pid;               // last child started by the line being run (0 if none), its exit status becomes $?
+    struct output_capture *captures;    // outputs of the line being run in launch order (-o)
+    int num_captures;
+    int captures_capacity;
+    int captures_open;              // captures whose pipe has not ended yet
+    int capture_head;               // first capture not completely written out yet (group)
+    int line_pipeline;              // pipeline of the line being launched (from 0)
+    int line_pipelines;             // pipelines of the line being launched
+    char line_background;           // the line being launched ends with '&'
+    char capturing;                 // the outputs of the line being run are collected by the shell
+};
+
+// resources used by the children the shell has reaped (see "stats" built-in)
+struct command_stats
+{
+    long commands;                  // reaped children
+    double real;                    // total wall, user and system seconds
+    double user;
+    double sys;
+    long max_rss;                   // largest resident set of a child (KB)
+    long voluntary_switches;        // total context switches
+    long involuntary_switches;
+    long wall_histogram[STATS_BUCKETS];     // children per log2 bucket of their wall time (us)
+    long rss_histogram[STATS_BUCKETS];      // children per log2 bucket of their max rss (KB)
+};
+
+// timestamped phase of running commands, see trace_record
+struct trace_event
+{
+    unsigned long sequence;         // index + 1 of the event once it is completely written
+    unsigned long long start;       // monotonic clock (ns)
+    unsigned long long end;
+    int phase;                      // TRACE_*
+    pid_t tid;                      // process the phase ran in
+    char detail[TRACE_DETAIL_SIZE]; // program the phase was for (may be empty)
+};
+
+// ring of trace events shared with the forked children; writers claim slots with an atomic
+// counter, so the shell and its children record events without any lock
+struct trace_ring
+{
+    unsigned long head;             // slots claimed so far
+    struct trace_event events[TRACE_RING_SIZE];
+};
+
+// child forked ahead of time and parked until a command is dispatched to it (-w)
+struct worker
+{
+    pid_t pid;
+    int socket;                     // shell's end of the socket pair the request is sent on
+    unsigned long directory;        // directory_changes when the worker was forked
+    unsigned long environment;      // environment_changes when the worker was forked
+};
+
+// connection of a client (-c) to the server (-D) and the shell forked to run the script it sent
+struct server_session
+{
+    int socket;                     // server's end of the connection, -1 once the client hung up
+    pid_t pid;                      // shell running the script, 0 while the request has not arrived
+};
+
+// header of a request to a parked worker; the executable path, the arguments and the environment
+// (if any) follow it as NUL terminated strings and the fds travel as SCM_RIGHTS
+struct worker_request
+{
+    pid_t pgid;                     // process group to join (0 starts one, -1 stays in the shell's)
+    int cpu;                        // cpu to pin the program to (-k), -1 leaves it where it is
+    int flags;                      // WORKER_* of what was passed along
+    int argc;
+    int envc;                       // environment strings, 0 keeps the environment the worker was forked with
+};
+
+// entries of the history containing a trigram, in ascending order
+struct trigram_list
+{
+    unsigned int trigram;           // three bytes of an entry, 0 marks a free slot (entries hold no NUL)
+    int count;
+    int capacity;
+    int *entries;
+};
+
+// lines read by the line editor, oldest first; the entries live in history_arena
+struct history
+{
+    char **entries;
+    int count;
+    int capacity;
+    int fd;                         // history file new lines are appended to, -1 if history is not saved
+    struct trigram_list *trigrams;  // open-addressing table of the search index, built on the first search
+    int num_trigrams;               // used slots of trigrams
+    int trigrams_capacity;          // allocated length of trigrams (a power of two)
+    int indexed;                    // entries added to the search index so far
+    char index_failed;              // allocation failed, searches scan the entries instead
+};
+
+// executables of a directory of the shell path, for tab completion; kept while the directory
+// stays in the path and scanned again only once its mtime changes
+struct completion_dir
+{
+    char *path;
+    struct timespec mtime;          // mtime of the directory when it was scanned
+    char scanned;
+    char **names;                   // sorted program names
+    int count;
+    int capacity;
+    struct arena arena;             // names, released when the directory is scanned again or leaves the path
+};
+
+// line being edited; it lives in the shell's command buffer so no copy is made once it is read
+struct line_editor
+{
+    char **line;                    // command buffer (getline style)
+    size_t *size;                   // allocated length of the command buffer
+    size_t length;
+    size_t cursor;                  // byte offset of the cursor in the line
+    const char *prompt;
+    int history_position;           // history entry shown (history.count for the line being typed)
+    char *pending;                  // the line being typed while older entries are shown (malloc'd)
+    char completed;                 // the previous key was a tab, a second one lists the candidates
+};
 
 // global vars
 const char ERROR_MESSAGE[30] = "An error has occurred\n";
 char *INIT_SHELL_PATH = "/bin";
+struct cmd_hash_entry *cmd_hash_table[CMD_HASH_BUCKETS];     // lives in the shell process only
+struct variable *variable_table[VARIABLE_BUCKETS];          // lives in the shell process only
+unsigned long environment_changes = 0;  // changes to exported variables; workers forked before the last one are sent the environment
+int last_status = 0;                // exit status of the last line ($?)
+struct arena path_arena = { NULL };     // shell path entries, released when the path changes
+struct arena hash_arena = { NULL };     // command hash entries, released when the table is cleared
+union arena_storage path_arena_storage, hash_arena_storage, line_arena_storage;    // first blocks of the arenas
+struct job job_table_storage[JOB_TABLE_INIT_SIZE];  // children of the job table until it outgrows them
+char batch_buffer[BATCH_BUFFER_SIZE];   // read buffer of input that cannot be mapped
+char startup_report = 0;            // time to the first command and the shell's footprint are reported on exit (-s)
+struct timespec startup_time;       // when main was entered
+struct timespec first_command_time; // when the first line started running (zero until then)
+char launch_engine = LAUNCH_ENGINE_FORK;
+int pipe_buffer_size = 0;           // F_SETPIPE_SZ for pipeline pipes (-B), 0 keeps the kernel default
+int max_running_children = 0;       // worker slots of a line (-j), 0 means no cap
+char parallel_batch = 0;            // batch lines share the worker slots instead of running one by one (-P)
+char shared_outputs = 0;            // output files are opened once per line in append mode (-a)
+char fast_builtins = 1;             // echo, printf, test and others run in the shell (turned off by -X)
+struct glob_dir *glob_table[GLOB_BUCKETS];  // directory listings of the patterns, lives in the shell process only
+char persistent_glob_cache = 0;     // listings are kept across lines while their directory does not change (-G)
+char compiled_scripts = 0;          // batch files run from a precompiled form written next to them (-C)
+char output_mode = OUTPUT_DIRECT;   // how the outputs of the pipelines of a parallel line are written (-o)
+int output_epoll = -1;              // epoll instance of the capture pipes and the SIGCHLD self-pipe, -1 until needed
+char output_splice = 1;             // stdout takes splices; cleared once it refused one
+struct sigaction output_sigpipe;    // SIGPIPE disposition put back once the shell wrote captured output
+char pin_children = 0;              // children are pinned to the cpus the shell may use in turn (-k)
+cpu_set_t pin_cpus;                 // cpus the shell could run on when it started
+int pin_next = -1;                  // cpu the last child was pinned to
+struct worker worker_pool[WORKER_POOL_MAX];   // parked workers, lives in the shell process only
+int worker_pool_size = 0;           // workers kept parked (-w), 0 if there is no pool
+char worker_refill_while_running = 0;   // workers are also forked while a line's children run (more than one online cpu)
+int num_workers = 0;                // workers parked right now
+unsigned long directory_changes = 0;    // successful cd's; workers forked before the last one are told to follow it
+char *server_socket = NULL;         // socket the shell serves scripts on (-D)
+char *client_socket = NULL;         // socket of the server a client hands its script to (-c)
+int server_lookup_fd = -1;          // in a server's shell: pipe the programs it looked up are reported on
+char cache_dir[PATH_MAX] = "";     // result cache directory, created on first use
+char line_editor = 0;               // lines are read by the line editor (interactive shell, terminal on stdin and stdout)
+struct termios editor_termios;      // terminal settings the lines run with
+struct history history = { NULL, 0, 0, -1, NULL, 0, 0, 0, 0 };   // lives in the shell process only
+struct arena history_arena = { NULL };  // history entries, released when the shell exits
+struct completion_dir *completion_dirs = NULL;  // one per directory of the shell path (tab completion)
+int num_completion_dirs = 0;
+char job_control = 0;               // interactive shell on a terminal: jobs are reported and can be moved to the terminal
+int sigchld_pipe[2] = { -1, -1 };   // self-pipe written by the SIGCHLD handler
+volatile sig_atomic_t sigchld_pending = 0;  // a child changed state since the last poll
+int stats_log_fd = -1;              // JSON lines log of every reaped child (-l), -1 if not logging
+struct command_stats shell_stats;   // lives in the shell process only
+struct trace_ring *trace_ring = NULL;       // shared mapping, NULL if not tracing
+int trace_fd = -1;                  // chrome trace-event JSON output (-T or WISH_TRACE)
+unsigned long trace_flushed = 0;    // events of the ring already written to the trace
+unsigned long long trace_base = 0;  // monotonic clock when tracing started (ns)
+pid_t trace_shell_pid = 0;
+char trace_in_child = 0;            // set in forked children, which only record events
+const char *BUILTIN_COMMANDS[] = { "exit", "cd", "path", "hash", "stats", "jobs", "wait", "fg", "bg", "export", NULL };
+const char *TRACE_PHASE_NAMES[] = { "parse", "resolve", "pipe", "fork", "spawn", "child", "wait", "reap", "run", "dispatch", "builtin", "glob" };
+extern char **environ;
 
 // ---------------------
 // Function Declarations
 // ---------------------
 // helper function declarations
-void check_shell_mode(int args, char *shell_mode);
-void open_batch_file(FILE **fp, char *file);
-void modify_path(char *buffer, char ***shell_path, int *num_path);
-void remove_lead_and_trailing_whitespaces(char **buffer);
-void check_child_message_and_close_pipes(int command_count, int pipes[][2], char **buffer, char ***shell_path, int *num_path);
+int check_shell_mode(int argc, char *argv[], char *shell_mode);
+void open_batch_file(struct batch_file *batch, char *file);
+char read_batch_line(struct batch_file *batch, char **line, size_t *line_length);
+char read_buffered_line(struct batch_file *batch, char **line, size_t *line_length);
+void open_compiled_script(struct batch_file *batch, const char *file);
+char compiled_load(struct batch_file *batch, const char *path, const struct stat *script);
+char compiled_check(struct batch_file *batch);
+char compiled_check_strings(struct batch_file *batch, size_t end);
+char compile_script(struct batch_file *batch, const char *path, const struct stat *script);
+char compiled_add_line(struct compiled_writer *out, struct command_line *parsed, size_t offset, size_t length);
+char compiled_put_word(struct compiled_writer *out, unsigned int word);
+char compiled_put_string(struct compiled_writer *out, const char *string);
+char read_compiled_line(struct batch_file *batch, char **line, size_t *line_length, char *parsed);
+struct command_line *compiled_inflate(struct batch_file *batch, struct arena *arena);
+unsigned int compiled_get_word(struct batch_file *batch);
+char *compiled_get_string(struct batch_file *batch);
+char **compiled_get_strings(struct batch_file *batch, struct arena *arena, int *count);
+void modify_path(char **paths, int count, char ***shell_path, int *num_path);
 char check_builtin_cmd(char *buffer);
-void run_builtin_cmd(char **buffer, int child_to_parent[2], char ***shell_path, int *num_path);
-void run_extern_cmd(char **buffer, char ***shell_path, int *num_path);
+char check_line_barrier(struct command_line *parsed);
+char run_builtin_cmd(struct command *cmd, struct job_table *jobs, char ***shell_path, int *num_path);
+void builtin_error(void);
+void run_extern_cmd(struct command *cmd, int in_fd, int out_fd, char ***shell_path, int *num_path, struct arena *line_arena);
+void child_system_error(struct arena *line_arena, char ***shell_path, int *num_path);
+char spawn_extern_cmd(struct command *cmd, int in_fd, int out_fd, pid_t pgid, pid_t *child);
+pid_t launch_extern_cmd(struct command *cmd, int in_fd, int out_fd, pid_t pgid, char ***shell_path, int *num_path, struct batch_file *batch, struct arena *line_arena);
+
+// parser function declarations
+int next_token(const char **cursor, const char *end, const char **word, size_t *word_length);
+struct command_line *parse_command_line(const char *line, size_t length, struct arena *arena);
+struct pipeline *command_line_add_pipeline(struct command_line *parsed, struct arena *arena);
+struct command *pipeline_add_command(struct pipeline *pipeline, struct arena *arena);
+char command_add_arg(struct command *cmd, struct arena *arena, const char *word, size_t length);
+char command_redirected(struct command *cmd);
+
+// redirection function declarations
+int output_flags(char append);
+char redirect_file(const char *file, int flags, int target_fd);
+char open_shared_outputs(struct command_line *parsed, struct arena *arena);
+int shared_output_fd(struct command_line *parsed, struct arena *arena, char *file, char append);
+void close_shared_outputs(struct command_line *parsed);
+int open_command_files(struct command *cmd, int files[3]);
+char command_opens_fifo(struct command *cmd);
+void close_command_files(struct command *cmd, int files[3]);
+
+// command hash function declarations
+unsigned long hash_string(const char *str);
+char *cmd_hash_lookup(char *program_name, char ***shell_path, int *num_path, char used);
+void cmd_hash_print(void);
+void cmd_hash_clear(void);
+
+// variable function declarations
+unsigned long hash_name(const char *name, size_t length);
+size_t variable_name_length(const char *text, size_t length);
+struct variable *variable_find(const char *name, size_t length);
+char variable_set(const char *name, size_t name_length, const char *value, size_t value_length, char export);
+size_t expand_word_into(const char *word, size_t length, char *out);
+char *expand_word(struct arena *arena, const char *word, size_t *length);
+char **command_environment(struct command *cmd, struct arena *arena);
+
+// pattern function declarations
+char glob_pattern(const char *word, size_t length);
+char command_add_glob(struct command *cmd, struct arena *arena, const char *word, size_t length);
+char glob_match(struct command *cmd, struct arena *arena, const char *pattern, char *path, size_t path_length);
+char glob_match_next(struct command *cmd, struct arena *arena, const char *rest, char *path, size_t path_length, char listed);
+struct glob_dir *glob_listing(const char *path);
+void glob_cache_clear(void);
+
+// fast built-in function declarations
+const struct fast_builtin *fast_builtin_find(const char *name);
+int fast_builtin_run(const struct fast_builtin *builtin, struct command *cmd);
+void builtin_write(struct builtin_output *output, const char *text, size_t length);
+char builtin_flush(struct builtin_output *output);
+char builtin_asks_help(int argc, char **args);
+int builtin_escape(const char *text, char mode, struct builtin_output *output);
+int builtin_write_escaped(struct builtin_output *output, const char *text, char mode);
+int builtin_echo(int argc, char **args, struct builtin_output *output);
+int builtin_true(int argc, char **args, struct builtin_output *output);
+int builtin_false(int argc, char **args, struct builtin_output *output);
+int builtin_pwd(int argc, char **args, struct builtin_output *output);
+int builtin_printf(int argc, char **args, struct builtin_output *output);
+char printf_integer(const char *text, long long *value);
+int printf_directive(char *spec, size_t spec_length, const int *stars, int num_stars, char conversion, const char *argument, char *text, size_t size);
+int printf_format(int argc, char **args, struct builtin_output *output);
+int builtin_test(int argc, char **args, struct builtin_output *output);
+int test_expression(int count, char **args);
+int test_unary(const char *operator, const char *operand);
+int test_binary(const char *left, const char *operator, const char *right);
+char test_integer(const char *text, long long *value);
 
 // processes function declarations
-void cmd_process(char **buffer, int *count, int pipes[][2], pid_t children[], char ***shell_path, int *num_path, FILE **fp);
-void cmd_parse_processes(char **buffer, char ***shell_path, int *num_path, FILE **fp);
+char cmd_process(struct pipeline *pipeline, struct job_table *jobs, char ***shell_path, int *num_path, struct batch_file *batch, struct arena *line_arena);
+void cmd_run_processes(struct command_line *parsed, char **buffer, struct job_table *jobs, char wait_for_line, char ***shell_path, int *num_path, struct batch_file *batch, struct arena *line_arena);
+
+// job table function declarations
+char job_table_reserve(struct job_table *jobs, int needed);
+char job_table_reap_any(struct job_table *jobs, int options);
+void job_table_wait_for_slots(struct job_table *jobs, int needed);
+int job_table_start_timer(struct job_table *jobs);
+void job_table_add(struct job_table *jobs, pid_t child, struct command *cmd, const struct timespec *start, int timer);
+
+// background job function declarations
+void sigchld_handler(int signal_number);
+void install_sigchld_handler(void);
+void job_table_poll(struct job_table *jobs);
+void wait_for_input(struct job_table *jobs);
+int job_table_start_background(struct job_table *jobs, struct command_line *parsed);
+struct background_job *job_table_find_background(struct job_table *jobs, int id);
+struct background_job *job_table_parse_job(struct job_table *jobs, int argc, char **args);
+void job_table_wait_for_job(struct job_table *jobs, int id);
+void job_table_foreground(struct job_table *jobs, struct background_job *job);
+void job_table_print(struct job_table *jobs, struct background_job *job);
+char job_table_notify(struct job_table *jobs, char report);
+void job_table_remove_background(struct job_table *jobs, int index);
+void command_line_text(struct command_line *parsed, char *text, size_t size);
+
+// result cache function declarations
+const char *cache_directory(void);
+char *cache_material(struct pipeline *pipeline, size_t *length);
+unsigned long long cache_key(const char *material, size_t length);
+int cache_output_fd(struct command *cmd);
+char cache_replay(unsigned long long key, const char *material, size_t length, int output_fd, int *status);
+void cache_finish(struct cache_fill *fill, char store, int child_status);
+int job_table_start_fill(struct job_table *jobs);
+char cache_copy(int from_fd, int to_fd, off_t length);
+
+// output capture function declarations
+int output_start(struct job_table *jobs, struct command *cmd);
+void output_drain(struct job_table *jobs, char until_child);
+void output_read(struct job_table *jobs, int index);
+ssize_t output_move(int from_fd, int to_fd);
+void output_close(struct job_table *jobs, struct output_capture *capture);
+void output_end(struct job_table *jobs, int index);
+void output_write_head(struct job_table *jobs);
+void output_tag(struct job_table *jobs, int index, const char *data, size_t length, char end);
+void output_fail(struct job_table *jobs);
+void output_finish(struct job_table *jobs);
+void output_ignore_sigpipe(char ignore);
+int pin_next_cpu(void);
+void pin_to_cpu(int cpu);
+
+// resource accounting function declarations
+double timespec_seconds(const struct timespec *start, const struct timespec *end);
+double timeval_seconds(const struct timeval *time);
+int stats_bucket(long value);
+void stats_record(struct job *job, int child_status, struct rusage *usage, double real);
+void stats_log(struct job *job, int child_status, struct rusage *usage, double real);
+void stats_print(void);
+void stats_print_histogram(const char *title, long *histogram);
+void time_report(double real, double user, double sys);
+void startup_print(void);
+int json_escape(char *out, const char *str);
+
+// tracing function declarations
+void trace_open(const char *file);
+unsigned long long trace_clock(void);
+void trace_record(int phase, unsigned long long start, pid_t tid, const char *detail);
+void trace_flush(char final);
+void trace_finish(void);
+
+// worker pool function declarations
+void worker_pool_refill(struct batch_file *batch, char until_input);
+void worker_main(int socket);
+char worker_dispatch(struct command *cmd, int in_fd, int out_fd, pid_t pgid, int cpu, pid_t *child);
+char worker_send(struct worker *worker, struct command *cmd, int in_fd, int out_fd, int files[3], pid_t pgid, int cpu);
+
+// server function declarations
+char *server_main(char ***shell_path, int *num_path);
+char *server_park_session(struct server_session *parked, struct server_session *sessions, int num_sessions, int listener, int lookups[2], char *message);
+void server_dispatch_session(struct server_session *session, struct server_session *parked, char *message);
+void server_finish_session(struct server_session *session, int status);
+void client_main(const char *file);
+
+// line editor function declarations
+void line_editor_init(char **shell_path, int num_path);
+ssize_t line_editor_read(const char *prompt, char **buffer, size_t *size, struct job_table *jobs);
+int editor_read_key(struct line_editor *editor, struct job_table *jobs);
+int editor_read_byte(int timeout);
+void editor_refresh(struct line_editor *editor);
+size_t editor_columns(const char *text, size_t length);
+size_t editor_next_char(struct line_editor *editor, size_t position, int direction);
+size_t editor_next_word(struct line_editor *editor, size_t position, int direction);
+char editor_insert(struct line_editor *editor, const char *text, size_t length);
+void editor_delete(struct line_editor *editor, size_t from, size_t to);
+char editor_set(struct line_editor *editor, const char *text);
+void editor_history(struct line_editor *editor, int direction);
+int editor_search(struct line_editor *editor, struct job_table *jobs);
+void editor_complete(struct line_editor *editor, char list);
+
+// history function declarations
+void history_load(const char *file, int limit);
+void history_trim(int limit, const char *end, off_t loaded);
+char history_append(char *entry);
+void history_add(const char *line, size_t length);
+int history_search(const char *query, int before);
+char history_update_index(int limit);
+char history_index_entry(int id);
+struct trigram_list *trigram_list_find(unsigned int trigram, char create);
+
+// completion function declarations
+void completion_update_path(char **paths, int count);
+char completion_scan(struct completion_dir *dir);
+char completion_add(struct arena *arena, char ***candidates, int *count, int *capacity, const char *name, size_t length);
+int compare_strings(const void *first, const void *second);
+
+// arena function declarations
+void arena_preallocate(struct arena *arena, union arena_storage *storage);
+void *arena_alloc(struct arena *arena, size_t size);
+void *arena_grow_array(struct arena *arena, void *array, int count, int *capacity, size_t element_size);
+char *arena_strndup(struct arena *arena, const char *str, size_t length);
+void arena_reset(struct arena *arena);
 
 // deallocator function declarations
 void deallocate_string(char **buffer);
 void deallocate_shell_path(char ***shell_path, int *num_path);
-void attempt_close_batch(FILE **fp);
+void deallocate_arena(struct arena *arena);
+void attempt_close_batch(struct batch_file *batch);
+void deallocate_job_table(struct job_table *jobs);
+void deallocate_line_editor(void);
+void deallocate_variable_table(void);
 
 // exit function declarations
-void wait_and_check_child_exit_status(int command_count, pid_t children[], char** buffer, char ***shell_path, int *num_path, FILE **fp);
+void wait_and_check_child_exit_status(struct job_table *jobs, char include_background, char** buffer, char ***shell_path, int *num_path, struct batch_file *batch);
+void exit_shell_request(struct job_table *jobs, char **buffer, char ***shell_path, int *num_path, struct batch_file *batch);
 void system_error(const char *message);
 void shell_error(const char *message);
 void shell_system_error(const char* message);
 
 int main(int argc, char *argv[])
 {
+    clock_gettime(CLOCK_MONOTONIC, &startup_time);
+
     // shell mode flag: INTERACTIVE OR BATCH
     char shell_mode;
-    check_shell_mode(argc, &shell_mode);
+    int file_index = check_shell_mode(argc, argv, &shell_mode);
+    char *file = shell_mode == BATCH_MODE ? argv[file_index] : NULL;
 
-    // attempt to open batch file if shell is in batch mode
-    FILE *fp = NULL;
-    if (shell_mode == BATCH_MODE) { open_batch_file(&fp, argv[1]); }
+    // a client (-c) only hands its script to the server
+    if (client_socket != NULL) { client_main(file); }
 
-    // set initial shell path
+    // set initial shell path; the first blocks of the arenas are static, so a short script does
+    // not need the heap for them
+    arena_preallocate(&path_arena, &path_arena_storage);
+    arena_preallocate(&hash_arena, &hash_arena_storage);
     int num_path = 0;
     char **shell_path = NULL;
-    modify_path(INIT_SHELL_PATH, &shell_path, &num_path);
+    modify_path(&INIT_SHELL_PATH, 1, &shell_path, &num_path);
+
+    // a server (-D) only comes back here in the shell forked for a client's script
+    if (server_socket != NULL)
+    {
+        file = server_main(&shell_path, &num_path);
+        shell_mode = BATCH_MODE;
+    }
+
+    // attempt to open batch file if shell is in batch mode; without a batch file, lines that are
+    // not edited are read from stdin through the same buffer
+    struct batch_file batch = { NULL, 0, 0, -1, NULL, 0, 0, 0, NULL, 0, NULL, 0, 0, 0, NULL, 0 };
+    if (shell_mode == BATCH_MODE) { open_batch_file(&batch, file); }
+    else { batch.fd = STDIN_FILENO; }
+    if (shell_mode == BATCH_MODE && compiled_scripts) { open_compiled_script(&batch, file); }
 
-    // dynamnic command buffer init
+    // the line editor's dynamic buffer; other lines are viewed in place in the mapping or read buffer
     char *command_buffer = NULL;
+    char *command_line = NULL;
     size_t len_buffer = 0;
+    size_t line_length = 0;
+
+    // the parsed line lives in its own arena, released in one go once the line is done
+    struct arena line_arena = { NULL };
+    arena_preallocate(&line_arena, &line_arena_storage);
+
+    // children of the shell and background jobs; the SIGCHLD handler says when some can be reaped
+    struct job_table jobs = { NULL };
+    install_sigchld_handler();
+    if (shell_mode == INTERACTIVE_MODE && isatty(STDIN_FILENO))
+    {
+        // the shell hands the terminal to its jobs and takes it back afterwards; only the jobs
+        // are stopped by Ctrl-Z
+        job_control = 1;
+        signal(SIGTSTP, SIG_IGN);
+        signal(SIGTTIN, SIG_IGN);
+        signal(SIGTTOU, SIG_IGN);
+    }
+
+    // on a terminal lines are read with the line editor, which needs the shell path for completion
+    if (job_control)
+    {
+        line_editor_init(shell_path, num_path);
+    }
+
+    // the first commands already find parked workers (-w)
+    worker_pool_refill(&batch, 0);
 
     while (1)
     {
-        // read command line from file or stin
+        // reap what finished in the meantime so worker slots free up; on a terminal finished jobs
+        // are reported, otherwise they are kept until jobs or wait looks at them
+        job_table_poll(&jobs);
+        if (job_control)
+        {
+            job_table_notify(&jobs, 1);
+        }
+
+        // read command line from file or stin; a precompiled line needs no parsing
+        char compiled = 0;
         if (shell_mode == BATCH_MODE)
         {
-            if (getline(&command_buffer, &len_buffer, fp) == -1) 
+            if (batch.compiled ? !read_compiled_line(&batch, &command_line, &line_length, &compiled) :
+                                 !read_batch_line(&batch, &command_line, &line_length))
             { 
-                attempt_close_batch(&fp);
+                // lines of a parallel batch and background jobs may still be running
+                wait_and_check_child_exit_status(&jobs, 1, &command_buffer, &shell_path, &num_path, &batch);
+                if (startup_report)
+                {
+                    startup_print();
+                }
+                attempt_close_batch(&batch);
                 deallocate_string(&command_buffer);
                 deallocate_shell_path(&shell_path, &num_path);
+                deallocate_job_table(&jobs);
+                deallocate_arena(&line_arena);
+                deallocate_variable_table();
+                glob_cache_clear();
+                trace_finish();
                 break; 
             }
         }
         else
         {
-            printf("wish> ");
-            if (getline(&command_buffer, &len_buffer, stdin) == -1) { system_error(ERROR_MESSAGE); }
+            ssize_t read_length;
+            // the shell is idle until the next line arrives, so the workers the last one used are
+            // forked now rather than while a line runs (-w)
+            if (line_editor)
+            {
+                worker_pool_refill(&batch, 1);
+                read_length = line_editor_read("wish> ", &command_buffer, &len_buffer, &jobs);
+                command_line = command_buffer;
+            }
+            else
+            {
+                // built-ins flush what they print, so the prompt can skip stdio
+                write(STDOUT_FILENO, "wish> ", 6);
+                if (batch.start == batch.end)
+                {
+                    worker_pool_refill(&batch, 1);
+                    wait_for_input(&jobs);
+                }
+                read_length = read_buffered_line(&batch, &command_line, &line_length) ? (ssize_t)line_length : -1;
+            }
+            if (read_length == -1) { system_error(ERROR_MESSAGE); }
+            line_length = (size_t)read_length;
         }
 
-        // remove leading spaces and trailing newline
-        remove_lead_and_trailing_whitespaces(&command_buffer);
+        // parse the whole line once before anything runs
+        unsigned long long parse_start = trace_clock();
+        struct command_line *parsed = compiled ? compiled_inflate(&batch, &line_arena) : NULL;
+        if (parsed == NULL)
+        {
+            // records that cannot be inflated leave the line to its text
+            compiled = 0;
+            parsed = parse_command_line(command_line, line_length, &line_arena);
+        }
+        trace_record(TRACE_PARSE, parse_start, trace_shell_pid, compiled ? "compiled" : "");
+        if (parsed == NULL)
+        {
+            attempt_close_batch(&batch);
+            deallocate_string(&command_buffer);
+            deallocate_shell_path(&shell_path, &num_path);
+            system_error(ERROR_MESSAGE);
+        }
 
-        // check for ampersand operator and decide on which type of process to run
-        if (command_buffer && command_buffer[0] != '\0' && command_buffer[0] != '\r' && command_buffer[0] != '\n')
+        // empty lines have no pipelines to run
+        if (parsed->count > 0)
         {
-            if (strstr(command_buffer, "&"))
+            if (startup_report && first_command_time.tv_sec == 0 && first_command_time.tv_nsec == 0)
             {
-                // there are several commands found
-                cmd_parse_processes(&command_buffer, &shell_path, &num_path, &fp);
+                clock_gettime(CLOCK_MONOTONIC, &first_command_time);
             }
-            else
+
+            // in a parallel batch, lines are only waited for before a built-in changes the shell
+            // (cd, path, exit, ...) so that later lines still see the earlier ones' effects
+            char wait_for_line = 1;
+            if (parallel_batch && shell_mode == BATCH_MODE)
             {
-                // only single command is needed to be ran
-                int pipe[1][2];                 // one pair of file descriptors
-                pid_t child[1];                 // one child needed only for a single command
-                int count = 0;                  // run one single command
-                cmd_process(&command_buffer, &count, pipe, child, &shell_path, &num_path, &fp);
-                wait_and_check_child_exit_status(count, child, &command_buffer, &shell_path, &num_path, &fp);
-                check_child_message_and_close_pipes(count, pipe, &command_buffer, &shell_path, &num_path);
+                wait_for_line = check_line_barrier(parsed);
+                if (wait_for_line)
+                {
+                    wait_and_check_child_exit_status(&jobs, 0, &command_buffer, &shell_path, &num_path, &batch);
+                }
             }
+            cmd_run_processes(parsed, &command_buffer, &jobs, wait_for_line, &shell_path, &num_path, &batch, &line_arena);
         }
 
-        len_buffer = 0;
-        deallocate_string(&command_buffer);
+        arena_reset(&line_arena);
     }
 
     return 0;
@@ -130,423 +993,6547 @@ int main(int argc, char *argv[])
 // ---------------------
 // Function Definitions
 // ---------------------
-// checks shell mode given the number of arguments given in program launch
-void check_shell_mode(int args, char *shell_mode)
+// checks shell mode and startup options given the arguments of the program launch
+// returns the index of the batch file argument (if any)
+int check_shell_mode(int argc, char *argv[], char *shell_mode)
 {
+    // startup options come before the batch file
+    int option;
+    opterr = 0;
+    while ((option = getopt(argc, argv, "+ac:e:B:CD:Gj:kP:l:o:sT:w:X")) != -1)
+    {
+        switch (option)
+        {
+            case 'e':
+                if (strcmp(optarg, "fork") == 0)
+                {
+                    launch_engine = LAUNCH_ENGINE_FORK;
+                }
+                else if (strcmp(optarg, "spawn") == 0)
+                {
+                    launch_engine = LAUNCH_ENGINE_SPAWN;
+                }
+                else
+                {
+                    system_error(ERROR_MESSAGE);
+                }
+                break;
+            case 'B':
+                pipe_buffer_size = atoi(optarg);
+                if (pipe_buffer_size <= 0)
+                {
+                    system_error(ERROR_MESSAGE);
+                }
+                break;
+            case 'P':
+                // parallel batch lines share the worker slots of -j
+                parallel_batch = 1;
+                // fall through
+            case 'j':
+                // 0 gives one worker slot per online cpu
+                max_running_children = atoi(optarg);
+                if (max_running_children == 0)
+                {
+                    max_running_children = (int)sysconf(_SC_NPROCESSORS_ONLN);
+                }
+                if (max_running_children <= 0)
+                {
+                    system_error(ERROR_MESSAGE);
+                }
+                break;
+            case 'o':
+                if (strcmp(optarg, "group") == 0)
+                {
+                    output_mode = OUTPUT_GROUP;
+                }
+                else if (strcmp(optarg, "tag") == 0)
+                {
+                    output_mode = OUTPUT_TAG;
+                }
+                else
+                {
+                    system_error(ERROR_MESSAGE);
+                }
+                break;
+            case 'k':
+                // the cpus the shell was started on (e.g. by taskset) are the ones handed out
+                if (sched_getaffinity(0, sizeof(pin_cpus), &pin_cpus) == -1)
+                {
+                    system_error(ERROR_MESSAGE);
+                }
+                pin_children = 1;
+                break;
+            case 'l':
+                // close-on-exec so programs cannot write into the log
+                stats_log_fd = open(optarg, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+                if (stats_log_fd == -1)
+                {
+                    system_error(ERROR_MESSAGE);
+                }
+                break;
+            case 'T':
+                trace_open(optarg);
+                break;
+            case 'a':
+                shared_outputs = 1;
+                break;
+            case 's':
+                startup_report = 1;
+                break;
+            case 'X':
+                fast_builtins = 0;
+                break;
+            case 'G':
+                persistent_glob_cache = 1;
+                break;
+            case 'C':
+                compiled_scripts = 1;
+                break;
+            case 'D':
+                server_socket = optarg;
+                break;
+            case 'c':
+                client_socket = optarg;
+                break;
+            case 'w':
+                worker_pool_size = atoi(optarg);
+                if (worker_pool_size <= 0 || worker_pool_size > WORKER_POOL_MAX)
+                {
+                    system_error(ERROR_MESSAGE);
+                }
+                worker_refill_while_running = sysconf(_SC_NPROCESSORS_ONLN) > 1;
+                break;
+            default:
+                system_error(ERROR_MESSAGE);
+        }
+    }
+
+    // the environment can turn tracing on without changing how the shell is launched
+    char *trace_file = getenv("WISH_TRACE");
+    if (trace_ring == NULL && trace_file != NULL && *trace_file != '\0')
+    {
+        trace_open(trace_file);
+    }
+
     // argument check for shell mode
-    if (args < 2) 
+    int args = argc - optind;
+    if (args < 1) 
     {
         *shell_mode = INTERACTIVE_MODE;
-    } else if (args < 3) 
+    } else if (args < 2) 
     {
         *shell_mode = BATCH_MODE;
     } else 
     {
         system_error(ERROR_MESSAGE);
     }
-}
 
-// attempts to open batch file
-void open_batch_file(FILE **fp, char *file)
-{
-    if ((*fp = fopen(file, "r")) == NULL)
+    // a server takes its scripts from clients only
+    if (server_socket != NULL && (*shell_mode == BATCH_MODE || client_socket != NULL))
     {
         system_error(ERROR_MESSAGE);
     }
+    return optind;
 }
 
-// modify the program path and readjust the list if needed
-void modify_path(char *buffer, char ***shell_path, int *num_path)
+// attempts to open batch file; regular files are mapped so that lines can be viewed in place
+void open_batch_file(struct batch_file *batch, char *file)
 {
-    char *token = strtok(buffer, " ");
-    if (token != NULL) { token = strtok(NULL, " "); }
-    if (*shell_path == NULL && token == NULL)
-    {
-        // shell path has not yet been created and we just want to put first index in
-        (*num_path)++;
-        *shell_path = (char **)realloc(*shell_path, (*num_path)*sizeof(char *));
-        if (*shell_path == NULL)
-        {
-            return;
-        }
-        else
-        {
-            (*shell_path)[(*num_path) - 1] = strdup(buffer);
-        }
-    }
-    else if (token == NULL || token[0] == '\0' || token[0] == '\n')
+    // close-on-exec so spawned programs do not inherit the batch file
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    struct stat file_stat;
+    if (fd == -1 || fstat(fd, &file_stat) == -1)
     {
-        // handle command is "path" w/ no arguments
-        free((*shell_path)[0]);
-        (*shell_path)[0] = strdup("");
-        for (int i = 1; i < *num_path; i++)
-        {
-            free((*shell_path)[i]);
-            (*shell_path)[i] = NULL;
-        }
-        *num_path = 1;
+        system_error(ERROR_MESSAGE);
     }
-    else
+
+    if (S_ISREG(file_stat.st_mode))
     {
-        // handle path with multiple arguments
-        int path_counter = 0;
-        while (token != NULL)
+        batch->size = (size_t)file_stat.st_size;
+        if (batch->size == 0)
         {
-            if (path_counter < *num_path)
-            {
-                // overwrite the current path; first index
-                free((*shell_path)[path_counter]);
-                (*shell_path)[path_counter] = NULL;
-                (*shell_path)[path_counter++] = strdup(token);
-            }
-            else
-            {
-                // else if need to add more paths, add num_paths and increase size of shell path
-                *shell_path = (char **)realloc(*shell_path, (*num_path + 1) * sizeof(char *));
-                (*shell_path)[path_counter] = strdup(token);
-                path_counter++;
-                (*num_path)++;
-            }
-            token = strtok(NULL, " ");
+            // nothing to read
+            close(fd);
+            return;
         }
 
-        // if there are extra paths that are not used, deallocate them
-        for (int i = path_counter; i < *num_path; i++)
+        // the parser reads line views without writing to them, so the mapping stays read-only
+        batch->data = mmap(NULL, batch->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (batch->data != MAP_FAILED)
         {
-            free((*shell_path)[i]);
-            (*shell_path)[i] = NULL;
+            madvise(batch->data, batch->size, MADV_SEQUENTIAL);
+            close(fd);
+            return;
         }
-        *num_path = path_counter;
+        batch->data = NULL;
+        batch->size = 0;
     }
+
+    batch->fd = fd;
 }
 
-// removes all leading and trailing whitespaces
-void remove_lead_and_trailing_whitespaces(char **buffer)
+// runs the batch file from its precompiled form "<file>.wishc" (-C), which is written first if it is
+// missing or belongs to another version of the script; without it the text is parsed as usual
+void open_compiled_script(struct batch_file *batch, const char *file)
 {
-    if (!buffer || !*buffer || !**buffer) {
+    char path[PATH_MAX];
+    struct stat script;
+    if (batch->data == NULL || stat(file, &script) == -1 ||
+        snprintf(path, sizeof(path), "%s.wishc", file) >= (int)sizeof(path))
+    {
         return;
     }
-
-    // make copy
-    char *str = *buffer;
-
-    // move pointer until first non-whitespace character
-    char *buffer_copy = str;
-    while (*buffer_copy && isspace((unsigned char)*buffer_copy)) 
+    if (!compiled_load(batch, path, &script) && compile_script(batch, path, &script))
     {
-        buffer_copy++;
+        compiled_load(batch, path, &script);
     }
+}
 
-    // shift the string after dealing with its leading whitespaces
-    if (buffer_copy != str) 
+// maps the precompiled script at path if it was made from the script as it is now: same size,
+// mtime and inode, and the same content hash if the script had changed just before it was compiled
+// returns 0 if there is no such file or its records are damaged, so that it is compiled again
+char compiled_load(struct batch_file *batch, const char *path, const struct stat *script)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if (fd == -1)
+    {
+        return 0;
+    }
+    if (fstat(fd, &info) == -1 || (size_t)info.st_size < sizeof(struct compiled_header))
     {
-        size_t length = strlen(buffer_copy) + 1;
-        memmove(str, buffer_copy, length);
+        close(fd);
+        return 0;
     }
 
-    // remove trailing whitespaces
-    char *end = str + strlen(str) - 1;
-    while (end >= str && isspace((unsigned char)*end)) 
+    // private and writable, so that the words handed out as arguments behave like parsed ones
+    char *data = mmap(NULL, (size_t)info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
     {
-        *end-- = '\0';
+        return 0;
+    }
+    struct compiled_header *header = (struct compiled_header *)data;
+    size_t words_size = header->num_words * sizeof(unsigned int);
+    if (memcmp(header->magic, COMPILED_MAGIC, sizeof(header->magic)) != 0 || header->version != COMPILED_VERSION ||
+        header->script_size != (unsigned long long)script->st_size || header->inode != (unsigned long long)script->st_ino ||
+        header->mtime_sec != (long long)script->st_mtim.tv_sec || header->mtime_nsec != (long long)script->st_mtim.tv_nsec ||
+        header->num_words > (size_t)info.st_size / sizeof(unsigned int) ||
+        sizeof(struct compiled_header) + words_size + header->strings_size != (unsigned long long)info.st_size ||
+        (header->strings_size > 0 && data[info.st_size - 1] != '\0') ||
+        (header->verify && header->hash != cache_key(batch->data, batch->size)))
+    {
+        munmap(data, (size_t)info.st_size);
+        return 0;
     }
-}
 
-// awaits messages (if any) from the child process. This usually means a request 
-// from the child for parent to change directories or modify the shell path
-void check_child_message_and_close_pipes(int command_count, int pipes[][2], char **buffer, char ***shell_path, int *num_path) 
-{
-    for (int i = 0; i < command_count; i++)
+    batch->compiled = data;
+    batch->compiled_size = (size_t)info.st_size;
+    batch->words = (unsigned int *)(data + sizeof(struct compiled_header));
+    batch->num_words = header->num_words;
+    batch->word = 0;
+    batch->strings = data + sizeof(struct compiled_header) + words_size;
+    batch->strings_size = header->strings_size;
+    batch->record_end = 0;
+    if (!compiled_check(batch))
     {
-        // check if children wrote to parent
-        char message_type;
-        char new_dir[512];
-        ssize_t bytesRead = read(pipes[i][0], &message_type, sizeof(char));
-        if (bytesRead > 0) 
-        {
-            switch (message_type) 
-            {
-                case MESSAGE_TYPE_CD:
-                    // read the directory and change to it
-                    read(pipes[i][0], new_dir, sizeof(new_dir));
-                    chdir(new_dir);
-                    break;
-                case MESSAGE_TYPE_PATH:
-                    // handle path modification
-                    modify_path(*buffer, shell_path, num_path);
-                    break;
-            }
-        }
-        close(pipes[i][0]);  // close read end of parent pipe
+        munmap(data, (size_t)info.st_size);
+        batch->compiled = NULL;
+        return 0;
     }
+    return 1;
 }
 
-// checks if the program is built-in or not
-char check_builtin_cmd(char *buffer)
+// walks every record once without building anything; returns 0 if one is damaged: an unknown kind,
+// a line outside of the script, a count or string offset out of range or a size that does not match
+char compiled_check(struct batch_file *batch)
 {
-    if ((strcmp(buffer, "exit") == 0) ||
-        (strcmp(buffer, "cd") == 0) ||
-        (strcmp(buffer, "path") == 0))
-        {
-            return 1;
-        }
-        else
+    batch->word = 0;
+    while (batch->word < batch->num_words)
+    {
+        size_t start = batch->word;
+        unsigned int kind = compiled_get_word(batch);
+        size_t end = start + compiled_get_word(batch);
+        size_t offset = compiled_get_word(batch);
+        offset |= (size_t)compiled_get_word(batch) << 32;
+        size_t length = compiled_get_word(batch);
+        if ((kind != COMPILED_TEXT && kind != COMPILED_PARSED) || end > batch->num_words ||
+            offset > batch->size || length > batch->size - offset)
         {
             return 0;
         }
-}
 
-// attempt to run built in programs
-void run_builtin_cmd(char **buffer, int child_to_parent[2], char ***shell_path, int *num_path)
-{
-    char *buffer_copy = (char *)malloc(strlen(*buffer) + 1);
-    strcpy(buffer_copy, *buffer);
-    char *token = strtok(buffer_copy, " ");
-    if (strcmp(token, "exit") == 0 && strcmp(*buffer, token) == 0)
-    {
-        deallocate_string(&buffer_copy);
-        deallocate_shell_path(shell_path, num_path);
-        deallocate_string(buffer);
-        _exit(CHILD_EXIT_REQUEST);
-    }
-    else if (strcmp(token, "cd") == 0)
-    {
-        token = strtok(NULL, " ");
-        if (token && strtok(NULL, " ") == NULL)
+        if (kind == COMPILED_PARSED)
         {
-            if (chdir(token) != 0)
-            {
-                shell_error(ERROR_MESSAGE);
-            }
-            else
+            compiled_get_word(batch);
+            unsigned int num_pipelines = compiled_get_word(batch);
+            for (unsigned int i = 0; i < num_pipelines && batch->word <= end; i++)
             {
-                char message_type = MESSAGE_TYPE_CD;
-                if (write(child_to_parent[1], &message_type, sizeof(char)) == -1)
+                compiled_get_word(batch);
+                if (!compiled_check_strings(batch, end))
                 {
-                    deallocate_string(&buffer_copy);
-                    deallocate_shell_path(shell_path, num_path);
-                    deallocate_string(buffer);
-                    shell_system_error(ERROR_MESSAGE);
+                    return 0;
                 }
-                if (write(child_to_parent[1], token, strlen(token) + 1) == -1)
+                unsigned int num_commands = compiled_get_word(batch);
+                for (unsigned int j = 0; j < num_commands && batch->word <= end; j++)
                 {
-                    deallocate_string(&buffer_copy);
-                    deallocate_shell_path(shell_path, num_path);
-                    deallocate_string(buffer);
-                    shell_system_error(ERROR_MESSAGE);
+                    if (!compiled_check_strings(batch, end) || !compiled_check_strings(batch, end))
+                    {
+                        return 0;
+                    }
+                    // the input, output and error files may be missing
+                    for (int k = 0; k < 3; k++)
+                    {
+                        unsigned int file = compiled_get_word(batch);
+                        if (file != COMPILED_NONE && file >= batch->strings_size)
+                        {
+                            return 0;
+                        }
+                    }
+                    compiled_get_word(batch);
                 }
             }
         }
-        else
+        if (batch->word != end)
         {
-            shell_error(ERROR_MESSAGE);
+            return 0;
         }
     }
-    else if (strcmp(token, "path") == 0)
+    batch->word = 0;
+    return 1;
+}
+
+// checks a count and that many string offsets, which all have to lie before the word end
+char compiled_check_strings(struct batch_file *batch, size_t end)
+{
+    unsigned int count = compiled_get_word(batch);
+    if (batch->word > end || count > end - batch->word)
     {
-        // send flag to parent to modify path
-        char message_type = MESSAGE_TYPE_PATH;
-        if (write(child_to_parent[1], &message_type, sizeof(char)) == -1)
-        {
-            deallocate_string(&buffer_copy);
-            deallocate_string(buffer);
-            deallocate_shell_path(shell_path, num_path);
-            shell_system_error(ERROR_MESSAGE);
-        }
+        return 0;
     }
-    else
+    for (unsigned int i = 0; i < count; i++)
     {
-        shell_error(ERROR_MESSAGE);
+        if (compiled_get_word(batch) >= batch->strings_size)
+        {
+            return 0;
+        }
     }
-    deallocate_string(&buffer_copy);
+    return 1;
 }
 
-// attempt to run built-in commands
-void run_extern_cmd(char **buffer, char ***shell_path, int *num_path)
+// parses every line of the mapped script and writes the result to path (through a temporary file,
+// so that a concurrent shell never maps half of it); returns 0 if it could not be written
+char compile_script(struct batch_file *batch, const char *path, const struct stat *script)
 {
-    char *args[512];
-    int i = 0;
+    struct compiled_writer out = { NULL, 0, 0, NULL, 0, 0 };
+    struct arena arena = { NULL };
+    char failed = 0;
+    char *line;
+    size_t length;
+    while (!failed && read_batch_line(batch, &line, &length))
+    {
+        struct command_line *parsed = parse_command_line(line, length, &arena);
+        failed = parsed == NULL || !compiled_add_line(&out, parsed, (size_t)(line - batch->data), length);
+        arena_reset(&arena);
+    }
+    deallocate_arena(&arena);
+    batch->offset = 0;
 
-    // search for the redirection operator
-    char *redirect_char = strchr(*buffer, '>');
-    char *filename = NULL;
+    // a change to the script within its timestamp granularity would keep the mtime, so a script
+    // changed that recently is also identified by its content
+    struct compiled_header header;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, COMPILED_MAGIC, sizeof(header.magic));
+    header.version = COMPILED_VERSION;
+    header.verify = timespec_seconds(&script->st_mtim, &now) < COMPILED_RACY_SECONDS;
+    header.script_size = (unsigned long long)script->st_size;
+    header.mtime_sec = (long long)script->st_mtim.tv_sec;
+    header.mtime_nsec = (long long)script->st_mtim.tv_nsec;
+    header.inode = (unsigned long long)script->st_ino;
+    header.hash = cache_key(batch->data, batch->size);
+    header.num_words = out.num_words;
+    header.strings_size = out.strings_size;
 
-    if (redirect_char) 
+    char temporary[PATH_MAX];
+    int fd = -1;
+    if (!failed && snprintf(temporary, sizeof(temporary), "%s.%d", path, (int)getpid()) < (int)sizeof(temporary))
     {
-        // split command and filename
-        *redirect_char = '\0';
-        filename = redirect_char + 1;
-
-        while (*filename && isspace((unsigned char)*filename)) 
+        fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    }
+    if (fd != -1)
+    {
+        struct iovec parts[3] = { { &header, sizeof(header) },
+                                  { out.words, out.num_words * sizeof(unsigned int) },
+                                  { out.strings, out.strings_size } };
+        size_t total = parts[0].iov_len + parts[1].iov_len + parts[2].iov_len;
+        failed = writev(fd, parts, 3) != (ssize_t)total;
+        failed = close(fd) == -1 || failed || rename(temporary, path) == -1;
+        if (failed)
         {
-            filename++;
+            unlink(temporary);
         }
+    }
+    free(out.words);
+    free(out.strings);
+    return fd != -1 && !failed;
+}
 
-        // check if filename is empty after '>'
-        if (!*filename) 
+// appends the record of a parsed line to the precompiled script; a line whose words depend on
+// variables or the file system is only kept as a view of its text (offset, length) to parse when it
+// runs. returns 0 if allocation failed
+char compiled_add_line(struct compiled_writer *out, struct command_line *parsed, size_t offset, size_t length)
+{
+    size_t start = out->num_words;
+    char ok = compiled_put_word(out, parsed->dynamic ? COMPILED_TEXT : COMPILED_PARSED) && compiled_put_word(out, 0) &&
+              compiled_put_word(out, (unsigned int)(offset & 0xffffffffu)) &&
+              compiled_put_word(out, (unsigned int)(offset >> 32)) && compiled_put_word(out, (unsigned int)length);
+    if (ok && !parsed->dynamic)
+    {
+        ok = compiled_put_word(out, parsed->background) && compiled_put_word(out, parsed->count);
+    }
+    for (int i = 0; ok && !parsed->dynamic && i < parsed->count; i++)
+    {
+        struct pipeline *pipeline = &parsed->pipelines[i];
+        ok = compiled_put_word(out, pipeline->malformed | pipeline->timed << 1 | pipeline->cached << 2) &&
+             compiled_put_word(out, pipeline->num_cache_inputs);
+        for (int j = 0; ok && j < pipeline->num_cache_inputs; j++)
         {
-            shell_error(ERROR_MESSAGE);
-            deallocate_string(buffer);
-            deallocate_shell_path(shell_path, num_path);
-            _exit(0);
+            ok = compiled_put_string(out, pipeline->cache_inputs[j]);
         }
-        
-        // check if there are spaces after the filename, indicating multiple files
-        if (strchr(filename, ' ')) 
+        ok = ok && compiled_put_word(out, pipeline->count);
+        for (int j = 0; ok && j < pipeline->count; j++)
         {
-            shell_error(ERROR_MESSAGE);
-            deallocate_string(buffer);
-            deallocate_shell_path(shell_path, num_path);
-            _exit(0);
+            struct command *cmd = &pipeline->commands[j];
+            ok = compiled_put_word(out, cmd->argc);
+            for (int k = 0; ok && k < cmd->argc; k++)
+            {
+                ok = compiled_put_string(out, cmd->args[k]);
+            }
+            ok = ok && compiled_put_word(out, cmd->num_assignments);
+            for (int k = 0; ok && k < cmd->num_assignments; k++)
+            {
+                ok = compiled_put_string(out, cmd->assignments[k]);
+            }
+            ok = ok && compiled_put_string(out, cmd->input_file) && compiled_put_string(out, cmd->output_file) &&
+                 compiled_put_string(out, cmd->error_file) &&
+                 compiled_put_word(out, cmd->output_append | cmd->error_append << 1 | cmd->error_to_output << 2 |
+                                   cmd->error_before_output << 3);
         }
+    }
+    if (ok)
+    {
+        out->words[start + 1] = (unsigned int)(out->num_words - start);
+    }
+    return ok;
+}
 
-        char *filename_final = strdup(filename);
-        remove_lead_and_trailing_whitespaces(&filename_final);
-        
-        int fd = open(filename_final, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-        if (fd == -1) 
+// appends a word to the records of the precompiled script; returns 0 if allocation failed
+char compiled_put_word(struct compiled_writer *out, unsigned int word)
+{
+    if (out->num_words == out->words_capacity)
+    {
+        size_t capacity = out->words_capacity ? out->words_capacity * 2 : 1024;
+        unsigned int *words = (unsigned int *)realloc(out->words, capacity * sizeof(unsigned int));
+        if (words == NULL)
         {
-            deallocate_string(buffer);
+            return 0;
+        }
+        out->words = words;
+        out->words_capacity = capacity;
+    }
+    out->words[out->num_words++] = word;
+    return 1;
+}
+
+// appends a string (NULL for none) to the strings of the precompiled script and its offset to the
+// records; returns 0 if allocation failed
+char compiled_put_string(struct compiled_writer *out, const char *string)
+{
+    if (string == NULL)
+    {
+        return compiled_put_word(out, COMPILED_NONE);
+    }
+    size_t length = strlen(string) + 1;
+    if (out->strings_size + length > out->strings_capacity)
+    {
+        size_t capacity = out->strings_capacity ? out->strings_capacity : 4096;
+        while (capacity < out->strings_size + length)
+        {
+            capacity *= 2;
+        }
+        char *strings = (char *)realloc(out->strings, capacity);
+        if (strings == NULL)
+        {
+            return 0;
+        }
+        out->strings = strings;
+        out->strings_capacity = capacity;
+    }
+    memcpy(out->strings + out->strings_size, string, length);
+    out->strings_size += length;
+    return compiled_put_word(out, (unsigned int)(out->strings_size - length));
+}
+
+// reads the next line of a precompiled script as a view of the script (like read_batch_line); the
+// rest of a parsed one is left for compiled_inflate and sets parsed. the records were checked when
+// they were mapped. returns 0 at the end of the script
+char read_compiled_line(struct batch_file *batch, char **line, size_t *line_length, char *parsed)
+{
+    // the previous record may not have been read to its end
+    batch->word = batch->record_end;
+    if (batch->word >= batch->num_words)
+    {
+        return 0;
+    }
+    *parsed = compiled_get_word(batch) == COMPILED_PARSED;
+    batch->record_end = batch->word - 1 + compiled_get_word(batch);
+    size_t offset = compiled_get_word(batch);
+    offset |= (size_t)compiled_get_word(batch) << 32;
+    *line_length = compiled_get_word(batch);
+    *line = batch->data + offset;
+    return 1;
+}
+
+// builds the parsed line of the next records in the line arena; its words stay in the mapping
+// returns NULL if allocation failed or the records are damaged
+struct command_line *compiled_inflate(struct batch_file *batch, struct arena *arena)
+{
+    struct command_line *parsed = (struct command_line *)arena_alloc(arena, sizeof(struct command_line));
+    if (parsed == NULL)
+    {
+        return NULL;
+    }
+    parsed->pipelines = NULL;
+    parsed->count = parsed->capacity = 0;
+    parsed->outputs = NULL;
+    parsed->num_outputs = parsed->outputs_capacity = 0;
+    parsed->background = (char)compiled_get_word(batch);
+    parsed->dynamic = 0;
+
+    unsigned int num_pipelines = compiled_get_word(batch);
+    for (unsigned int i = 0; i < num_pipelines && batch->word <= batch->record_end; i++)
+    {
+        struct pipeline *pipeline = command_line_add_pipeline(parsed, arena);
+        if (pipeline == NULL)
+        {
+            return NULL;
+        }
+        unsigned int flags = compiled_get_word(batch);
+        pipeline->malformed = (flags & 1) != 0;
+        pipeline->timed = (flags & 2) != 0;
+        pipeline->cached = (flags & 4) != 0;
+        if ((pipeline->cache_inputs = compiled_get_strings(batch, arena, &pipeline->num_cache_inputs)) == NULL)
+        {
+            return NULL;
+        }
+        pipeline->cache_inputs_capacity = pipeline->num_cache_inputs;
+
+        unsigned int num_commands = compiled_get_word(batch);
+        for (unsigned int j = 0; j < num_commands && batch->word <= batch->record_end; j++)
+        {
+            struct command *cmd = pipeline_add_command(pipeline, arena);
+            if (cmd == NULL || (cmd->args = compiled_get_strings(batch, arena, &cmd->argc)) == NULL ||
+                (cmd->assignments = compiled_get_strings(batch, arena, &cmd->num_assignments)) == NULL)
+            {
+                return NULL;
+            }
+            cmd->args_capacity = cmd->argc + 1;
+            cmd->assignments_capacity = cmd->num_assignments;
+            cmd->input_file = compiled_get_string(batch);
+            cmd->output_file = compiled_get_string(batch);
+            cmd->error_file = compiled_get_string(batch);
+            flags = compiled_get_word(batch);
+            cmd->output_append = (flags & 1) != 0;
+            cmd->error_append = (flags & 2) != 0;
+            cmd->error_to_output = (flags & 4) != 0;
+            cmd->error_before_output = (flags & 8) != 0;
+        }
+    }
+    return batch->word <= batch->record_end ? parsed : NULL;
+}
+
+// reads the next word of the records; past the end it returns 0 and leaves the position beyond
+// num_words, which marks the records as damaged
+unsigned int compiled_get_word(struct batch_file *batch)
+{
+    unsigned int word = batch->word < batch->num_words ? batch->words[batch->word] : 0;
+    batch->word++;
+    return word;
+}
+
+// reads a string of the records (NULL for none or a damaged offset)
+char *compiled_get_string(struct batch_file *batch)
+{
+    unsigned int offset = compiled_get_word(batch);
+    if (offset == COMPILED_NONE || offset >= batch->strings_size)
+    {
+        return NULL;
+    }
+    return batch->strings + offset;
+}
+
+// reads a count and that many strings into a NULL terminated arena array; returns NULL if
+// allocation failed
+char **compiled_get_strings(struct batch_file *batch, struct arena *arena, int *count)
+{
+    unsigned int length = compiled_get_word(batch);
+    length = length < batch->num_words ? length : 0;
+    char **strings = (char **)arena_alloc(arena, (length + 1) * sizeof(char *));
+    if (strings == NULL)
+    {
+        return NULL;
+    }
+    for (unsigned int i = 0; i < length; i++)
+    {
+        if ((strings[i] = compiled_get_string(batch)) == NULL)
+        {
+            // a missing word would end the array early
+            batch->word = batch->num_words + 1;
+        }
+    }
+    strings[length] = NULL;
+    *count = (int)length;
+    return strings;
+}
+
+// reads the next line of the batch file as a view (line, line_length) that is not NUL terminated;
+// a mapped file hands out the line in place, other files are read into the read buffer
+// returns 0 at the end of the file
+char read_batch_line(struct batch_file *batch, char **line, size_t *line_length)
+{
+    if (batch->fd != -1)
+    {
+        return read_buffered_line(batch, line, line_length);
+    }
+
+    if (batch->offset >= batch->size)
+    {
+        return 0;
+    }
+    char *start = batch->data + batch->offset;
+    char *newline = memchr(start, '\n', batch->size - batch->offset);
+    *line = start;
+    if (newline)
+    {
+        *line_length = (size_t)(newline - start);
+        batch->offset += *line_length + 1;
+    }
+    else
+    {
+        // final line without a newline
+        *line_length = batch->size - batch->offset;
+        batch->offset = batch->size;
+    }
+    return 1;
+}
+
+// reads the next line of input that cannot be mapped as a view into the read buffer, with plain
+// reads and no stdio; the static buffer is reused for every line and only a line longer than it
+// moves the input to a larger heap buffer
+// returns 0 at the end of the input (or if a long line could not be allocated, as getline did)
+char read_buffered_line(struct batch_file *batch, char **line, size_t *line_length)
+{
+    if (batch->buffer == NULL)
+    {
+        batch->buffer = batch_buffer;
+        batch->buffer_size = sizeof(batch_buffer);
+    }
+    if (batch->start == batch->end)
+    {
+        batch->start = batch->end = 0;
+    }
+
+    size_t scanned = batch->start;
+    while (1)
+    {
+        char *newline = memchr(batch->buffer + scanned, '\n', batch->end - scanned);
+        if (newline != NULL)
+        {
+            *line = batch->buffer + batch->start;
+            *line_length = (size_t)(newline - *line) + 1;
+            batch->start += *line_length;
+            return 1;
+        }
+        scanned = batch->end;
+
+        if (batch->end == batch->buffer_size)
+        {
+            if (batch->start > 0)
+            {
+                // make room by moving the partial line to the front
+                memmove(batch->buffer, batch->buffer + batch->start, batch->end - batch->start);
+                batch->end -= batch->start;
+                scanned = batch->end;
+                batch->start = 0;
+            }
+            else
+            {
+                size_t size = batch->buffer_size * 2;
+                char *buffer = (char *)malloc(size);
+                if (buffer == NULL)
+                {
+                    return 0;
+                }
+                memcpy(buffer, batch->buffer, batch->end);
+                if (batch->buffer != batch_buffer)
+                {
+                    free(batch->buffer);
+                }
+                batch->buffer = buffer;
+                batch->buffer_size = size;
+            }
+        }
+
+        ssize_t length = read(batch->fd, batch->buffer + batch->end, batch->buffer_size - batch->end);
+        if (length == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (length <= 0)
+        {
+            if (batch->end == batch->start)
+            {
+                return 0;
+            }
+            // final line without a newline
+            *line = batch->buffer + batch->start;
+            *line_length = batch->end - batch->start;
+            batch->start = batch->end;
+            return 1;
+        }
+        batch->end += (size_t)length;
+    }
+}
+
+// replaces the program path with the count given paths; no path means no program can be found
+void modify_path(char **paths, int count, char ***shell_path, int *num_path)
+{
+    // remembered program locations may no longer be valid; the old entries go with the path arena
+    cmd_hash_clear();
+    if (line_editor)
+    {
+        completion_update_path(paths, count);
+    }
+    arena_reset(&path_arena);
+    *shell_path = NULL;
+    *num_path = 0;
+    if (count == 0)
+    {
+        return;
+    }
+
+    *shell_path = (char **)arena_alloc(&path_arena, count * sizeof(char *));
+    if (*shell_path == NULL)
+    {
+        return;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        if (((*shell_path)[i] = arena_strndup(&path_arena, paths[i], strlen(paths[i]))) == NULL)
+        {
+            return;
+        }
+        (*num_path)++;
+    }
+}
+
+// checks if the program is built-in or not
+char check_builtin_cmd(char *buffer)
+{
+    for (int i = 0; BUILTIN_COMMANDS[i] != NULL; i++)
+    {
+        if (strcmp(buffer, BUILTIN_COMMANDS[i]) == 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// checks if any command of the line runs a built-in program; such a line is a barrier
+// of a parallel batch since it may change the state later lines run with
+char check_line_barrier(struct command_line *parsed)
+{
+    for (int i = 0; i < parsed->count; i++)
+    {
+        struct pipeline *pipeline = &parsed->pipelines[i];
+        for (int j = 0; !pipeline->malformed && j < pipeline->count; j++)
+        {
+            // so does a command of only assignments
+            if (pipeline->commands[j].argc == 0 || check_builtin_cmd(pipeline->commands[j].args[0]))
+            {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// run built in programs inside the shell process; no child or pipe is needed
+// because cd and path change the shell's own state
+char run_builtin_cmd(struct command *cmd, struct job_table *jobs, char ***shell_path, int *num_path)
+{
+    // built-ins do not support redirections
+    if (command_redirected(cmd))
+    {
+        builtin_error();
+        return BUILTIN_DONE;
+    }
+
+    char *program_name = cmd->args[0];
+    char result = BUILTIN_DONE;
+    last_status = 0;
+    if (strcmp(program_name, "exit") == 0)
+    {
+        // exit does not take any arguments
+        if (cmd->argc == 1)
+        {
+            result = BUILTIN_EXIT_REQUEST;
+        }
+        else
+        {
+            builtin_error();
+        }
+    }
+    else if (strcmp(program_name, "cd") == 0)
+    {
+        if (cmd->argc == 2)
+        {
+            if (chdir(cmd->args[1]) != 0)
+            {
+                builtin_error();
+            }
+            else
+            {
+                directory_changes++;
+            }
+        }
+        else
+        {
+            builtin_error();
+        }
+    }
+    else if (strcmp(program_name, "path") == 0)
+    {
+        modify_path(cmd->args + 1, cmd->argc - 1, shell_path, num_path);
+    }
+    else if (strcmp(program_name, "hash") == 0)
+    {
+        // "hash" lists, "hash -r" forgets, "hash name ..." looks programs up ahead of time
+        if (cmd->argc == 1)
+        {
+            cmd_hash_print();
+        }
+        else if (cmd->argc == 2 && strcmp(cmd->args[1], "-r") == 0)
+        {
+            cmd_hash_clear();
+        }
+        else
+        {
+            for (int i = 1; i < cmd->argc; i++)
+            {
+                if (cmd->args[i][0] == '-' || cmd_hash_lookup(cmd->args[i], shell_path, num_path, 0) == NULL)
+                {
+                    builtin_error();
+                }
+            }
+        }
+    }
+    else if (strcmp(program_name, "stats") == 0)
+    {
+        // "stats" dumps what the reaped children cost, "stats -r" starts counting again
+        if (cmd->argc == 1)
+        {
+            stats_print();
+        }
+        else if (cmd->argc == 2 && strcmp(cmd->args[1], "-r") == 0)
+        {
+            memset(&shell_stats, 0, sizeof(shell_stats));
+        }
+        else
+        {
+            builtin_error();
+        }
+    }
+    else if (strcmp(program_name, "jobs") == 0)
+    {
+        if (cmd->argc == 1)
+        {
+            for (int i = 0; i < jobs->num_background; i++)
+            {
+                if (jobs->background[i].pgid != 0)
+                {
+                    job_table_print(jobs, &jobs->background[i]);
+                }
+            }
+            fflush(stdout);
+            job_table_notify(jobs, 0);
+        }
+        else
+        {
+            builtin_error();
+        }
+    }
+    else if (strcmp(program_name, "wait") == 0)
+    {
+        // "wait" waits for every running background job, "wait id ..." for the given ones
+        if (cmd->argc == 1)
+        {
+            for (int i = 0; i < jobs->num_background; i++)
+            {
+                if (jobs->background[i].pgid != 0)
+                {
+                    job_table_wait_for_job(jobs, jobs->background[i].id);
+                }
+            }
+        }
+        for (int i = 1; i < cmd->argc; i++)
+        {
+            struct background_job *job = job_table_parse_job(jobs, 2, cmd->args + i - 1);
+            if (job == NULL)
+            {
+                builtin_error();
+                continue;
+            }
+            job_table_wait_for_job(jobs, job->id);
+        }
+        job_table_notify(jobs, 0);
+    }
+    else if (strcmp(program_name, "fg") == 0)
+    {
+        // "fg [id]" waits for a job (the latest by default) as if it ran in the foreground
+        struct background_job *job = job_table_parse_job(jobs, cmd->argc, cmd->args);
+        if (job == NULL)
+        {
+            builtin_error();
+        }
+        else
+        {
+            if (job_control)
+            {
+                printf("%s\n", job->command);
+                fflush(stdout);
+            }
+            job_table_foreground(jobs, job);
+        }
+    }
+    else if (strcmp(program_name, "bg") == 0)
+    {
+        // "bg [id]" lets a stopped job (the latest by default) continue in the background
+        struct background_job *job = job_table_parse_job(jobs, cmd->argc, cmd->args);
+        if (job == NULL || job->state == JOB_DONE)
+        {
+            builtin_error();
+        }
+        else
+        {
+            if (job->state == JOB_STOPPED)
+            {
+                kill(-job->pgid, SIGCONT);
+                job->state = JOB_RUNNING;
+            }
+            if (job_control)
+            {
+                job_table_print(jobs, job);
+                fflush(stdout);
+            }
+        }
+    }
+    else if (strcmp(program_name, "export") == 0)
+    {
+        // "export NAME=value ..." sets and exports, "export NAME ..." exports (once set), "export" lists
+        if (cmd->argc == 1)
+        {
+            for (char **entry = environ; *entry != NULL; entry++)
+            {
+                printf("export %s\n", *entry);
+            }
+            fflush(stdout);
+        }
+        for (int i = 1; i < cmd->argc; i++)
+        {
+            size_t length = strlen(cmd->args[i]);
+            size_t name_length = variable_name_length(cmd->args[i], length);
+            struct variable *variable;
+            if (name_length == 0 || (name_length < length && cmd->args[i][name_length] != '='))
+            {
+                builtin_error();
+            }
+            else if (name_length < length)
+            {
+                if (!variable_set(cmd->args[i], name_length, cmd->args[i] + name_length + 1, length - name_length - 1, 1))
+                {
+                    builtin_error();
+                }
+            }
+            else if ((variable = variable_find(cmd->args[i], name_length)) == NULL)
+            {
+                builtin_error();
+            }
+            else if (!variable->exported)
+            {
+                variable->exported = 1;
+                if (variable->text[variable->name_length] == '=' && putenv(variable->text) == 0)
+                {
+                    environment_changes++;
+                }
+            }
+        }
+    }
+    else
+    {
+        builtin_error();
+    }
+    return result;
+}
+
+// reports a failed built-in, which sets $? to 1
+void builtin_error(void)
+{
+    shell_error(ERROR_MESSAGE);
+    last_status = 1;
+}
+
+// returns the next token of the line view [*cursor, end) and moves the cursor past it;
+// the text of a word is returned through word and word_length (it is not copied)
+int next_token(const char **cursor, const char *end, const char **word, size_t *word_length)
+{
+    const char *c = *cursor;
+    while (c < end && isspace((unsigned char)*c))
+    {
+        c++;
+    }
+    if (c == end || *c == '\0')
+    {
+        *cursor = c;
+        return TOKEN_END;
+    }
+
+    *cursor = c + 1;
+    switch (*c)
+    {
+        case '&':
+            // "&>" sends stdout and stderr to a file
+            if (c + 1 < end && c[1] == '>')
+            {
+                *cursor = c + 2;
+                return TOKEN_ALL_OUTPUT;
+            }
+            return TOKEN_PARALLEL;
+        case '|':
+            return TOKEN_PIPE;
+        case '>':
+            if (c + 1 < end && c[1] == '>')
+            {
+                *cursor = c + 2;
+                return TOKEN_APPEND;
+            }
+            return TOKEN_REDIRECT;
+        case '<':
+            return TOKEN_INPUT;
+        case '2':
+            // "2>" redirects stderr only at the start of a word ("a2>" is the word "a2" and a '>')
+            if (c + 1 < end && c[1] == '>')
+            {
+                if (c + 3 < end && c[2] == '&' && c[3] == '1')
+                {
+                    *cursor = c + 4;
+                    return TOKEN_ERROR_TO_OUTPUT;
+                }
+                if (c + 2 < end && c[2] == '>')
+                {
+                    *cursor = c + 3;
+                    return TOKEN_ERROR_APPEND;
+                }
+                *cursor = c + 2;
+                return TOKEN_ERROR;
+            }
+            break;
+    }
+
+    // a word ends at a whitespace or an operator
+    *word = c;
+    while (c < end && *c != '\0' && !isspace((unsigned char)*c) && *c != '&' && *c != '|' && *c != '>' && *c != '<')
+    {
+        c++;
+    }
+    *word_length = (size_t)(c - *word);
+    *cursor = c;
+    return TOKEN_WORD;
+}
+
+// parses the line view [line, line + length) in a single pass into the pipelines to run; the words
+// are copied into the line arena and the line itself is never modified
+// a malformed pipeline (missing command or file, words after a redirection, a stream redirected
+// twice) is kept and flagged so the error is reported in order. returns NULL if allocation failed
+struct command_line *parse_command_line(const char *line, size_t length, struct arena *arena)
+{
+    struct command_line *parsed = (struct command_line *)arena_alloc(arena, sizeof(struct command_line));
+    if (parsed == NULL)
+    {
+        return NULL;
+    }
+    parsed->pipelines = NULL;
+    parsed->count = parsed->capacity = 0;
+    parsed->outputs = NULL;
+    parsed->num_outputs = parsed->outputs_capacity = 0;
+    parsed->background = 0;
+    parsed->dynamic = 0;
+
+    // directories read for the patterns of the previous line may have changed since
+    if (!persistent_glob_cache)
+    {
+        glob_cache_clear();
+    }
+
+    const char *cursor = line;
+    const char *end = line + length;
+    struct pipeline *pipeline = NULL;       // pipeline being parsed
+    struct command *cmd = NULL;             // last stage of that pipeline
+    int expect_file = 0;                    // redirection token whose file comes next (0 if none)
+    char expect_cache_input = 0;            // "cache -i" was read, the input file comes next
+    size_t name_length;                     // of "NAME=value"
+    char assignment;                        // the word is a "NAME=value" assignment
+    char expanded;                          // the word had variables in it
+    int token = TOKEN_END;
+    do
+    {
+        const char *word = NULL;
+        size_t word_length = 0;
+        int previous = token;
+        token = next_token(&cursor, end, &word, &word_length);
+
+        // a '&' that ends the line sends the whole line to the background
+        if (token == TOKEN_END && previous == TOKEN_PARALLEL && parsed->count > 0)
+        {
+            parsed->background = 1;
+        }
+
+        if (token == TOKEN_PARALLEL || token == TOKEN_END)
+        {
+            // finish the pipeline; a dangling redirection or an empty last stage is an error, only a
+            // pipeline of a single stage may be nothing but assignments (which set shell variables)
+            if (pipeline && (expect_file || expect_cache_input ||
+                             (cmd->argc == 0 && (cmd->num_assignments == 0 || pipeline->count > 1 || command_redirected(cmd)))))
+            {
+                pipeline->malformed = 1;
+            }
+            pipeline = NULL;
+            cmd = NULL;
+            expect_file = 0;
+            expect_cache_input = 0;
+            continue;
+        }
+
+        // the first token after a '&' starts a new pipeline
+        if (pipeline == NULL)
+        {
+            if ((pipeline = command_line_add_pipeline(parsed, arena)) == NULL ||
+                (cmd = pipeline_add_command(pipeline, arena)) == NULL)
+            {
+                return NULL;
+            }
+        }
+
+        // the rest of a malformed pipeline is skipped
+        if (pipeline->malformed)
+        {
+            continue;
+        }
+
+        switch (token)
+        {
+            case TOKEN_WORD:
+                // "NAME=value" is told apart before expansion; a word that expands to nothing is
+                // dropped, as an unquoted one is in sh
+                name_length = variable_name_length(word, word_length);
+                assignment = name_length > 0 && name_length < word_length && word[name_length] == '=';
+                expanded = memchr(word, '$', word_length) != NULL;
+                parsed->dynamic |= expanded || glob_pattern(word, word_length);
+                if (expanded && (word = expand_word(arena, word, &word_length)) == NULL)
+                {
+                    return NULL;
+                }
+                if (expanded && word_length == 0 && !expect_file && !expect_cache_input)
+                {
+                    break;
+                }
+
+                if (expect_file)
+                {
+                    char *file = arena_strndup(arena, word, word_length);
+                    if (file == NULL)
+                    {
+                        return NULL;
+                    }
+                    if (expect_file == TOKEN_INPUT)
+                    {
+                        cmd->input_file = file;
+                    }
+                    else if (expect_file == TOKEN_ERROR || expect_file == TOKEN_ERROR_APPEND)
+                    {
+                        cmd->error_file = file;
+                        cmd->error_append = (expect_file == TOKEN_ERROR_APPEND);
+                    }
+                    else
+                    {
+                        cmd->output_file = file;
+                        cmd->output_append = (expect_file == TOKEN_APPEND);
+                    }
+                    expect_file = 0;
+                }
+                else if (command_redirected(cmd))
+                {
+                    // only more redirections may follow a redirection
+                    pipeline->malformed = 1;
+                }
+                else if (expect_cache_input)
+                {
+                    char **inputs = (char **)arena_grow_array(arena, pipeline->cache_inputs, pipeline->num_cache_inputs, &pipeline->cache_inputs_capacity, sizeof(char *));
+                    if (inputs == NULL ||
+                        (inputs[pipeline->num_cache_inputs] = arena_strndup(arena, word, word_length)) == NULL)
+                    {
+                        return NULL;
+                    }
+                    pipeline->cache_inputs = inputs;
+                    pipeline->num_cache_inputs++;
+                    expect_cache_input = 0;
+                }
+                else if (cmd->argc == 0 && assignment)
+                {
+                    char **assignments = (char **)arena_grow_array(arena, cmd->assignments, cmd->num_assignments, &cmd->assignments_capacity, sizeof(char *));
+                    if (assignments == NULL ||
+                        (assignments[cmd->num_assignments] = arena_strndup(arena, word, word_length)) == NULL)
+                    {
+                        return NULL;
+                    }
+                    cmd->assignments = assignments;
+                    cmd->num_assignments++;
+                }
+                else if (pipeline->count == 1 && cmd->argc == 0 && !pipeline->timed && !expanded &&
+                         word_length == 4 && strncmp(word, "time", 4) == 0)
+                {
+                    // "time" in front of a pipeline reports what the whole pipeline cost
+                    pipeline->timed = 1;
+                }
+                else if (pipeline->count == 1 && cmd->argc == 0 && !pipeline->cached && !expanded &&
+                         word_length == 5 && strncmp(word, "cache", 5) == 0)
+                {
+                    // "cache" in front of a pipeline replays its output while nothing it depends on changed
+                    pipeline->cached = 1;
+                }
+                else if (pipeline->cached && pipeline->count == 1 && cmd->argc == 0 && !expanded &&
+                         word_length == 2 && strncmp(word, "-i", 2) == 0)
+                {
+                    expect_cache_input = 1;
+                }
+                else if (glob_pattern(word, word_length) ? !command_add_glob(cmd, arena, word, word_length) :
+                                                           !command_add_arg(cmd, arena, word, word_length))
+                {
+                    return NULL;
+                }
+                break;
+            case TOKEN_REDIRECT:
+            case TOKEN_APPEND:
+            case TOKEN_ALL_OUTPUT:
+                // a single output file per command
+                if (expect_file || cmd->output_file ||
+                    (token == TOKEN_ALL_OUTPUT && (cmd->error_file || cmd->error_to_output)))
+                {
+                    pipeline->malformed = 1;
+                }
+                // like bash, "2>&1 > file" leaves stderr on the stdout it had before the file
+                cmd->error_before_output = cmd->error_to_output && token != TOKEN_ALL_OUTPUT;
+                cmd->error_to_output |= (token == TOKEN_ALL_OUTPUT);
+                expect_file = token;
+                break;
+            case TOKEN_INPUT:
+                if (expect_file || cmd->input_file)
+                {
+                    pipeline->malformed = 1;
+                }
+                expect_file = token;
+                break;
+            case TOKEN_ERROR:
+            case TOKEN_ERROR_APPEND:
+            case TOKEN_ERROR_TO_OUTPUT:
+                // stderr goes to a single place
+                if (expect_file || cmd->error_file || cmd->error_to_output)
+                {
+                    pipeline->malformed = 1;
+                }
+                if (token == TOKEN_ERROR_TO_OUTPUT)
+                {
+                    cmd->error_to_output = 1;
+                }
+                else
+                {
+                    expect_file = token;
+                }
+                break;
+            case TOKEN_PIPE:
+                // the stage before '|' needs a command
+                if (expect_file || cmd->argc == 0)
+                {
+                    pipeline->malformed = 1;
+                }
+                else if ((cmd = pipeline_add_command(pipeline, arena)) == NULL)
+                {
+                    return NULL;
+                }
+                break;
+        }
+    } while (token != TOKEN_END);
+
+    return parsed;
+}
+
+// appends an empty pipeline to the parsed line; returns NULL if allocation failed
+struct pipeline *command_line_add_pipeline(struct command_line *parsed, struct arena *arena)
+{
+    struct pipeline *pipelines = (struct pipeline *)arena_grow_array(arena, parsed->pipelines, parsed->count, &parsed->capacity, sizeof(struct pipeline));
+    if (pipelines == NULL)
+    {
+        return NULL;
+    }
+    parsed->pipelines = pipelines;
+
+    struct pipeline *pipeline = &parsed->pipelines[parsed->count++];
+    pipeline->commands = NULL;
+    pipeline->count = pipeline->capacity = 0;
+    pipeline->malformed = 0;
+    pipeline->timed = 0;
+    pipeline->cached = 0;
+    pipeline->cache_inputs = NULL;
+    pipeline->num_cache_inputs = pipeline->cache_inputs_capacity = 0;
+    return pipeline;
+}
+
+// appends an empty stage to the pipeline; returns NULL if allocation failed
+struct command *pipeline_add_command(struct pipeline *pipeline, struct arena *arena)
+{
+    struct command *commands = (struct command *)arena_grow_array(arena, pipeline->commands, pipeline->count, &pipeline->capacity, sizeof(struct command));
+    if (commands == NULL)
+    {
+        return NULL;
+    }
+    pipeline->commands = commands;
+
+    struct command *cmd = &pipeline->commands[pipeline->count++];
+    cmd->args = NULL;
+    cmd->argc = cmd->args_capacity = 0;
+    cmd->output_file = cmd->input_file = cmd->error_file = NULL;
+    cmd->output_append = cmd->error_append = cmd->error_to_output = cmd->error_before_output = 0;
+    cmd->output_fd = cmd->error_fd = -1;
+    cmd->executable_path = NULL;
+    cmd->assignments = NULL;
+    cmd->num_assignments = cmd->assignments_capacity = 0;
+    cmd->environment = NULL;
+    return cmd;
+}
+
+// appends a copy of the word to the arguments of the command; returns 0 if allocation failed
+char command_add_arg(struct command *cmd, struct arena *arena, const char *word, size_t length)
+{
+    // keep room for the NULL terminator, which is in use once there are arguments
+    int used = cmd->argc ? cmd->argc + 1 : 0;
+    char **args = (char **)arena_grow_array(arena, cmd->args, used, &cmd->args_capacity, sizeof(char *));
+    if (args == NULL)
+    {
+        return 0;
+    }
+    cmd->args = args;
+    if ((cmd->args[cmd->argc] = arena_strndup(arena, word, length)) == NULL)
+    {
+        return 0;
+    }
+    cmd->args[++cmd->argc] = NULL;
+    return 1;
+}
+
+// checks if any stream of the command is redirected
+char command_redirected(struct command *cmd)
+{
+    return cmd->output_file || cmd->input_file || cmd->error_file || cmd->error_to_output;
+}
+
+// open flags of an output or error file
+int output_flags(char append)
+{
+    return O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC);
+}
+
+// opens file onto target_fd (of a forked child); the dup2 and close are skipped when the file
+// already got the target fd. returns 0 if the file could not be opened or duplicated
+char redirect_file(const char *file, int flags, int target_fd)
+{
+    int fd = open(file, flags, 0644);
+    if (fd == -1)
+    {
+        return 0;
+    }
+    if (fd != target_fd)
+    {
+        if (dup2(fd, target_fd) == -1)
+        {
+            close(fd);
+            return 0;
+        }
+        close(fd);
+    }
+    return 1;
+}
+
+// -a: opens every output and error file of the line once, truncating it once and in append mode,
+// so that parallel commands writing to the same file add to it instead of overwriting each other
+// returns 0 if a file could not be opened
+char open_shared_outputs(struct command_line *parsed, struct arena *arena)
+{
+    for (int i = 0; i < parsed->count; i++)
+    {
+        struct pipeline *pipeline = &parsed->pipelines[i];
+        for (int j = 0; !pipeline->malformed && j < pipeline->count; j++)
+        {
+            struct command *cmd = &pipeline->commands[j];
+            if (cmd->argc == 0 || check_builtin_cmd(cmd->args[0]))
+            {
+                continue;
+            }
+            if (cmd->output_file &&
+                (cmd->output_fd = shared_output_fd(parsed, arena, cmd->output_file, cmd->output_append)) == -1)
+            {
+                return 0;
+            }
+            if (cmd->error_file &&
+                (cmd->error_fd = shared_output_fd(parsed, arena, cmd->error_file, cmd->error_append)) == -1)
+            {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+// returns the fd of file shared by the line, opening it if it is the first use; -1 on failure
+int shared_output_fd(struct command_line *parsed, struct arena *arena, char *file, char append)
+{
+    for (int i = 0; i < parsed->num_outputs; i++)
+    {
+        if (strcmp(parsed->outputs[i].file, file) == 0)
+        {
+            return parsed->outputs[i].fd;
+        }
+    }
+
+    struct shared_output *outputs = (struct shared_output *)arena_grow_array(arena, parsed->outputs, parsed->num_outputs, &parsed->outputs_capacity, sizeof(struct shared_output));
+    if (outputs == NULL)
+    {
+        return -1;
+    }
+    parsed->outputs = outputs;
+
+    // close-on-exec: the children only keep the copies duplicated onto their stdout/stderr
+    int fd = open(file, output_flags(append) | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    parsed->outputs[parsed->num_outputs].file = file;
+    parsed->outputs[parsed->num_outputs++].fd = fd;
+    return fd;
+}
+
+// closes the shell's copies of the output files shared by the line
+void close_shared_outputs(struct command_line *parsed)
+{
+    for (int i = 0; i < parsed->num_outputs; i++)
+    {
+        close(parsed->outputs[i].fd);
+    }
+    parsed->num_outputs = 0;
+}
+
+// child side of the fork launch engine: connect the pipeline fds (-1 if none), route stdout to the
+// output file (if any) and replace the child with the program the shell already resolved
+void run_extern_cmd(struct command *cmd, int in_fd, int out_fd, char ***shell_path, int *num_path, struct arena *line_arena)
+{
+    trace_in_child = 1;
+    unsigned long long child_start = trace_clock();
+
+    // pipeline fds are close-on-exec, only the duplicated copies survive execv
+    if ((in_fd != -1 && dup2(in_fd, STDIN_FILENO) == -1) ||
+        (out_fd != -1 && dup2(out_fd, STDOUT_FILENO) == -1))
+    {
+        child_system_error(line_arena, shell_path, num_path);
+    }
+
+    // files take precedence over the pipeline fds; a missing input file is the user's mistake
+    if (cmd->input_file && !redirect_file(cmd->input_file, O_RDONLY, STDIN_FILENO))
+    {
+        if (errno != ENOENT && errno != EACCES)
+        {
+            child_system_error(line_arena, shell_path, num_path);
+        }
+        shell_error(ERROR_MESSAGE);
+        deallocate_arena(line_arena);
+        deallocate_shell_path(shell_path, num_path);
+        _exit(1);
+    }
+
+    // rout stdout and stderr to their files (shared ones were opened by the shell), in the order of the line
+    if ((cmd->error_before_output && dup2(STDOUT_FILENO, STDERR_FILENO) == -1) ||
+        (cmd->output_fd != -1 && dup2(cmd->output_fd, STDOUT_FILENO) == -1) ||
+        (cmd->output_fd == -1 && cmd->output_file &&
+         !redirect_file(cmd->output_file, output_flags(cmd->output_append), STDOUT_FILENO)) ||
+        (cmd->error_to_output && !cmd->error_before_output && dup2(STDOUT_FILENO, STDERR_FILENO) == -1) ||
+        (cmd->error_fd != -1 && dup2(cmd->error_fd, STDERR_FILENO) == -1) ||
+        (cmd->error_fd == -1 && cmd->error_file &&
+         !redirect_file(cmd->error_file, output_flags(cmd->error_append), STDERR_FILENO)))
+    {
+        child_system_error(line_arena, shell_path, num_path);
+    }
+
+    /* IMPORTANT: child's copies of the line, path and hash arenas will not be deallocated manually if execv runs */
+    /* Valgrind may this as a "still reachable" memory leak even if the OS will cleanly reclaim the child's memory */
+    /* May need to create Valgrind suppresion file for this case */
+    trace_record(TRACE_CHILD, child_start, getpid(), cmd->args[0]);
+    execve(cmd->executable_path, cmd->args, cmd->environment ? cmd->environment : environ);
+
+    // a remembered program may have been removed since it was hashed
+    if (errno == ENOENT || errno == EACCES)
+    {
+        shell_error(ERROR_MESSAGE);
+        deallocate_arena(line_arena);
+        deallocate_shell_path(shell_path, num_path);
+        _exit(0);
+    }
+
+    // if execv returns, there was an error
+    child_system_error(line_arena, shell_path, num_path);
+}
+
+// system error in a forked child: the child's copies of the shell's memory are all arenas
+// (line, path and hash), so releasing them is a handful of frees before exiting
+void child_system_error(struct arena *line_arena, char ***shell_path, int *num_path)
+{
+    deallocate_arena(line_arena);
+    deallocate_shell_path(shell_path, num_path);
+    shell_system_error(ERROR_MESSAGE);
+}
+
+// opens the files of cmd in the shell, for the launch paths that hand them to the child
+// (spawn, parked workers); output files shared by the line (-a) are reused as they are
+// returns 0 if a file could not be opened (a system error, as with the fork engine) and -1 if
+// the input file is missing, which is reported without starting the program
+int open_command_files(struct command *cmd, int files[3])
+{
+    files[STDIN_FILENO] = -1;
+    files[STDOUT_FILENO] = cmd->output_fd;
+    files[STDERR_FILENO] = cmd->error_fd;
+
+    if (cmd->input_file && (files[STDIN_FILENO] = open(cmd->input_file, O_RDONLY | O_CLOEXEC)) == -1)
+    {
+        if (errno != ENOENT && errno != EACCES)
+        {
+            return 0;
+        }
+        shell_error(ERROR_MESSAGE);
+        return -1;
+    }
+    if ((files[STDOUT_FILENO] == -1 && cmd->output_file &&
+         (files[STDOUT_FILENO] = open(cmd->output_file, output_flags(cmd->output_append) | O_CLOEXEC, 0644)) == -1) ||
+        (files[STDERR_FILENO] == -1 && cmd->error_file &&
+         (files[STDERR_FILENO] = open(cmd->error_file, output_flags(cmd->error_append) | O_CLOEXEC, 0644)) == -1))
+    {
+        close_command_files(cmd, files);
+        return 0;
+    }
+    return 1;
+}
+
+// checks if a file cmd redirects to is a fifo: opening it blocks until its other end is opened,
+// possibly by a command the shell has yet to start, so only a forked child may open it
+char command_opens_fifo(struct command *cmd)
+{
+    const char *files[3] = { cmd->input_file, cmd->output_fd == -1 ? cmd->output_file : NULL,
+                             cmd->error_fd == -1 ? cmd->error_file : NULL };
+    struct stat info;
+    for (int i = 0; i < 3; i++)
+    {
+        if (files[i] && stat(files[i], &info) == 0 && S_ISFIFO(info.st_mode))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// closes the shell's copies of the files opened by open_command_files; the files shared by the
+// line stay open for the other commands
+void close_command_files(struct command *cmd, int files[3])
+{
+    if (files[STDIN_FILENO] != -1) { close(files[STDIN_FILENO]); }
+    if (files[STDOUT_FILENO] != -1 && files[STDOUT_FILENO] != cmd->output_fd) { close(files[STDOUT_FILENO]); }
+    if (files[STDERR_FILENO] != -1 && files[STDERR_FILENO] != cmd->error_fd) { close(files[STDERR_FILENO]); }
+}
+
+// spawn launch engine: the pipeline fds and files opened by the shell are handed to
+// posix_spawn, so no copy of the shell's page tables is made
+// returns 0 if an output file could not be opened (a system error, as with the fork engine)
+char spawn_extern_cmd(struct command *cmd, int in_fd, int out_fd, pid_t pgid, pid_t *child)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attributes;
+    int files[3];
+    *child = -1;
+
+    int opened = open_command_files(cmd, files);
+    if (opened != 1)
+    {
+        return opened == -1;
+    }
+    if (posix_spawn_file_actions_init(&actions) != 0)
+    {
+        close_command_files(cmd, files);
+        return 0;
+    }
+
+    // background jobs get their own process group; signals the shell ignores are restored
+    posix_spawnattr_init(&attributes);
+    short flags = 0;
+    if (pgid != -1)
+    {
+        posix_spawnattr_setpgroup(&attributes, pgid);
+        flags |= POSIX_SPAWN_SETPGROUP;
+    }
+    if (job_control)
+    {
+        sigset_t defaults;
+        sigemptyset(&defaults);
+        sigaddset(&defaults, SIGTSTP);
+        sigaddset(&defaults, SIGTTIN);
+        sigaddset(&defaults, SIGTTOU);
+        posix_spawnattr_setsigdefault(&attributes, &defaults);
+        flags |= POSIX_SPAWN_SETSIGDEF;
+    }
+    posix_spawnattr_setflags(&attributes, flags);
+
+    // files take precedence over the pipe, as they do in the fork engine
+    if (in_fd != -1) { posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO); }
+    if (out_fd != -1) { posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO); }
+    if (files[STDIN_FILENO] != -1) { posix_spawn_file_actions_adddup2(&actions, files[STDIN_FILENO], STDIN_FILENO); }
+    if (cmd->error_before_output) { posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO); }
+    if (files[STDOUT_FILENO] != -1) { posix_spawn_file_actions_adddup2(&actions, files[STDOUT_FILENO], STDOUT_FILENO); }
+    if (cmd->error_to_output && !cmd->error_before_output) { posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO); }
+    if (files[STDERR_FILENO] != -1) { posix_spawn_file_actions_adddup2(&actions, files[STDERR_FILENO], STDERR_FILENO); }
+
+    // a failing exec is reported like a program missing from the path
+    if (posix_spawn(child, cmd->executable_path, &actions, &attributes, cmd->args, cmd->environment ? cmd->environment : environ) != 0)
+    {
+        shell_error(ERROR_MESSAGE);
+        *child = -1;
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attributes);
+    close_command_files(cmd, files);
+    return 1;
+}
+
+// forks workers until worker_pool_size of them are parked (-w), so that the fork of a later command
+// is paid while the shell would otherwise only wait; until_input stops as soon as a line is waiting
+// on stdin. Called while the shell holds no pipe, since a parked worker keeps copies of the shell's
+// fds until it execs. A failed fork only leaves the pool smaller
+void worker_pool_refill(struct batch_file *batch, char until_input)
+{
+    struct pollfd input = { STDIN_FILENO, POLLIN, 0 };
+    while (num_workers < worker_pool_size && !(until_input && poll(&input, 1, 0) != 0))
+    {
+        int sockets[2];
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sockets) == -1)
+        {
+            return;
+        }
+        unsigned long long fork_start = trace_clock();
+        pid_t worker = fork();
+        if (worker == -1)
+        {
+            close(sockets[0]);
+            close(sockets[1]);
+            return;
+        }
+
+        if (worker == 0)
+        {
+            // the other workers only see the shell retire them if nobody else holds their sockets
+            close(sockets[0]);
+            for (int i = 0; i < num_workers; i++)
+            {
+                close(worker_pool[i].socket);
+            }
+            attempt_close_batch(batch);
+            if (job_control)
+            {
+                signal(SIGTSTP, SIG_DFL);
+                signal(SIGTTIN, SIG_DFL);
+                signal(SIGTTOU, SIG_DFL);
+            }
+
+            // execv replaces the worker once a command arrives
+            worker_main(sockets[1]);
+        }
+        close(sockets[1]);
+        worker_pool[num_workers].pid = worker;
+        worker_pool[num_workers].socket = sockets[0];
+        worker_pool[num_workers].environment = environment_changes;
+        worker_pool[num_workers++].directory = directory_changes;
+        trace_record(TRACE_FORK, fork_start, trace_shell_pid, "worker");
+    }
+}
+
+// parked worker: blocks until the shell sends it a command, then joins the requested process group,
+// takes over the fds passed along and replaces itself with the program; the shell closing the
+// socket without a command retires it
+void worker_main(int socket)
+{
+    struct worker_request request;
+    char strings[WORKER_MESSAGE_SIZE];
+    union { char buffer[CMSG_SPACE(4 * sizeof(int))]; struct cmsghdr header; } control;
+    struct iovec parts[2] = { { &request, sizeof(request) }, { strings, sizeof(strings) } };
+    struct msghdr message = { 0 };
+    message.msg_iov = parts;
+    message.msg_iovlen = 2;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+
+    ssize_t length;
+    do
+    {
+        length = recvmsg(socket, &message, MSG_CMSG_CLOEXEC);
+    } while (length == -1 && errno == EINTR);
+    if (length < (ssize_t)sizeof(request))
+    {
+        _exit(0);
+    }
+    trace_in_child = 1;
+    unsigned long long child_start = trace_clock();
+
+    // the executable path comes first, then the arguments and the environment
+    char **args = (char **)malloc((request.argc + request.envc + 2) * sizeof(char *));
+    if (args == NULL)
+    {
+        shell_system_error(ERROR_MESSAGE);
+    }
+    char *path = strings;
+    char *cursor = path + strlen(path) + 1;
+    for (int i = 0; i < request.argc + 1 + request.envc; i++)
+    {
+        if (i == request.argc)
+        {
+            args[i] = NULL;
+            continue;
+        }
+        args[i] = cursor;
+        cursor += strlen(cursor) + 1;
+    }
+    args[request.argc + 1 + request.envc] = NULL;
+    char **environment = request.envc > 0 ? args + request.argc + 1 : environ;
+
+    int fds[4];
+    int num_fds = 0;
+    int next = 0;
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    if (header != NULL && header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS)
+    {
+        num_fds = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(header), num_fds * sizeof(int));
+    }
+
+    // the fds arrive in the order the fork engine applies its redirections
+    if (request.pgid != -1) { setpgid(0, request.pgid); }
+    if (request.cpu != -1) { pin_to_cpu(request.cpu); }
+    if (((request.flags & WORKER_FD_DIRECTORY) && (next >= num_fds || fchdir(fds[next++]) == -1)) ||
+        ((request.flags & WORKER_FD_INPUT) && (next >= num_fds || dup2(fds[next++], STDIN_FILENO) == -1)) ||
+        ((request.flags & WORKER_FD_OUTPUT) && (next >= num_fds || dup2(fds[next++], STDOUT_FILENO) == -1)) ||
+        ((request.flags & WORKER_ERROR_TO_OUTPUT) && dup2(STDOUT_FILENO, STDERR_FILENO) == -1) ||
+        ((request.flags & WORKER_FD_ERROR) && (next >= num_fds || dup2(fds[next++], STDERR_FILENO) == -1)))
+    {
+        shell_system_error(ERROR_MESSAGE);
+    }
+
+    trace_record(TRACE_CHILD, child_start, getpid(), args[0]);
+    execve(path, args, environment);
+
+    // a remembered program may have been removed since it was hashed
+    if (errno == ENOENT || errno == EACCES)
+    {
+        shell_error(ERROR_MESSAGE);
+        _exit(0);
+    }
+    shell_system_error(ERROR_MESSAGE);
+}
+
+// hands cmd to a parked worker (-w) together with the pipeline fds and the files opened by the shell,
+// so that only the exec is left between the line and the running program; the worker is the child
+// returns 0 on a system error and WORKER_UNAVAILABLE if no parked worker could take the command
+char worker_dispatch(struct command *cmd, int in_fd, int out_fd, pid_t pgid, int cpu, pid_t *child)
+{
+    *child = -1;
+    int files[3];
+    int opened = open_command_files(cmd, files);
+    if (opened != 1)
+    {
+        return opened == -1;
+    }
+
+    // the most recently parked worker is used first; one that died while parked is dropped
+    // (it is reaped like any other child) and the next one is tried, with a request of its own
+    // since it may have been forked before a cd or an export
+    char result = WORKER_UNAVAILABLE;
+    while (num_workers > 0)
+    {
+        struct worker *worker = &worker_pool[num_workers - 1];
+        char sent = worker_send(worker, cmd, in_fd, out_fd, files, pgid, cpu);
+        if (sent == WORKER_UNAVAILABLE)
+        {
+            // left to the engine, the worker stays parked
+            break;
+        }
+        num_workers--;
+        close(worker->socket);
+        if (sent)
+        {
+            // set the group in the shell too, so that it is in place whichever process runs first
+            if (pgid != -1) { setpgid(worker->pid, pgid ? pgid : worker->pid); }
+            *child = worker->pid;
+            result = 1;
+            break;
+        }
+    }
+
+    close_command_files(cmd, files);
+    return result;
+}
+
+// sends cmd to one parked worker, with the environment and the working directory if they changed
+// since the worker was forked; files are the ones opened by the shell for cmd
+// returns 1 if it was sent, 0 if the worker is gone and WORKER_UNAVAILABLE if the command does not
+// fit in a request (or the directory cannot be passed along)
+char worker_send(struct worker *worker, struct command *cmd, int in_fd, int out_fd, int files[3], pid_t pgid, int cpu)
+{
+    struct worker_request request = { pgid, cpu, 0, cmd->argc, 0 };
+    char strings[WORKER_MESSAGE_SIZE];
+    size_t length = 0;
+
+    // the environment goes along if the command has its own or if it changed since the worker was forked
+    char **environment = cmd->environment;
+    if (environment == NULL && worker->environment != environment_changes)
+    {
+        environment = environ;
+    }
+    while (environment != NULL && environment[request.envc] != NULL)
+    {
+        request.envc++;
+    }
+
+    // commands too long for one request are left to the engine
+    for (int i = -1; i < cmd->argc + request.envc; i++)
+    {
+        const char *str = i == -1 ? cmd->executable_path : (i < cmd->argc ? cmd->args[i] : environment[i - cmd->argc]);
+        size_t size = strlen(str) + 1;
+        if (length + size > sizeof(strings))
+        {
+            return WORKER_UNAVAILABLE;
+        }
+        memcpy(strings + length, str, size);
+        length += size;
+    }
+
+    // files take precedence over the pipe, as they do in the engines
+    int fds[4];
+    int num_fds = 0;
+    int directory = -1;
+    int input = files[STDIN_FILENO] != -1 ? files[STDIN_FILENO] : in_fd;
+    int output = files[STDOUT_FILENO] != -1 ? files[STDOUT_FILENO] : out_fd;
+    if (worker->directory != directory_changes)
+    {
+        if ((directory = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC)) == -1)
+        {
+            return WORKER_UNAVAILABLE;
+        }
+        fds[num_fds++] = directory;
+        request.flags |= WORKER_FD_DIRECTORY;
+    }
+    if (input != -1) { fds[num_fds++] = input; request.flags |= WORKER_FD_INPUT; }
+    if (output != -1) { fds[num_fds++] = output; request.flags |= WORKER_FD_OUTPUT; }
+    if (cmd->error_to_output && !cmd->error_before_output) { request.flags |= WORKER_ERROR_TO_OUTPUT; }
+    if (files[STDERR_FILENO] != -1) { fds[num_fds++] = files[STDERR_FILENO]; request.flags |= WORKER_FD_ERROR; }
+
+    // "2>&1 > file" sends stderr where stdout went before the file: the pipe, or the shell's stdout
+    if (cmd->error_before_output)
+    {
+        fds[num_fds++] = out_fd != -1 ? out_fd : STDOUT_FILENO;
+        request.flags |= WORKER_FD_ERROR;
+    }
+
+    union { char buffer[CMSG_SPACE(4 * sizeof(int))]; struct cmsghdr header; } control;
+    struct iovec parts[2] = { { &request, sizeof(request) }, { strings, length } };
+    struct msghdr message = { 0 };
+    message.msg_iov = parts;
+    message.msg_iovlen = 2;
+    if (num_fds > 0)
+    {
+        message.msg_control = control.buffer;
+        message.msg_controllen = CMSG_SPACE(num_fds * sizeof(int));
+        struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(num_fds * sizeof(int));
+        memcpy(CMSG_DATA(header), fds, num_fds * sizeof(int));
+    }
+
+    char sent = sendmsg(worker->socket, &message, MSG_NOSIGNAL) == (ssize_t)(sizeof(request) + length);
+    if (directory != -1) { close(directory); }
+    return sent;
+}
+
+// listens on the server socket (-D) and runs every script a client (-c) sends in a shell forked
+// from the server; that shell returns from here with the client's working directory, stdin, stdout,
+// stderr and environment in place and the script to run, and the server sends its exit status back
+// to the client once it is reaped. The shells start from the server's state, whose program hash
+// learns what they look up
+char *server_main(char ***shell_path, int *num_path)
+{
+    struct sockaddr_un address, bound;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    bound = address;
+    if (snprintf(address.sun_path, sizeof(address.sun_path), "%s", server_socket) >= (int)sizeof(address.sun_path) ||
+        snprintf(bound.sun_path, sizeof(bound.sun_path), "%s.%d", server_socket, (int)getpid()) >= (int)sizeof(bound.sun_path))
+    {
+        system_error(ERROR_MESSAGE);
+    }
+
+    // a socket left behind by a server that is gone is replaced, a live server is left alone
+    int probe = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (probe == -1 || connect(probe, (struct sockaddr *)&address, sizeof(address)) == 0 ||
+        (errno != ECONNREFUSED && errno != ENOENT))
+    {
+        system_error(ERROR_MESSAGE);
+    }
+    close(probe);
+
+    // the socket is bound under a temporary name and only appears once it accepts connections, so a
+    // client that finds it is never refused
+    int listener = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    unlink(bound.sun_path);
+    if (listener == -1 || bind(listener, (struct sockaddr *)&bound, sizeof(bound)) == -1 ||
+        listen(listener, SOMAXCONN) == -1 || rename(bound.sun_path, address.sun_path) == -1)
+    {
+        unlink(bound.sun_path);
+        system_error(ERROR_MESSAGE);
+    }
+
+    // the shells report every program they look up as one packet on the lookup pipe
+    int lookups[2];
+    char *message = (char *)malloc(SERVER_MESSAGE_SIZE);
+    if (message == NULL || pipe2(lookups, O_DIRECT | O_NONBLOCK | O_CLOEXEC) == -1)
+    {
+        system_error(ERROR_MESSAGE);
+    }
+    install_sigchld_handler();
+
+    int num_sessions = 0;
+    int capacity = 16;
+    struct server_session *sessions = (struct server_session *)malloc(capacity * sizeof(struct server_session));
+    struct pollfd *fds = (struct pollfd *)malloc((capacity + 2) * sizeof(struct pollfd));
+    if (sessions == NULL || fds == NULL)
+    {
+        system_error(ERROR_MESSAGE);
+    }
+
+    // a shell is parked ahead of the next request (like the workers of -w), so that a request only
+    // has to be handed to it; one forked before the server learned more programs is replaced
+    struct server_session parked = { -1, 0 };
+    unsigned long learned = 0;
+    unsigned long parked_learned = 0;
+    char *script = NULL;
+    while (script == NULL)
+    {
+        if (parked.pid != 0 && parked_learned != learned)
+        {
+            close(parked.socket);
+            parked.socket = -1;
+            parked.pid = 0;
+        }
+        if (parked.pid == 0)
+        {
+            parked_learned = learned;
+            if ((script = server_park_session(&parked, sessions, num_sessions, listener, lookups, message)) != NULL)
+            {
+                break;
+            }
+        }
+
+        // the listener and the self-pipe come first, then a connection per session (-1 is skipped)
+        fds[0].fd = listener;
+        fds[0].events = POLLIN;
+        fds[1].fd = sigchld_pipe[0];
+        fds[1].events = POLLIN;
+        for (int i = 0; i < num_sessions; i++)
+        {
+            fds[i + 2].fd = sessions[i].socket;
+            fds[i + 2].events = POLLIN;
+        }
+        if (poll(fds, num_sessions + 2, -1) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            system_error(ERROR_MESSAGE);
+        }
+
+        // a request is handed to the parked shell; on the connection of a running shell the client
+        // can only hang up, which hangs up the shell and its children too
+        for (int i = 0; i < num_sessions && script == NULL; i++)
+        {
+            if (fds[i + 2].revents == 0 || sessions[i].socket == -1)
+            {
+                continue;
+            }
+            if (sessions[i].pid != 0)
+            {
+                kill(-sessions[i].pid, SIGHUP);
+                close(sessions[i].socket);
+                sessions[i].socket = -1;
+            }
+            else if (parked.pid != 0 ||
+                     (script = server_park_session(&parked, sessions, num_sessions, listener, lookups, message)) == NULL)
+            {
+                server_dispatch_session(&sessions[i], &parked, message);
+            }
+        }
+        if (script != NULL)
+        {
+            break;
+        }
+
+        // programs are learned before a finished shell is reported, so that the client's next
+        // script already finds them
+        char name[PIPE_BUF];
+        ssize_t length;
+        while ((length = read(lookups[0], name, sizeof(name) - 1)) > 0)
+        {
+            name[length] = '\0';
+            cmd_hash_lookup(name, shell_path, num_path, 0);
+            learned++;
+        }
+        if (fds[1].revents & POLLIN)
+        {
+            char drain[64];
+            while (read(sigchld_pipe[0], drain, sizeof(drain)) > 0) { }
+            int status;
+            pid_t pid;
+            while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+            {
+                if (pid == parked.pid)
+                {
+                    close(parked.socket);
+                    parked.socket = -1;
+                    parked.pid = 0;
+                }
+                for (int i = 0; i < num_sessions; i++)
+                {
+                    if (sessions[i].pid == pid)
+                    {
+                        server_finish_session(&sessions[i], status);
+                        break;
+                    }
+                }
+            }
+        }
+
+        // sessions without a connection or a shell are over
+        int kept = 0;
+        for (int i = 0; i < num_sessions; i++)
+        {
+            if (sessions[i].socket != -1 || sessions[i].pid != 0)
+            {
+                sessions[kept++] = sessions[i];
+            }
+        }
+        num_sessions = kept;
+
+        if (fds[0].revents & POLLIN)
+        {
+            int connection = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+            if (connection != -1 && num_sessions == capacity)
+            {
+                int grown = capacity * 2;
+                struct server_session *more_sessions = (struct server_session *)realloc(sessions, grown * sizeof(struct server_session));
+                sessions = more_sessions ? more_sessions : sessions;
+                struct pollfd *more_fds = (struct pollfd *)realloc(fds, (grown + 2) * sizeof(struct pollfd));
+                fds = more_fds ? more_fds : fds;
+                if (more_sessions == NULL || more_fds == NULL)
+                {
+                    system_error(ERROR_MESSAGE);
+                }
+                capacity = grown;
+            }
+            if (connection != -1)
+            {
+                sessions[num_sessions].socket = connection;
+                sessions[num_sessions++].pid = 0;
+            }
+        }
+    }
+    free(sessions);
+    free(fds);
+    return script;
+}
+
+// forks the shell that runs the next request of a client and parks it; returns the script of that
+// request in the shell and NULL in the server (parked is left empty if the fork failed)
+char *server_park_session(struct server_session *parked, struct server_session *sessions, int num_sessions, int listener, int lookups[2], char *message)
+{
+    int sockets[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sockets) == -1)
+    {
+        return NULL;
+    }
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        close(sockets[0]);
+        close(sockets[1]);
+        return NULL;
+    }
+    if (pid > 0)
+    {
+        close(sockets[1]);
+        parked->socket = sockets[0];
+        parked->pid = pid;
+        return NULL;
+    }
+
+    // the shell keeps none of the server's fds; main makes its own SIGCHLD self-pipe
+    close(sockets[0]);
+    close(listener);
+    close(lookups[0]);
+    close(sigchld_pipe[0]);
+    close(sigchld_pipe[1]);
+    for (int i = 0; i < num_sessions; i++)
+    {
+        if (sessions[i].socket != -1)
+        {
+            close(sessions[i].socket);
+        }
+    }
+    server_lookup_fd = lookups[1];
+
+    // a process group of its own, so that a hangup of the client reaches every child; the
+    // programs hashed so far have not been used by this shell yet
+    setpgid(0, 0);
+    for (int i = 0; i < CMD_HASH_BUCKETS; i++)
+    {
+        for (struct cmd_hash_entry *entry = cmd_hash_table[i]; entry != NULL; entry = entry->next)
+        {
+            entry->hits = 0;
+        }
+    }
+
+    // the server closing the socket without a request retires the shell
+    union { char buffer[CMSG_SPACE(4 * sizeof(int))]; struct cmsghdr header; } control;
+    struct iovec part = { message, SERVER_MESSAGE_SIZE - 1 };
+    struct msghdr request = { 0 };
+    request.msg_iov = &part;
+    request.msg_iovlen = 1;
+    request.msg_control = control.buffer;
+    request.msg_controllen = sizeof(control.buffer);
+    ssize_t length;
+    do
+    {
+        length = recvmsg(sockets[1], &request, MSG_CMSG_CLOEXEC);
+    } while (length == -1 && errno == EINTR);
+    struct cmsghdr *header = length > 0 ? CMSG_FIRSTHDR(&request) : NULL;
+    if (header == NULL || header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS ||
+        header->cmsg_len != CMSG_LEN(4 * sizeof(int)))
+    {
+        _exit(0);
+    }
+    int fds[4];
+    memcpy(fds, CMSG_DATA(header), sizeof(fds));
+    close(sockets[1]);
+    clock_gettime(CLOCK_MONOTONIC, &startup_time);
+
+    // the script comes first, then the environment of the client
+    message[length] = '\0';
+    int envc = 0;
+    for (char *cursor = message + strlen(message) + 1; cursor < message + length; cursor += strlen(cursor) + 1)
+    {
+        envc++;
+    }
+    char **environment = (char **)malloc((envc + 1) * sizeof(char *));
+    if (environment == NULL || fchdir(fds[0]) == -1 || dup2(fds[1], STDIN_FILENO) == -1 ||
+        dup2(fds[2], STDOUT_FILENO) == -1 || dup2(fds[3], STDERR_FILENO) == -1)
+    {
+        system_error(ERROR_MESSAGE);
+    }
+    char *cursor = message + strlen(message) + 1;
+    for (int i = 0; i < envc; i++)
+    {
+        environment[i] = cursor;
+        cursor += strlen(cursor) + 1;
+    }
+    environment[envc] = NULL;
+    environ = environment;
+    for (int i = 0; i < 4; i++)
+    {
+        if (fds[i] > STDERR_FILENO)
+        {
+            close(fds[i]);
+        }
+    }
+    return message;
+}
+
+// reads the request of the client of session and hands it to the parked shell, which becomes the
+// session's shell; a request that cannot be run drops the connection. The fds of a request are the
+// client's working directory, stdin, stdout and stderr
+void server_dispatch_session(struct server_session *session, struct server_session *parked, char *message)
+{
+    union { char buffer[CMSG_SPACE(4 * sizeof(int))]; struct cmsghdr header; } control;
+    struct iovec part = { message, SERVER_MESSAGE_SIZE - 1 };
+    struct msghdr request = { 0 };
+    request.msg_iov = &part;
+    request.msg_iovlen = 1;
+    request.msg_control = control.buffer;
+    request.msg_controllen = sizeof(control.buffer);
+
+    ssize_t length = recvmsg(session->socket, &request, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+    int fds[4];
+    int num_fds = 0;
+    struct cmsghdr *header = length > 0 ? CMSG_FIRSTHDR(&request) : NULL;
+    if (header != NULL && header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS)
+    {
+        num_fds = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(header), num_fds * sizeof(int));
+    }
+
+    // the request goes on as it came, fds included
+    part.iov_len = length > 0 ? (size_t)length : 0;
+    if (num_fds == 4 && !(request.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) && message[length - 1] == '\0' &&
+        parked->pid != 0 && sendmsg(parked->socket, &request, MSG_NOSIGNAL) == length)
+    {
+        session->pid = parked->pid;
+    }
+    else
+    {
+        close(session->socket);
+        session->socket = -1;
+    }
+    if (parked->pid != 0 && session->pid == parked->pid)
+    {
+        close(parked->socket);
+        parked->socket = -1;
+        parked->pid = 0;
+    }
+    for (int i = 0; i < num_fds; i++)
+    {
+        close(fds[i]);
+    }
+}
+
+// sends the wait status of a finished shell to its client, if the client is still there
+void server_finish_session(struct server_session *session, int status)
+{
+    if (session->socket != -1)
+    {
+        send(session->socket, &status, sizeof(status), MSG_NOSIGNAL);
+        close(session->socket);
+        session->socket = -1;
+    }
+    session->pid = 0;
+}
+
+// hands the script (stdin without one) to the server on the client socket (-c) together with the
+// working directory, stdin, stdout, stderr and environment, so that the script runs as if this
+// process were the shell, and exits the way the shell running it did
+void client_main(const char *file)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+
+    // the script comes first, then the environment
+    char *message = (char *)malloc(SERVER_MESSAGE_SIZE);
+    size_t length = 0;
+    char fits = message != NULL;
+    for (int i = -1; fits && (i == -1 || environ[i] != NULL); i++)
+    {
+        const char *str = i == -1 ? (file ? file : "/dev/stdin") : environ[i];
+        size_t size = strlen(str) + 1;
+        fits = length + size < SERVER_MESSAGE_SIZE;
+        if (fits)
+        {
+            memcpy(message + length, str, size);
+            length += size;
+        }
+    }
+
+    int fds[4] = { open(".", O_PATH | O_DIRECTORY | O_CLOEXEC), STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+    int connection = -1;
+    if (!fits || fds[0] == -1 ||
+        snprintf(address.sun_path, sizeof(address.sun_path), "%s", client_socket) >= (int)sizeof(address.sun_path) ||
+        (connection = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) == -1 ||
+        connect(connection, (struct sockaddr *)&address, sizeof(address)) == -1)
+    {
+        system_error(ERROR_MESSAGE);
+    }
+
+    union { char buffer[CMSG_SPACE(4 * sizeof(int))]; struct cmsghdr header; } control;
+    struct iovec part = { message, length };
+    struct msghdr request = { 0 };
+    request.msg_iov = &part;
+    request.msg_iovlen = 1;
+    request.msg_control = control.buffer;
+    request.msg_controllen = CMSG_SPACE(4 * sizeof(int));
+    struct cmsghdr *header = CMSG_FIRSTHDR(&request);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(4 * sizeof(int));
+    memcpy(CMSG_DATA(header), fds, sizeof(fds));
+    if (sendmsg(connection, &request, MSG_NOSIGNAL) != (ssize_t)length)
+    {
+        system_error(ERROR_MESSAGE);
+    }
+    close(fds[0]);
+    free(message);
+
+    // the server closes the connection without a status only if it could not run the script
+    int status;
+    ssize_t received;
+    do
+    {
+        received = recv(connection, &status, sizeof(status), 0);
+    } while (received == -1 && errno == EINTR);
+    if (received != sizeof(status))
+    {
+        system_error(ERROR_MESSAGE);
+    }
+    close(connection);
+    exit(WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+}
+
+// launches an external command with the selected engine, reading from in_fd and writing to out_fd
+// (-1 keeps the shell's stdin/stdout) in process group pgid (0 starts a new group, -1 stays in the shell's)
+// returns the child pid, -1 if the program could not be started
+pid_t launch_extern_cmd(struct command *cmd, int in_fd, int out_fd, pid_t pgid, char ***shell_path, int *num_path, struct batch_file *batch, struct arena *line_arena)
+{
+    pid_t child;
+    unsigned long long launch_start = trace_clock();
+
+    // a pinned child (-k) pins itself before execv, so whatever the program starts inherits the cpu
+    int cpu = pin_children ? pin_next_cpu() : -1;
+
+    // workers and spawn are handed files the shell opened, a command with a fifo is forked instead
+    char forked = (num_workers > 0 || launch_engine == LAUNCH_ENGINE_SPAWN) && command_redirected(cmd) && command_opens_fifo(cmd);
+
+    // a parked worker only has to exec (-w); without one the engine starts the program
+    char dispatched = num_workers > 0 && !forked ? worker_dispatch(cmd, in_fd, out_fd, pgid, cpu, &child) : WORKER_UNAVAILABLE;
+    if (dispatched == 0)
+    {
+        deallocate_arena(line_arena);
+        attempt_close_batch(batch);
+        deallocate_shell_path(shell_path, num_path);
+        system_error(ERROR_MESSAGE);
+    }
+    if (dispatched == 1)
+    {
+        trace_record(TRACE_DISPATCH, launch_start, trace_shell_pid, cmd->args[0]);
+        return child;
+    }
+
+    // posix_spawn cannot pin the child before it execs, pinned children are forked
+    if (launch_engine == LAUNCH_ENGINE_SPAWN && cpu == -1 && !forked)
+    {
+        if (!spawn_extern_cmd(cmd, in_fd, out_fd, pgid, &child))
+        {
+            deallocate_arena(line_arena);
+            attempt_close_batch(batch);
+            deallocate_shell_path(shell_path, num_path);
+            system_error(ERROR_MESSAGE);
+        }
+        trace_record(TRACE_SPAWN, launch_start, trace_shell_pid, cmd->args[0]);
+        return child;
+    }
+
+    // attempt fork
+    child = fork();
+    if (child == -1)
+    {
+        deallocate_arena(line_arena);
+        attempt_close_batch(batch);
+        deallocate_shell_path(shell_path, num_path);
+        system_error(ERROR_MESSAGE);
+    }
+
+    if (child == 0)
+    {
+        // close child's copy of file stream; the words of a precompiled line live in the mapping
+        // of its records, which execv drops anyway
+        batch->compiled = NULL;
+        attempt_close_batch(batch);
+
+        // background jobs get their own process group; signals the shell ignores are restored
+        if (pgid != -1) { setpgid(0, pgid); }
+        if (cpu != -1) { pin_to_cpu(cpu); }
+        if (job_control)
+        {
+            signal(SIGTSTP, SIG_DFL);
+            signal(SIGTTIN, SIG_DFL);
+            signal(SIGTTOU, SIG_DFL);
+        }
+
+        // execv replaces the child process
+        run_extern_cmd(cmd, in_fd, out_fd, shell_path, num_path, line_arena);
+    }
+    // set the group in the parent too, so that it is in place whichever process runs first
+    if (pgid != -1) { setpgid(child, pgid ? pgid : child); }
+    trace_record(TRACE_FORK, launch_start, trace_shell_pid, cmd->args[0]);
+    return child;
+}
+
+// run a single process or a pipeline of processes (cmd1 | cmd2 | ...) of a parsed line; built-ins
+// run directly in the shell, other programs are launched with the selected engine once every stage
+// has been resolved. All stages of a pipeline run concurrently and are added to jobs.
+// returns BUILTIN_EXIT_REQUEST if the command asked the shell to exit
+char cmd_process(struct pipeline *pipeline, struct job_table *jobs, char ***shell_path, int *num_path, struct batch_file *batch, struct arena *line_arena)
+{
+    // $? follows the last pipeline of the line
+    jobs->status_pid = 0;
+    if (pipeline->malformed)
+    {
+        shell_error(ERROR_MESSAGE);
+        last_status = 2;
+        return BUILTIN_DONE;
+    }
+
+    // a command of only assignments sets shell variables (exported ones in the environment too)
+    struct command *first = &pipeline->commands[0];
+    if (first->argc == 0)
+    {
+        for (int i = 0; i < first->num_assignments; i++)
+        {
+            char *assignment = first->assignments[i];
+            size_t name_length = strchr(assignment, '=') - assignment;
+            if (!variable_set(assignment, name_length, assignment + name_length + 1, strlen(assignment + name_length + 1), 0))
+            {
+                deallocate_arena(line_arena);
+                attempt_close_batch(batch);
+                deallocate_shell_path(shell_path, num_path);
+                system_error(ERROR_MESSAGE);
+            }
+        }
+        last_status = 0;
+        return BUILTIN_DONE;
+    }
+
+    // check which command-running method to do; built-ins only run on their own
+    for (int i = 0; i < pipeline->count; i++)
+    {
+        if (check_builtin_cmd(pipeline->commands[i].args[0]))
+        {
+            if (pipeline->count > 1)
+            {
+                builtin_error();
+                return BUILTIN_DONE;
+            }
+            if (!pipeline->timed)
+            {
+                return run_builtin_cmd(&pipeline->commands[0], jobs, shell_path, num_path);
+            }
+
+            // a built-in runs in the shell, so its cost is the shell's own usage while it ran
+            struct timespec start, end;
+            struct rusage before, after;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            getrusage(RUSAGE_SELF, &before);
+            char result = run_builtin_cmd(&pipeline->commands[0], jobs, shell_path, num_path);
+            getrusage(RUSAGE_SELF, &after);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            time_report(timespec_seconds(&start, &end),
+                        timeval_seconds(&after.ru_utime) - timeval_seconds(&before.ru_utime),
+                        timeval_seconds(&after.ru_stime) - timeval_seconds(&before.ru_stime));
+            return result;
+        }
+    }
+
+    // search the shell path in the shell itself so the result can be remembered
+    unsigned long long resolve_start = trace_clock();
+    for (int i = 0; i < pipeline->count; i++)
+    {
+        struct command *cmd = &pipeline->commands[i];
+        if ((cmd->executable_path = cmd_hash_lookup(cmd->args[0], shell_path, num_path, 1)) == NULL)
+        {
+            shell_error(ERROR_MESSAGE);
+            last_status = 127;
+            return BUILTIN_DONE;
+        }
+        if (cmd->num_assignments > 0 && (cmd->environment = command_environment(cmd, line_arena)) == NULL)
+        {
+            deallocate_arena(line_arena);
+            attempt_close_batch(batch);
+            deallocate_shell_path(shell_path, num_path);
+            system_error(ERROR_MESSAGE);
+        }
+    }
+    trace_record(TRACE_RESOLVE, resolve_start, trace_shell_pid, pipeline->commands[0].args[0]);
+
+    // the stdout of a pipeline of a line whose outputs are collected goes to the shell, which
+    // writes it out in order (-o); a cached pipeline writes its own output
+    struct command *last = &pipeline->commands[pipeline->count - 1];
+    char captured = jobs->capturing && !pipeline->cached && last->output_file == NULL && last->output_fd == -1;
+    int capture = -1;
+
+    // a foreground line of only a program with a fast built-in runs that in the shell; the program
+    // was resolved all the same, so a shell path without it still fails the command. in a parallel
+    // line it is launched like any program, since the shell running it would hold up the commands
+    // after it (which may be the ones it waits for, e.g. the reader of a fifo it writes)
+    const struct fast_builtin *builtin = NULL;
+    if (pipeline->count == 1 && !pipeline->cached && !jobs->line_background && jobs->line_pipelines == 1 &&
+        (builtin = fast_builtin_find(first->args[0])) != NULL)
+    {
+        struct timespec start, end;
+        struct rusage before, after;
+        unsigned long long builtin_start = trace_clock();
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        getrusage(RUSAGE_SELF, &before);
+        int status = fast_builtin_run(builtin, first);
+        if (status == FAST_BUILTIN_SYSTEM_ERROR)
+        {
+            deallocate_arena(line_arena);
+            attempt_close_batch(batch);
+            deallocate_shell_path(shell_path, num_path);
+            system_error(ERROR_MESSAGE);
+        }
+        if (status != FAST_BUILTIN_DECLINED)
+        {
+            trace_record(TRACE_BUILTIN, builtin_start, trace_shell_pid, first->args[0]);
+            last_status = status;
+            if (pipeline->timed)
+            {
+                getrusage(RUSAGE_SELF, &after);
+                clock_gettime(CLOCK_MONOTONIC, &end);
+                time_report(timespec_seconds(&start, &end),
+                            timeval_seconds(&after.ru_utime) - timeval_seconds(&before.ru_utime),
+                            timeval_seconds(&after.ru_stime) - timeval_seconds(&before.ru_stime));
+            }
+            return BUILTIN_DONE;
+        }
+    }
+    if (captured && (capture = output_start(jobs, last)) == -1)
+    {
+        deallocate_arena(line_arena);
+        attempt_close_batch(batch);
+        deallocate_shell_path(shell_path, num_path);
+        system_error(ERROR_MESSAGE);
+    }
+
+    // a cached pipeline whose inputs did not change replays its output instead of running; otherwise
+    // the stdout of its last stage is captured so it can be stored once the stage is reaped
+    int fill = -1;
+    if (pipeline->cached)
+    {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        size_t length;
+        char *material = cache_material(pipeline, &length);
+        int output_fd = material ? cache_output_fd(last) : -1;
+        if (output_fd == -1)
+        {
+            free(material);
+            deallocate_arena(line_arena);
+            attempt_close_batch(batch);
+            deallocate_shell_path(shell_path, num_path);
+            system_error(ERROR_MESSAGE);
+        }
+
+        unsigned long long key = cache_key(material, length);
+        if (cache_replay(key, material, length, output_fd, &last_status))
+        {
+            free(material);
+            close(output_fd);
+            if (pipeline->timed)
+            {
+                clock_gettime(CLOCK_MONOTONIC, &end);
+                time_report(timespec_seconds(&start, &end), 0, 0);
+            }
+            return BUILTIN_DONE;
+        }
+
+        int capture_fd = memfd_create("wish-cache", MFD_CLOEXEC);
+        if (capture_fd == -1 || (fill = job_table_start_fill(jobs)) == -1)
+        {
+            if (capture_fd != -1) { close(capture_fd); }
+            free(material);
+            close(output_fd);
+            deallocate_arena(line_arena);
+            attempt_close_batch(batch);
             deallocate_shell_path(shell_path, num_path);
-            deallocate_string(&filename_final);
-            shell_system_error(ERROR_MESSAGE);
+            system_error(ERROR_MESSAGE);
+        }
+        jobs->fills[fill].material = material;
+        jobs->fills[fill].material_length = length;
+        jobs->fills[fill].key = key;
+        jobs->fills[fill].capture_fd = capture_fd;
+        jobs->fills[fill].output_fd = output_fd;
+
+        // the engines treat it like a file opened by the shell for the line (-a)
+        last->output_fd = capture_fd;
+    }
+
+    // make room for the stages and queue behind the concurrency cap (if any); a pipeline is
+    // started as a whole since its stages depend on each other
+    if (!job_table_reserve(jobs, pipeline->count))
+    {
+        deallocate_arena(line_arena);
+        attempt_close_batch(batch);
+        deallocate_shell_path(shell_path, num_path);
+        system_error(ERROR_MESSAGE);
+    }
+    job_table_wait_for_slots(jobs, pipeline->count);
+
+    // a timed pipeline is reported once its last stage has been reaped
+    int timer = -1;
+    if (pipeline->timed && (timer = job_table_start_timer(jobs)) == -1)
+    {
+        deallocate_arena(line_arena);
+        attempt_close_batch(batch);
+        deallocate_shell_path(shell_path, num_path);
+        system_error(ERROR_MESSAGE);
+    }
+
+    // connect each stage to the next with a pipe and start them all
+    int in_fd = -1;
+    for (int i = 0; i < pipeline->count; i++)
+    {
+        int pipe_fds[2] = { -1, -1 };
+        if (i < pipeline->count - 1)
+        {
+            unsigned long long pipe_start = trace_clock();
+            if (pipe2(pipe_fds, O_CLOEXEC) == -1)
+            {
+                deallocate_arena(line_arena);
+                attempt_close_batch(batch);
+                deallocate_shell_path(shell_path, num_path);
+                system_error(ERROR_MESSAGE);
+            }
+            if (pipe_buffer_size > 0)
+            {
+                // larger buffers let busy stages stream without waiting on each other;
+                // the kernel may refuse sizes above its limit, the default is kept then
+                fcntl(pipe_fds[1], F_SETPIPE_SZ, pipe_buffer_size);
+            }
+            trace_record(TRACE_PIPE, pipe_start, trace_shell_pid, "");
+        }
+
+        // children of a background job join the group of its first child
+        struct background_job *background = job_table_find_background(jobs, jobs->launch_job);
+        pid_t pgid = background ? background->pgid : -1;
+
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        pid_t child = launch_extern_cmd(&pipeline->commands[i], in_fd, pipe_fds[1], pgid, shell_path, num_path, batch, line_arena);
+        if (child > 0)
+        {
+            job_table_add(jobs, child, &pipeline->commands[i], &start, timer);  // update child process list
+            if (i == pipeline->count - 1)
+            {
+                jobs->children[jobs->count - 1].cache_fill = fill;
+                jobs->status_pid = child;
+            }
+        }
+        else if (i == pipeline->count - 1)
+        {
+            // the last stage could not be started, there is nothing to store
+            if (fill != -1)
+            {
+                cache_finish(&jobs->fills[fill], 0, 0);
+            }
+            last_status = 127;
+        }
+
+        // the children hold their own copies of the pipe ends
+        if (in_fd != -1) { close(in_fd); }
+        if (pipe_fds[1] != -1) { close(pipe_fds[1]); }
+        in_fd = pipe_fds[0];
+    }
+
+    // the last stage holds the write end of its capture pipe, which ends once it exits
+    if (capture != -1)
+    {
+        close(last->output_fd);
+        last->output_fd = -1;
+    }
+
+    // none of the stages could be started
+    if (timer != -1 && jobs->timers[timer].running == 0)
+    {
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        time_report(timespec_seconds(&jobs->timers[timer].start, &end), 0, 0);
+    }
+    return BUILTIN_DONE;
+}
+
+// runs the pipelines of a parsed line in parallel; the children are left running (in the job table)
+// unless wait_for_line is set. A line ending with '&' becomes a background job that is never waited
+// for here. buffer is only deallocated if the shell exits
+void cmd_run_processes(struct command_line *parsed, char **buffer, struct job_table *jobs, char wait_for_line, char ***shell_path, int *num_path, struct batch_file *batch, struct arena *line_arena)
+{
+    // with job control every line is a job of its own, so that a foreground line can be stopped
+    // (Ctrl-Z) without stopping the shell and continued later with fg or bg
+    if ((shared_outputs && !open_shared_outputs(parsed, line_arena)) ||
+        ((parsed->background || job_control) && (jobs->launch_job = job_table_start_background(jobs, parsed)) == 0))
+    {
+        deallocate_arena(line_arena);
+        attempt_close_batch(batch);
+        deallocate_shell_path(shell_path, num_path);
+        system_error(ERROR_MESSAGE);
+    }
+
+    // the outputs of a parallel line the shell waits for can be collected and written in order (-o)
+    jobs->capturing = output_mode != OUTPUT_DIRECT && wait_for_line && parsed->count > 1 && !parsed->background && !job_control;
+
+    char exit_requested = 0;
+    jobs->line_pipelines = parsed->count;
+    jobs->line_background = parsed->background;
+    for (int i = 0; i < parsed->count; i++)
+    {
+        jobs->line_pipeline = i;
+        if (cmd_process(&parsed->pipelines[i], jobs, shell_path, num_path, batch, line_arena) == BUILTIN_EXIT_REQUEST)
+        {
+            exit_requested = 1;
+        }
+    }
+    close_shared_outputs(parsed);
+    if (parsed->background)
+    {
+        // a line sent to the background succeeds right away
+        jobs->status_pid = 0;
+        last_status = 0;
+    }
+
+    // park new workers while the children just started run (the line holds no pipe anymore); on a
+    // single cpu the forks would only hold the children up
+    if (jobs->count > 0 && worker_refill_while_running)
+    {
+        worker_pool_refill(batch, 0);
+    }
+
+    // a background line that started no child (only built-ins or errors) leaves no job behind
+    if (jobs->launch_job)
+    {
+        struct background_job *background = job_table_find_background(jobs, jobs->launch_job);
+        jobs->launch_job = 0;
+        if (background->running == 0 && background->state != JOB_DONE)
+        {
+            job_table_remove_background(jobs, (int)(background - jobs->background));
+        }
+        else if (!parsed->background)
+        {
+            job_table_foreground(jobs, background);
+        }
+        else if (job_control)
+        {
+            dprintf(STDERR_FILENO, "[%d] %d\n", background->id, (int)background->last_pid);
+        }
+    }
+
+    // let the parallel commands finish before honouring an exit request, which also waits
+    // for the background jobs
+    if (wait_for_line || exit_requested)
+    {
+        wait_and_check_child_exit_status(jobs, exit_requested, buffer, shell_path, num_path, batch);
+    }
+    if (jobs->capturing)
+    {
+        output_finish(jobs);
+    }
+    if (exit_requested)
+    {
+        deallocate_arena(line_arena);
+        exit_shell_request(jobs, buffer, shell_path, num_path, batch);
+    }
+}
+
+// makes sure the job table can take needed more children; returns 0 if allocation failed
+char job_table_reserve(struct job_table *jobs, int needed)
+{
+    if (jobs->count + needed <= jobs->capacity)
+    {
+        return 1;
+    }
+    if (jobs->children == NULL)
+    {
+        // the first children go into the static table
+        jobs->children = job_table_storage;
+        jobs->capacity = JOB_TABLE_INIT_SIZE;
+        if (jobs->count + needed <= jobs->capacity)
+        {
+            return 1;
+        }
+    }
+    int capacity = jobs->capacity;
+    while (capacity < jobs->count + needed)
+    {
+        capacity *= 2;
+    }
+    struct job *children;
+    if (jobs->children == job_table_storage)
+    {
+        children = (struct job *)malloc(capacity * sizeof(struct job));
+        if (children != NULL)
+        {
+            memcpy(children, job_table_storage, jobs->count * sizeof(struct job));
+        }
+    }
+    else
+    {
+        children = (struct job *)realloc(jobs->children, capacity * sizeof(struct job));
+    }
+    if (children == NULL)
+    {
+        return 0;
+    }
+    jobs->children = children;
+    jobs->capacity = capacity;
+    return 1;
+}
+
+// waits for whichever running child finishes first, accounts for the resources it used
+// and remembers if it hit a system error; a stopped or continued child only updates its job
+// options may be WNOHANG to only reap a child that already changed state
+// returns 0 if no child changed state
+char job_table_reap_any(struct job_table *jobs, int options)
+{
+    int child_status;
+    struct rusage usage;
+    unsigned long long wait_start = trace_clock();
+
+    // while the outputs of the line are collected, the shell moves them along until a child can
+    // be reaped, so that no pipeline is held up by a full pipe in the meantime (-o)
+    if (!(options & WNOHANG) && jobs->captures_open > 0)
+    {
+        output_drain(jobs, 1);
+        options |= jobs->captures_open > 0 ? WNOHANG : 0;
+    }
+    pid_t child = wait4(-1, &child_status, options | WUNTRACED | WCONTINUED, &usage);
+    if (child <= 0)
+    {
+        // no children are left to wait for
+        if (child == -1 && errno == ECHILD)
+        {
+            jobs->count = jobs->foreground = 0;
+            for (int i = 0; i < jobs->num_background; i++)
+            {
+                jobs->background[i].running = 0;
+                jobs->background[i].state = JOB_DONE;
+            }
+        }
+        return 0;
+    }
+    trace_record(TRACE_WAIT, wait_start, trace_shell_pid, "");
+    unsigned long long reap_start = trace_clock();
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    for (int i = 0; i < jobs->count; i++)
+    {
+        struct job *job = &jobs->children[i];
+        if (job->pid == child)
+        {
+            struct background_job *background = job_table_find_background(jobs, job->job_id);
+            if (WIFSTOPPED(child_status) && background && background->id == jobs->terminal_job &&
+                (WSTOPSIG(child_status) == SIGTTIN || WSTOPSIG(child_status) == SIGTTOU))
+            {
+                // the job touched the terminal before the shell handed it over; it has it now
+                kill(-background->pgid, SIGCONT);
+                return 1;
+            }
+            if (WIFSTOPPED(child_status) || WIFCONTINUED(child_status))
+            {
+                if (background)
+                {
+                    background->state = WIFSTOPPED(child_status) ? JOB_STOPPED : JOB_RUNNING;
+                }
+                return 1;
+            }
+
+            stats_record(job, child_status, &usage, timespec_seconds(&job->start, &end));
+            if (job->timer != -1)
+            {
+                struct pipeline_timer *timer = &jobs->timers[job->timer];
+                timer->user += timeval_seconds(&usage.ru_utime);
+                timer->sys += timeval_seconds(&usage.ru_stime);
+                if (--timer->running == 0)
+                {
+                    time_report(timespec_seconds(&timer->start, &end), timer->user, timer->sys);
+                }
+            }
+            if (job->cache_fill != -1)
+            {
+                cache_finish(&jobs->fills[job->cache_fill], WIFEXITED(child_status) &&
+                             WEXITSTATUS(child_status) != CHILD_SYSTEM_ERROR, child_status);
+            }
+            if (WIFEXITED(child_status) && WEXITSTATUS(child_status) == CHILD_SYSTEM_ERROR)
+            {
+                jobs->child_system_error = 1;
+            }
+            if (trace_ring)
+            {
+                trace_record(TRACE_RUN, job->start.tv_sec * 1000000000ULL + job->start.tv_nsec, child, job->command);
+                trace_record(TRACE_REAP, reap_start, trace_shell_pid, job->command);
+            }
+            if (child == jobs->status_pid)
+            {
+                last_status = WIFEXITED(child_status) ? WEXITSTATUS(child_status) : 128 + WTERMSIG(child_status);
+                jobs->status_pid = 0;
+            }
+            if (background == NULL)
+            {
+                jobs->foreground--;
+            }
+            else
+            {
+                if (child == background->last_pid)
+                {
+                    background->status = WIFEXITED(child_status) ? WEXITSTATUS(child_status) : 128 + WTERMSIG(child_status);
+                }
+                if (--background->running == 0)
+                {
+                    background->state = JOB_DONE;
+                }
+            }
+            jobs->children[i] = jobs->children[--jobs->count];
+            return 1;
+        }
+    }
+    return 1;
+}
+
+// directory of the result cache: $WISH_CACHE_DIR, else wish under $XDG_CACHE_HOME or ~/.cache;
+// it is created with its parents on first use. returns NULL if it cannot be created
+const char *cache_directory(void)
+{
+    if (cache_dir[0] != '\0')
+    {
+        return cache_dir;
+    }
+
+    char *directory = getenv("WISH_CACHE_DIR");
+    char *base = getenv("XDG_CACHE_HOME");
+    char *home = getenv("HOME");
+    int length;
+    if (directory != NULL && *directory != '\0')
+    {
+        length = snprintf(cache_dir, sizeof(cache_dir), "%s", directory);
+    }
+    else if (base != NULL && *base != '\0')
+    {
+        length = snprintf(cache_dir, sizeof(cache_dir), "%s/wish", base);
+    }
+    else
+    {
+        length = snprintf(cache_dir, sizeof(cache_dir), "%s/.cache/wish", home ? home : "");
+    }
+    if (length <= 0 || length >= (int)sizeof(cache_dir))
+    {
+        cache_dir[0] = '\0';
+        return NULL;
+    }
+
+    // create every missing component, like mkdir -p
+    for (char *slash = cache_dir + 1; slash != NULL; )
+    {
+        slash = strchr(slash, '/');
+        if (slash) { *slash = '\0'; }
+        char created = (mkdir(cache_dir, 0755) == 0 || errno == EEXIST);
+        if (slash) { *slash++ = '/'; }
+        if (!created)
+        {
+            cache_dir[0] = '\0';
+            return NULL;
+        }
+    }
+    return cache_dir;
+}
+
+// writes down what the output of a cached pipeline depends on: the working directory, the exported environment,
+// the assignments, resolved program and arguments of every stage, and the identity, size and mtime of every input file
+// (declared with -i or redirected with '<'). returns a malloc'd buffer, NULL if allocation failed
+char *cache_material(struct pipeline *pipeline, size_t *length)
+{
+    char *material = NULL;
+    FILE *text = open_memstream(&material, length);
+    if (text == NULL)
+    {
+        return NULL;
+    }
+
+    char directory[PATH_MAX];
+    fprintf(text, "%s\n", getcwd(directory, sizeof(directory)) ? directory : "");
+    for (char **entry = environ; *entry != NULL; entry++)
+    {
+        fprintf(text, "%s%c", *entry, '\0');
+    }
+    fprintf(text, "\n");
+    for (int i = 0; i < pipeline->count + pipeline->num_cache_inputs; i++)
+    {
+        // stages first, then the declared inputs
+        char *input = i < pipeline->count ? pipeline->commands[i].input_file : pipeline->cache_inputs[i - pipeline->count];
+        if (i < pipeline->count)
+        {
+            struct command *cmd = &pipeline->commands[i];
+            for (int j = 0; j < cmd->num_assignments; j++)
+            {
+                fprintf(text, "%s%c", cmd->assignments[j], '\0');
+            }
+            fprintf(text, "%s", cmd->executable_path);
+            for (int j = 1; j < cmd->argc; j++)
+            {
+                fprintf(text, "%c%s", '\0', cmd->args[j]);
+            }
+            fprintf(text, "\n%d\n", cmd->error_to_output | cmd->error_before_output << 1);
+        }
+
+        struct stat info;
+        if (input == NULL)
+        {
+            continue;
+        }
+        if (stat(input, &info) == 0)
+        {
+            fprintf(text, "%s%c%lu %lu %lld %lld.%09ld\n", input, '\0', (unsigned long)info.st_dev,
+                    (unsigned long)info.st_ino, (long long)info.st_size,
+                    (long long)info.st_mtim.tv_sec, info.st_mtim.tv_nsec);
+        }
+        else
+        {
+            fprintf(text, "%s%cmissing\n", input, '\0');
+        }
+    }
+
+    if (fclose(text) != 0)
+    {
+        free(material);
+        return NULL;
+    }
+    return material;
+}
+
+// 64-bit FNV-1a hash of the material, which names the cache entry
+unsigned long long cache_key(const char *material, size_t length)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= (unsigned char)material[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// opens where the output of a cached pipeline's last stage goes: its output file (truncated now,
+// as a launch would), the file shared by the line (-a) or the shell's stdout. returns -1 on failure
+int cache_output_fd(struct command *cmd)
+{
+    if (cmd->output_fd != -1)
+    {
+        return fcntl(cmd->output_fd, F_DUPFD_CLOEXEC, 0);
+    }
+    if (cmd->output_file)
+    {
+        return open(cmd->output_file, output_flags(cmd->output_append) | O_CLOEXEC, 0644);
+    }
+    return fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+}
+
+// copies the entry of key to output_fd if it was stored for the same material, and its exit status to status
+// returns 0 on a miss (no entry, another material with the same key or a damaged entry)
+char cache_replay(unsigned long long key, const char *material, size_t length, int output_fd, int *status)
+{
+    const char *directory = cache_directory();
+    if (directory == NULL)
+    {
+        return 0;
+    }
+
+    // the entry is the output (key.out) and its exit status followed by its material (key.meta)
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%016llx.meta", directory, key);
+    int meta_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (meta_fd == -1)
+    {
+        return 0;
+    }
+    char *meta = (char *)malloc(length + 32);
+    ssize_t meta_length = meta ? read(meta_fd, meta, length + 32) : -1;
+    close(meta_fd);
+    char *newline = meta_length > 0 ? (char *)memchr(meta, '\n', meta_length) : NULL;
+    char hit = newline != NULL && (size_t)(meta + meta_length - (newline + 1)) == length &&
+               memcmp(newline + 1, material, length) == 0;
+    int stored_status = hit ? atoi(meta) : 0;
+    free(meta);
+    if (!hit)
+    {
+        return 0;
+    }
+
+    snprintf(path, sizeof(path), "%s/%016llx.out", directory, key);
+    int out_fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if (out_fd == -1 || fstat(out_fd, &info) == -1)
+    {
+        if (out_fd != -1) { close(out_fd); }
+        return 0;
+    }
+    hit = cache_copy(out_fd, output_fd, info.st_size);
+    close(out_fd);
+    if (hit)
+    {
+        *status = stored_status;
+    }
+    return hit;
+}
+
+// the last stage of a cached pipeline was reaped (or could not be started): the captured output
+// goes where the stage's stdout would have gone and, if store is set, into the cache with the exit
+// status; entries are written under a temporary name and renamed so readers never see half of one
+void cache_finish(struct cache_fill *fill, char store, int child_status)
+{
+    struct stat info;
+    const char *directory = store ? cache_directory() : NULL;
+    if (fstat(fill->capture_fd, &info) == 0)
+    {
+        cache_copy(fill->capture_fd, fill->output_fd, info.st_size);
+    }
+
+    if (directory != NULL)
+    {
+        char path[PATH_MAX], temporary[PATH_MAX + 16];
+        const char *suffixes[] = { "out", "meta" };
+        for (int i = 0; i < 2; i++)
+        {
+            snprintf(path, sizeof(path), "%s/%016llx.%s", directory, fill->key, suffixes[i]);
+            snprintf(temporary, sizeof(temporary), "%s.%d", path, (int)getpid());
+            int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (fd == -1)
+            {
+                break;
+            }
+            char written = (i == 0) ? cache_copy(fill->capture_fd, fd, info.st_size) :
+                           (dprintf(fd, "%d\n", WEXITSTATUS(child_status)) > 0 &&
+                            write(fd, fill->material, fill->material_length) == (ssize_t)fill->material_length);
+            close(fd);
+            if (!written || rename(temporary, path) == -1)
+            {
+                unlink(temporary);
+                break;
+            }
+        }
+    }
+
+    close(fill->capture_fd);
+    close(fill->output_fd);
+    free(fill->material);
+    fill->material = NULL;
+}
+
+// hands out a free cache fill; returns -1 if allocation failed
+int job_table_start_fill(struct job_table *jobs)
+{
+    int fill = 0;
+    while (fill < jobs->num_fills && jobs->fills[fill].material != NULL)
+    {
+        fill++;
+    }
+    if (fill == jobs->num_fills)
+    {
+        int num_fills = jobs->num_fills ? jobs->num_fills * 2 : 4;
+        struct cache_fill *fills = (struct cache_fill *)realloc(jobs->fills, num_fills * sizeof(struct cache_fill));
+        if (fills == NULL)
+        {
+            return -1;
+        }
+        for (int i = jobs->num_fills; i < num_fills; i++)
+        {
+            fills[i].material = NULL;
+        }
+        jobs->fills = fills;
+        jobs->num_fills = num_fills;
+    }
+    return fill;
+}
+
+// copies the first length bytes of from_fd (a regular file or memfd, read from offset 0 whatever
+// its file offset is) to to_fd; returns 0 if not everything could be copied
+char cache_copy(int from_fd, int to_fd, off_t length)
+{
+    char buffer[CACHE_COPY_SIZE];
+    off_t offset = 0;
+    while (offset < length)
+    {
+        ssize_t chunk = pread(from_fd, buffer, sizeof(buffer), offset);
+        if (chunk <= 0)
+        {
+            return 0;
+        }
+        for (ssize_t done = 0; done < chunk; )
+        {
+            ssize_t written = write(to_fd, buffer + done, chunk - done);
+            if (written == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            if (written <= 0)
+            {
+                return 0;
+            }
+            done += written;
+        }
+        offset += chunk;
+    }
+    return 1;
+}
+
+// gives the stdout of cmd, the last stage of a pipeline of a line whose outputs are collected, to
+// the shell as a pipe it drains while waiting for the line. returns the index of the capture, -1 if
+// allocation failed or the pipe could not be created
+int output_start(struct job_table *jobs, struct command *cmd)
+{
+    if (jobs->num_captures == jobs->captures_capacity)
+    {
+        int capacity = jobs->captures_capacity ? 2 * jobs->captures_capacity : OUTPUT_CAPTURES_INIT_SIZE;
+        struct output_capture *captures = realloc(jobs->captures, capacity * sizeof(struct output_capture));
+        if (captures == NULL)
+        {
+            return -1;
+        }
+        jobs->captures = captures;
+        jobs->captures_capacity = capacity;
+    }
+    if (output_epoll == -1)
+    {
+        // children that change state wake the shell while it drains the pipes
+        struct epoll_event event = { EPOLLIN, { .u32 = OUTPUT_SIGCHLD } };
+        if (sigchld_pipe[0] == -1)
+        {
+            install_sigchld_handler();
+        }
+        if ((output_epoll = epoll_create1(EPOLL_CLOEXEC)) == -1 ||
+            epoll_ctl(output_epoll, EPOLL_CTL_ADD, sigchld_pipe[0], &event) == -1)
+        {
+            return -1;
+        }
+    }
+
+    int index = jobs->num_captures;
+    struct output_capture *capture = &jobs->captures[index];
+    capture->fd = capture->held_fd = -1;
+    capture->number = jobs->line_pipeline + 1;
+    capture->partial = NULL;
+    capture->partial_length = capture->partial_capacity = 0;
+
+    // the shell never blocks on the read end, a full pipe only holds up its own pipeline
+    int fds[2];
+    struct epoll_event event = { EPOLLIN, { .u32 = (uint32_t)index } };
+    if (pipe2(fds, O_CLOEXEC) == -1)
+    {
+        return -1;
+    }
+    if (pipe_buffer_size > 0)
+    {
+        fcntl(fds[1], F_SETPIPE_SZ, pipe_buffer_size);
+    }
+    if (fcntl(fds[0], F_SETFL, O_NONBLOCK) == -1 || epoll_ctl(output_epoll, EPOLL_CTL_ADD, fds[0], &event) == -1)
+    {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    capture->fd = fds[0];
+    cmd->output_fd = fds[1];
+    jobs->captures_open++;
+    jobs->num_captures++;
+    return index;
+}
+
+// moves the captured outputs along as they come; until_child returns as soon as a child can be
+// reaped (or none is left), otherwise once every capture pipe has ended
+void output_drain(struct job_table *jobs, char until_child)
+{
+    struct epoll_event events[OUTPUT_EVENTS];
+    output_ignore_sigpipe(1);
+    while (jobs->captures_open > 0)
+    {
+        // the self-pipe is emptied before looking for a child, so one that changes state
+        // afterwards still wakes the shell
+        char drain[64];
+        while (read(sigchld_pipe[0], drain, sizeof(drain)) > 0) { }
+        siginfo_t info;
+        info.si_pid = 0;
+        if (until_child && (waitid(P_ALL, 0, &info, WEXITED | WSTOPPED | WCONTINUED | WNOHANG | WNOWAIT) == -1 || info.si_pid != 0))
+        {
+            break;
+        }
+
+        int ready = epoll_wait(output_epoll, events, OUTPUT_EVENTS, -1);
+        for (int i = 0; i < ready; i++)
+        {
+            uint32_t index = events[i].data.u32;
+            if (index != OUTPUT_SIGCHLD && jobs->captures[index].fd != -1)
+            {
+                output_read(jobs, (int)index);
+            }
+        }
+    }
+    output_ignore_sigpipe(0);
+}
+
+// moves what the pipe of a capture holds on: tagged to stdout (tag), straight to stdout for the
+// first pipeline not written out yet and into a memfd for the ones after it (group)
+void output_read(struct job_table *jobs, int index)
+{
+    struct output_capture *capture = &jobs->captures[index];
+    ssize_t length;
+    if (output_mode == OUTPUT_TAG)
+    {
+        char buffer[OUTPUT_MOVE_SIZE];
+        if ((length = read(capture->fd, buffer, sizeof(buffer))) > 0)
+        {
+            output_tag(jobs, index, buffer, (size_t)length, 0);
+            return;
+        }
+    }
+    else
+    {
+        if (index != jobs->capture_head && capture->held_fd == -1 &&
+            (capture->held_fd = memfd_create("wish-output", MFD_CLOEXEC)) == -1)
+        {
+            output_fail(jobs);
+            jobs->child_system_error = 1;
+            return;
+        }
+        if ((length = output_move(capture->fd, index == jobs->capture_head ? STDOUT_FILENO : capture->held_fd)) > 0)
+        {
+            return;
+        }
+    }
+
+    if (length == 0)
+    {
+        output_end(jobs, index);
+    }
+    else if (errno != EAGAIN && errno != EINTR)
+    {
+        output_fail(jobs);
+    }
+}
+
+// moves what the pipe from_fd holds to to_fd, without copying it through the shell where the
+// kernel can (splice); returns the amount moved, 0 at the end of the pipe and -1 on an error (errno)
+ssize_t output_move(int from_fd, int to_fd)
+{
+    if (output_splice)
+    {
+        ssize_t moved = splice(from_fd, NULL, to_fd, NULL, OUTPUT_MOVE_SIZE, SPLICE_F_MOVE);
+        if (moved != -1 || errno != EINVAL)
+        {
+            return moved;
+        }
+        // some outputs take no splices (a file opened for appending, a terminal); copy from then on
+        output_splice = 0;
+    }
+
+    char buffer[OUTPUT_MOVE_SIZE];
+    ssize_t length = read(from_fd, buffer, sizeof(buffer));
+    for (ssize_t done = 0; length > 0 && done < length; )
+    {
+        ssize_t written = write(to_fd, buffer + done, length - done);
+        if (written == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written <= 0)
+        {
+            return -1;
+        }
+        done += written;
+    }
+    return length;
+}
+
+// closes the pipe of a capture, taking it out of the epoll instance first since a child that
+// has not reached execv yet may still share it
+void output_close(struct job_table *jobs, struct output_capture *capture)
+{
+    epoll_ctl(output_epoll, EPOLL_CTL_DEL, capture->fd, NULL);
+    close(capture->fd);
+    capture->fd = -1;
+    jobs->captures_open--;
+}
+
+// the pipe of a capture ended: its output is written out as far as the order allows (group), or
+// its last line is ended (tag)
+void output_end(struct job_table *jobs, int index)
+{
+    output_close(jobs, &jobs->captures[index]);
+    if (output_mode == OUTPUT_GROUP)
+    {
+        output_write_head(jobs);
+        return;
+    }
+    output_tag(jobs, index, NULL, 0, 1);
+}
+
+// writes out the captures from the head on whose pipelines are done, then what the first one still
+// running held back so far; the rest of its output goes straight to stdout (group)
+void output_write_head(struct job_table *jobs)
+{
+    while (jobs->capture_head < jobs->num_captures)
+    {
+        struct output_capture *capture = &jobs->captures[jobs->capture_head];
+        if (capture->held_fd != -1)
+        {
+            struct stat info;
+            char written = fstat(capture->held_fd, &info) == 0 && cache_copy(capture->held_fd, STDOUT_FILENO, info.st_size);
+            close(capture->held_fd);
+            capture->held_fd = -1;
+            if (!written)
+            {
+                output_fail(jobs);
+                return;
+            }
+        }
+        if (capture->fd != -1)
+        {
+            return;
+        }
+        jobs->capture_head++;
+    }
+}
+
+// writes the complete lines of data to stdout after the position of their pipeline ("[2] ..."),
+// keeping an unfinished last line for the next data; end writes that line out too (tag)
+void output_tag(struct job_table *jobs, int index, const char *data, size_t length, char end)
+{
+    struct output_capture *capture = &jobs->captures[index];
+    struct builtin_output output = { 0, 0, "" };
+    char tag[16];
+    int tag_length = snprintf(tag, sizeof(tag), "[%d] ", capture->number);
+    const char *newline;
+    while (length > 0 && (newline = memchr(data, '\n', length)) != NULL)
+    {
+        size_t line_length = (size_t)(newline - data) + 1;
+        builtin_write(&output, tag, tag_length);
+        builtin_write(&output, capture->partial, capture->partial_length);
+        builtin_write(&output, data, line_length);
+        capture->partial_length = 0;
+        data += line_length;
+        length -= line_length;
+    }
+    if (length > 0)
+    {
+        if (capture->partial_length + length > capture->partial_capacity)
+        {
+            size_t capacity = 2 * (capture->partial_length + length);
+            char *partial = realloc(capture->partial, capacity);
+            if (partial == NULL)
+            {
+                output_fail(jobs);
+                jobs->child_system_error = 1;
+                return;
+            }
+            capture->partial = partial;
+            capture->partial_capacity = capacity;
+        }
+        memcpy(capture->partial + capture->partial_length, data, length);
+        capture->partial_length += length;
+    }
+    if (end)
+    {
+        if (capture->partial_length > 0)
+        {
+            builtin_write(&output, tag, tag_length);
+            builtin_write(&output, capture->partial, capture->partial_length);
+            builtin_write(&output, "\n", 1);
+        }
+        free(capture->partial);
+        capture->partial = NULL;
+        capture->partial_length = capture->partial_capacity = 0;
+    }
+    if (!builtin_flush(&output))
+    {
+        output_fail(jobs);
+    }
+}
+
+// stdout failed (e.g. its reader went away): the captured outputs are dropped and their pipes
+// closed, so the pipelines writing to them get SIGPIPE as they would have writing to stdout
+void output_fail(struct job_table *jobs)
+{
+    for (int i = 0; i < jobs->num_captures; i++)
+    {
+        struct output_capture *capture = &jobs->captures[i];
+        if (capture->fd != -1)
+        {
+            output_close(jobs, capture);
+        }
+        if (capture->held_fd != -1)
+        {
+            close(capture->held_fd);
+            capture->held_fd = -1;
+        }
+        free(capture->partial);
+        capture->partial = NULL;
+        capture->partial_length = capture->partial_capacity = 0;
+    }
+    jobs->capture_head = jobs->num_captures;
+}
+
+// writes out what is left of the outputs of the line once its pipelines were reaped; a process
+// still holding the stdout of one (e.g. started in the background by it) is waited for
+void output_finish(struct job_table *jobs)
+{
+    output_drain(jobs, 0);
+    jobs->num_captures = jobs->capture_head = 0;
+    jobs->capturing = 0;
+}
+
+// while the shell writes captured output, a reader that went away fails the write instead of
+// killing the shell; no child is started in between, so none inherits the ignored signal
+void output_ignore_sigpipe(char ignore)
+{
+    if (ignore)
+    {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = SIG_IGN;
+        sigaction(SIGPIPE, &action, &output_sigpipe);
+    }
+    else
+    {
+        sigaction(SIGPIPE, &output_sigpipe, NULL);
+    }
+}
+
+// hands out the next cpu the shell may use to the child being launched (-k), in turn
+int pin_next_cpu(void)
+{
+    for (int i = 1; i <= CPU_SETSIZE; i++)
+    {
+        int cpu = (pin_next + i) % CPU_SETSIZE;
+        if (CPU_ISSET(cpu, &pin_cpus))
+        {
+            pin_next = cpu;
+            return cpu;
+        }
+    }
+    return -1;
+}
+
+// pins the calling child to cpu before it execs (-k); a cpu the kernel refuses (e.g. taken away
+// by a cpuset since the shell started) leaves it wherever it is
+void pin_to_cpu(int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    sched_setaffinity(0, sizeof(set), &set);
+}
+
+// queues the caller until needed more children fit in the worker slots (-j); a slot is
+// handed out as soon as any child finishes, not only the oldest one
+// a pipeline larger than the cap still runs, once every other child has finished
+void job_table_wait_for_slots(struct job_table *jobs, int needed)
+{
+    if (max_running_children <= 0)
+    {
+        return;
+    }
+    while (jobs->count > 0 && jobs->count + needed > max_running_children)
+    {
+        job_table_reap_any(jobs, 0);
+    }
+}
+
+// hands out a free pipeline timer started now; returns -1 if allocation failed
+int job_table_start_timer(struct job_table *jobs)
+{
+    int timer = 0;
+    while (timer < jobs->num_timers && jobs->timers[timer].running > 0)
+    {
+        timer++;
+    }
+    if (timer == jobs->num_timers)
+    {
+        int num_timers = jobs->num_timers ? jobs->num_timers * 2 : 4;
+        struct pipeline_timer *timers = (struct pipeline_timer *)realloc(jobs->timers, num_timers * sizeof(struct pipeline_timer));
+        if (timers == NULL)
+        {
+            return -1;
+        }
+        for (int i = jobs->num_timers; i < num_timers; i++)
+        {
+            timers[i].running = 0;
+        }
+        jobs->timers = timers;
+        jobs->num_timers = num_timers;
+    }
+
+    struct pipeline_timer *started = &jobs->timers[timer];
+    clock_gettime(CLOCK_MONOTONIC, &started->start);
+    started->user = started->sys = 0;
+    started->running = 0;
+    return timer;
+}
+
+// adds a launched child to the job table (room must have been reserved); start is when it was
+// launched and timer the pipeline timer it counts towards (-1 if none)
+void job_table_add(struct job_table *jobs, pid_t child, struct command *cmd, const struct timespec *start, int timer)
+{
+    struct job *job = &jobs->children[jobs->count++];
+    job->pid = child;
+    job->job_id = jobs->launch_job;
+    job->start = *start;
+    job->timer = timer;
+    job->cache_fill = -1;
+    job->command[0] = '\0';
+    if (timer != -1)
+    {
+        jobs->timers[timer].running++;
+    }
+
+    struct background_job *background = job_table_find_background(jobs, jobs->launch_job);
+    if (background == NULL)
+    {
+        jobs->foreground++;
+    }
+    else
+    {
+        if (background->pgid == 0)
+        {
+            background->pgid = child;
+        }
+        background->last_pid = child;
+        background->running++;
+    }
+
+    // the command text is only needed by the stats log and the trace
+    if (stats_log_fd != -1 || trace_ring)
+    {
+        size_t used = 0;
+        for (int i = 0; i < cmd->argc && used < JOB_COMMAND_SIZE - 1; i++)
+        {
+            int written = snprintf(job->command + used, JOB_COMMAND_SIZE - used, i ? " %s" : "%s", cmd->args[i]);
+            if (written < 0)
+            {
+                break;
+            }
+            used += (size_t)written;
+        }
+    }
+}
+
+// records that a child changed state; the self-pipe lets a shell blocked in poll notice it
+void sigchld_handler(int signal_number)
+{
+    int saved_errno = errno;
+    sigchld_pending = 1;
+    write(sigchld_pipe[1], "", 1);
+    errno = saved_errno;
+}
+
+// creates the SIGCHLD self-pipe (non-blocking: a full pipe already wakes the shell) and handler
+void install_sigchld_handler(void)
+{
+    struct sigaction action;
+    if (pipe2(sigchld_pipe, O_CLOEXEC | O_NONBLOCK) == -1)
+    {
+        system_error(ERROR_MESSAGE);
+    }
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = sigchld_handler;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGCHLD, &action, NULL) == -1)
+    {
+        system_error(ERROR_MESSAGE);
+    }
+}
+
+// reaps every child that changed state since the last poll without blocking; nothing is
+// asked of the kernel unless the SIGCHLD handler ran in the meantime
+void job_table_poll(struct job_table *jobs)
+{
+    if (!sigchld_pending)
+    {
+        return;
+    }
+    sigchld_pending = 0;
+    char drain[64];
+    while (read(sigchld_pipe[0], drain, sizeof(drain)) > 0) { }
+    while (jobs->count > 0 && job_table_reap_any(jobs, WNOHANG)) { }
+}
+
+// waits for the user's next line on a terminal; background jobs that finish in the meantime
+// are reported right away instead of at the next prompt
+void wait_for_input(struct job_table *jobs)
+{
+    fflush(stdout);
+    struct pollfd fds[2] = { { STDIN_FILENO, POLLIN, 0 }, { sigchld_pipe[0], POLLIN, 0 } };
+    while (job_control && jobs->num_background > 0)
+    {
+        if (poll(fds, 2, -1) == -1)
+        {
+            if (errno == EINTR) { continue; }
+            return;
+        }
+        if (fds[1].revents & POLLIN)
+        {
+            job_table_poll(jobs);
+            if (job_table_notify(jobs, 1))
+            {
+                write(STDOUT_FILENO, "wish> ", 6);
+            }
+        }
+        if (fds[0].revents)
+        {
+            return;
+        }
+    }
+}
+
+// adds a background job for the line; returns its id, 0 if allocation failed
+int job_table_start_background(struct job_table *jobs, struct command_line *parsed)
+{
+    if (jobs->num_background == jobs->background_capacity)
+    {
+        int capacity = jobs->background_capacity ? jobs->background_capacity * 2 : 4;
+        struct background_job *background = (struct background_job *)realloc(jobs->background, capacity * sizeof(struct background_job));
+        if (background == NULL)
+        {
+            return 0;
+        }
+        jobs->background = background;
+        jobs->background_capacity = capacity;
+    }
+
+    // ids count up from the highest one in use, as in bash
+    int id = 1;
+    for (int i = 0; i < jobs->num_background; i++)
+    {
+        if (jobs->background[i].id >= id)
+        {
+            id = jobs->background[i].id + 1;
+        }
+    }
+
+    struct background_job *job = &jobs->background[jobs->num_background++];
+    job->id = id;
+    job->pgid = 0;
+    job->last_pid = -1;
+    job->running = 0;
+    job->status = 0;
+    job->state = JOB_RUNNING;
+    command_line_text(parsed, job->command, sizeof(job->command));
+    return id;
+}
+
+// returns the background job with the given id (0 is a foreground line); NULL if there is none
+struct background_job *job_table_find_background(struct job_table *jobs, int id)
+{
+    for (int i = 0; id != 0 && i < jobs->num_background; i++)
+    {
+        if (jobs->background[i].id == id)
+        {
+            return &jobs->background[i];
+        }
+    }
+    return NULL;
+}
+
+// returns the job named by the arguments of a job built-in ("name", "name id" or "name %id");
+// without an id this is the latest job. The job of the line running the built-in has no child
+// yet and cannot be named. returns NULL if there is no such job
+struct background_job *job_table_parse_job(struct job_table *jobs, int argc, char **args)
+{
+    struct background_job *job = NULL;
+    if (argc == 1)
+    {
+        for (int i = jobs->num_background - 1; job == NULL && i >= 0; i--)
+        {
+            if (jobs->background[i].pgid != 0)
+            {
+                job = &jobs->background[i];
+            }
+        }
+        return job;
+    }
+    if (argc != 2)
+    {
+        return NULL;
+    }
+    char *id = args[1][0] == '%' ? args[1] + 1 : args[1];
+    for (char *c = id; *c != '\0'; c++)
+    {
+        if (!isdigit((unsigned char)*c))
+        {
+            return NULL;
+        }
+    }
+    if (*id != '\0')
+    {
+        job = job_table_find_background(jobs, atoi(id));
+    }
+    return job && job->pgid != 0 ? job : NULL;
+}
+
+// waits until the background job is done or stopped; children of other jobs that finish
+// meanwhile are reaped as usual
+void job_table_wait_for_job(struct job_table *jobs, int id)
+{
+    struct background_job *job;
+    while ((job = job_table_find_background(jobs, id)) != NULL && job->state == JOB_RUNNING)
+    {
+        if (jobs->count == 0)
+        {
+            job->state = JOB_DONE;
+            break;
+        }
+        job_table_reap_any(jobs, 0);
+    }
+}
+
+// runs the background job as the foreground one: it gets the terminal (job control only) and
+// is continued if it was stopped; returns once it is done or stopped again
+void job_table_foreground(struct job_table *jobs, struct background_job *job)
+{
+    int id = job->id;
+    if (job_control)
+    {
+        tcsetpgrp(STDIN_FILENO, job->pgid);
+        jobs->terminal_job = id;
+    }
+    if (job->state == JOB_STOPPED)
+    {
+        kill(-job->pgid, SIGCONT);
+        job->state = JOB_RUNNING;
+    }
+    job_table_wait_for_job(jobs, id);
+    if (job_control)
+    {
+        tcsetpgrp(STDIN_FILENO, getpgrp());
+        jobs->terminal_job = 0;
+    }
+
+    // a job stopped again is reported, a finished one is forgotten quietly once its status is in $?
+    job = job_table_find_background(jobs, id);
+    if (job && job->state == JOB_STOPPED && job_control)
+    {
+        job_table_print(jobs, job);
+    }
+    else if (job && job->state == JOB_DONE)
+    {
+        last_status = job->status;
+        job_table_remove_background(jobs, (int)(job - jobs->background));
+    }
+    fflush(stdout);
+}
+
+// prints a background job in the layout of bash's jobs built-in ('+' marks the latest job)
+void job_table_print(struct job_table *jobs, struct background_job *job)
+{
+    // jobs that have not started a child yet (the line running the built-in) are not counted
+    int newer = 0;
+    for (struct background_job *other = job + 1; other < jobs->background + jobs->num_background; other++)
+    {
+        newer += other->pgid != 0;
+    }
+    char marker = newer == 0 ? '+' : (newer == 1 ? '-' : ' ');
+    char state[16];
+    if (job->state == JOB_RUNNING)
+    {
+        strcpy(state, "Running");
+    }
+    else if (job->state == JOB_STOPPED)
+    {
+        strcpy(state, "Stopped");
+    }
+    else if (job->status == 0)
+    {
+        strcpy(state, "Done");
+    }
+    else
+    {
+        snprintf(state, sizeof(state), "Exit %d", job->status);
+    }
+    printf("[%d]%c  %-24s%s%s\n", job->id, marker, state, job->command, job->state == JOB_RUNNING ? " &" : "");
+}
+
+// forgets the finished background jobs, reporting them first if report is set
+// returns 1 if any job was reported
+char job_table_notify(struct job_table *jobs, char report)
+{
+    char reported = 0;
+    for (int i = 0; i < jobs->num_background; i++)
+    {
+        if (jobs->background[i].state == JOB_DONE)
+        {
+            if (report)
+            {
+                job_table_print(jobs, &jobs->background[i]);
+                reported = 1;
+            }
+            job_table_remove_background(jobs, i--);
+        }
+    }
+    if (reported)
+    {
+        fflush(stdout);
+    }
+    return reported;
+}
+
+// removes the background job at index, keeping the others in the order they were started
+void job_table_remove_background(struct job_table *jobs, int index)
+{
+    memmove(&jobs->background[index], &jobs->background[index + 1], (jobs->num_background - index - 1) * sizeof(struct background_job));
+    jobs->num_background--;
+}
+
+// writes the parsed line back as text (truncated to size) for the jobs listing
+void command_line_text(struct command_line *parsed, char *text, size_t size)
+{
+    size_t used = 0;
+    text[0] = '\0';
+    for (int i = 0; i < parsed->count && used < size; i++)
+    {
+        struct pipeline *pipeline = &parsed->pipelines[i];
+        for (int j = 0; j < pipeline->count && used < size; j++)
+        {
+            struct command *cmd = &pipeline->commands[j];
+            const char *separator = j > 0 ? " | " : (i > 0 ? " & " : "");
+            for (int k = 0; k < cmd->argc && used < size; k++)
+            {
+                int written = snprintf(text + used, size - used, "%s%s", k ? " " : separator, cmd->args[k]);
+                if (written < 0)
+                {
+                    return;
+                }
+                used += (size_t)written;
+            }
+        }
+    }
+}
+
+// seconds elapsed between two monotonic clock readings
+double timespec_seconds(const struct timespec *start, const struct timespec *end)
+{
+    return (double)(end->tv_sec - start->tv_sec) + (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// seconds of a cpu time from getrusage/wait4
+double timeval_seconds(const struct timeval *time)
+{
+    return (double)time->tv_sec + (double)time->tv_usec / 1e6;
+}
+
+// log2 bucket of a histogram value; values below 2 share the first bucket
+int stats_bucket(long value)
+{
+    int bucket = 0;
+    while (value > 1 && bucket < STATS_BUCKETS - 1)
+    {
+        value >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+// adds a reaped child to the shell's totals and histograms, and to the stats log (if any)
+void stats_record(struct job *job, int child_status, struct rusage *usage, double real)
+{
+    shell_stats.commands++;
+    shell_stats.real += real;
+    shell_stats.user += timeval_seconds(&usage->ru_utime);
+    shell_stats.sys += timeval_seconds(&usage->ru_stime);
+    if (usage->ru_maxrss > shell_stats.max_rss)
+    {
+        shell_stats.max_rss = usage->ru_maxrss;
+    }
+    shell_stats.voluntary_switches += usage->ru_nvcsw;
+    shell_stats.involuntary_switches += usage->ru_nivcsw;
+    shell_stats.wall_histogram[stats_bucket((long)(real * 1e6))]++;
+    shell_stats.rss_histogram[stats_bucket(usage->ru_maxrss)]++;
+
+    if (stats_log_fd != -1)
+    {
+        stats_log(job, child_status, usage, real);
+    }
+}
+
+// appends one JSON object per reaped child to the stats log (-l); the line is written with a
+// single write so that it is never interleaved with another writer of the log
+void stats_log(struct job *job, int child_status, struct rusage *usage, double real)
+{
+    // every command character takes at most 6 characters once escaped
+    char line[JOB_COMMAND_SIZE * 6 + 256];
+    int used = snprintf(line, sizeof(line), "{\"pid\":%d,\"command\":\"", (int)job->pid);
+    used += json_escape(line + used, job->command);
+
+    int status = WIFEXITED(child_status) ? WEXITSTATUS(child_status) : -1;
+    int signal = WIFSIGNALED(child_status) ? WTERMSIG(child_status) : 0;
+    used += snprintf(line + used, sizeof(line) - used,
+                     "\",\"status\":%d,\"signal\":%d,\"real\":%.6f,\"user\":%.6f,\"sys\":%.6f,"
+                     "\"maxrss_kb\":%ld,\"nvcsw\":%ld,\"nivcsw\":%ld}\n",
+                     status, signal, real, timeval_seconds(&usage->ru_utime), timeval_seconds(&usage->ru_stime),
+                     usage->ru_maxrss, usage->ru_nvcsw, usage->ru_nivcsw);
+    write(stats_log_fd, line, used);
+}
+
+// dumps the totals and histograms of the children reaped so far
+void stats_print(void)
+{
+    printf("commands\t%ld\n", shell_stats.commands);
+    printf("real\t%.6f\n", shell_stats.real);
+    printf("user\t%.6f\n", shell_stats.user);
+    printf("sys\t%.6f\n", shell_stats.sys);
+    printf("max rss\t%ld KB\n", shell_stats.max_rss);
+    printf("switches\t%ld voluntary, %ld involuntary\n", shell_stats.voluntary_switches, shell_stats.involuntary_switches);
+    stats_print_histogram("wall time (us)", shell_stats.wall_histogram);
+    stats_print_histogram("max rss (KB)", shell_stats.rss_histogram);
+    fflush(stdout);
+}
+
+// prints the non-empty buckets of a log2 histogram as value ranges
+void stats_print_histogram(const char *title, long *histogram)
+{
+    printf("%s\tcommands\n", title);
+    for (int i = 0; i < STATS_BUCKETS; i++)
+    {
+        if (histogram[i] > 0)
+        {
+            printf("%10ld-%-10ld\t%ld\n", i ? 1L << i : 0, (1L << (i + 1)) - 1, histogram[i]);
+        }
+    }
+}
+
+// copies str into out as the contents of a JSON string; out needs room for 6 characters per
+// character of str (and the NUL). returns the length written
+int json_escape(char *out, const char *str)
+{
+    int used = 0;
+    for (const char *c = str; *c != '\0'; c++)
+    {
+        if (*c == '"' || *c == '\\')
+        {
+            out[used++] = '\\';
+            out[used++] = *c;
+        }
+        else if ((unsigned char)*c < 0x20)
+        {
+            used += sprintf(out + used, "\\u%04x", (unsigned char)*c);
+        }
+        else
+        {
+            out[used++] = *c;
+        }
+    }
+    out[used] = '\0';
+    return used;
+}
+
+// reports the cost of a timed pipeline on stderr, in the layout of bash's time keyword
+void time_report(double real, double user, double sys)
+{
+    dprintf(STDERR_FILENO, "\nreal\t%dm%.3fs\nuser\t%dm%.3fs\nsys\t%dm%.3fs\n",
+            (int)(real / 60), real - 60 * (int)(real / 60),
+            (int)(user / 60), user - 60 * (int)(user / 60),
+            (int)(sys / 60), sys - 60 * (int)(sys / 60));
+}
+
+// reports on stderr how long the shell took from main to its first line and to its exit, with
+// its own peak footprint (-s); loading the program before main is not included
+void startup_print(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    long first_command = -1;
+    if (first_command_time.tv_sec != 0 || first_command_time.tv_nsec != 0)
+    {
+        first_command = (long)(timespec_seconds(&startup_time, &first_command_time) * 1e6);
+    }
+    dprintf(STDERR_FILENO, "startup: first command %ld us, exit %ld us, max rss %ld KB, minor faults %ld\n",
+            first_command, (long)(timespec_seconds(&startup_time, &now) * 1e6), usage.ru_maxrss, usage.ru_minflt);
+}
+
+// starts tracing into file: the ring is mapped shared before any child is forked so that
+// children can record their own phases, and the trace is written as a chrome trace-event array
+void trace_open(const char *file)
+{
+    if (trace_ring != NULL)
+    {
+        return;
+    }
+    trace_fd = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (trace_fd == -1)
+    {
+        system_error(ERROR_MESSAGE);
+    }
+    trace_ring = mmap(NULL, sizeof(struct trace_ring), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (trace_ring == MAP_FAILED)
+    {
+        trace_ring = NULL;
+        system_error(ERROR_MESSAGE);
+    }
+    trace_shell_pid = getpid();
+    trace_base = trace_clock();
+    write(trace_fd, "[\n", 2);
+}
+
+// current monotonic clock (ns), or 0 without tracing so the untraced hot path skips the clock
+unsigned long long trace_clock(void)
+{
+    if (trace_ring == NULL)
+    {
+        return 0;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// records a phase that started at start and ends now; the slot is claimed with an atomic add and
+// published by storing its sequence last, so the shell never flushes a half-written event
+void trace_record(int phase, unsigned long long start, pid_t tid, const char *detail)
+{
+    if (trace_ring == NULL)
+    {
+        return;
+    }
+    unsigned long slot = __atomic_fetch_add(&trace_ring->head, 1, __ATOMIC_RELAXED);
+    struct trace_event *event = &trace_ring->events[slot % TRACE_RING_SIZE];
+    event->start = start;
+    event->end = trace_clock();
+    event->phase = phase;
+    event->tid = tid;
+    strncpy(event->detail, detail, TRACE_DETAIL_SIZE - 1);
+    event->detail[TRACE_DETAIL_SIZE - 1] = '\0';
+    __atomic_store_n(&event->sequence, slot + 1, __ATOMIC_RELEASE);
+
+    // only the shell writes the trace; it does so well before the ring could wrap
+    if (!trace_in_child && slot + 1 - trace_flushed >= TRACE_RING_SIZE / 2)
+    {
+        trace_flush(0);
+    }
+}
+
+// writes the published events of the ring to the trace; an event a child is still writing stops
+// the flush, unless this is the final flush, which skips it
+void trace_flush(char final)
+{
+    unsigned long head = __atomic_load_n(&trace_ring->head, __ATOMIC_ACQUIRE);
+    char buffer[8192];
+    size_t used = 0;
+    while (trace_flushed < head)
+    {
+        struct trace_event *event = &trace_ring->events[trace_flushed % TRACE_RING_SIZE];
+        if (__atomic_load_n(&event->sequence, __ATOMIC_ACQUIRE) != trace_flushed + 1)
+        {
+            if (!final)
+            {
+                break;
+            }
+            trace_flushed++;
+            continue;
+        }
+
+        if (used + TRACE_DETAIL_SIZE * 6 + 256 > sizeof(buffer))
+        {
+            write(trace_fd, buffer, used);
+            used = 0;
+        }
+        char detail[TRACE_DETAIL_SIZE * 6 + 1];
+        json_escape(detail, event->detail);
+        used += snprintf(buffer + used, sizeof(buffer) - used,
+                         "{\"name\":\"%s\",\"cat\":\"wish\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                         "\"pid\":%d,\"tid\":%d,\"args\":{\"command\":\"%s\"}},\n",
+                         TRACE_PHASE_NAMES[event->phase], (event->start - trace_base) / 1000.0,
+                         (event->end - event->start) / 1000.0, (int)trace_shell_pid, (int)event->tid, detail);
+        trace_flushed++;
+    }
+    write(trace_fd, buffer, used);
+}
+
+// writes the rest of the trace and stops tracing; called on every way out of the shell
+void trace_finish(void)
+{
+    if (trace_ring == NULL || trace_in_child)
+    {
+        return;
+    }
+    trace_flush(1);
+
+    // a metadata event closes the array without leaving a trailing comma
+    dprintf(trace_fd, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"wish\"}}\n]\n", (int)trace_shell_pid);
+    close(trace_fd);
+    munmap(trace_ring, sizeof(struct trace_ring));
+    trace_ring = NULL;
+    trace_fd = -1;
+}
+
+// djb2 string hash used by the shell's lookup tables
+unsigned long hash_string(const char *str)
+{
+    unsigned long hash = 5381;
+    while (*str)
+    {
+        hash = ((hash << 5) + hash) + (unsigned char)*str++;
+    }
+    return hash;
+}
+
+// returns the executable path of a program, searching the shell path only if the program has not
+// been seen since the last path change or its remembered file is gone; used counts a run of it
+// (the "hash" built-in only looks it up). returns NULL if the program cannot be found
+char *cmd_hash_lookup(char *program_name, char ***shell_path, int *num_path, char used)
+{
+    unsigned long bucket = hash_string(program_name) % CMD_HASH_BUCKETS;
+    for (struct cmd_hash_entry **link = &cmd_hash_table[bucket]; *link != NULL; link = &(*link)->next)
+    {
+        struct cmd_hash_entry *entry = *link;
+        if (strcmp(entry->name, program_name) != 0)
+        {
+            continue;
+        }
+        if (access(entry->path, X_OK) == 0)
+        {
+            entry->hits += used;
+            return entry->path;
+        }
+
+        // removed or no longer executable: a later directory of the path may have one
+        *link = entry->next;
+        break;
+    }
+
+    // make valid program path string given shell path and program name
+    char executable_path[512];
+    int command_found = 0;
+    for (int i = 0; i < *num_path; i++)
+    {
+        snprintf(executable_path, sizeof(executable_path), "%s/%s", (*shell_path)[i], program_name);
+        if (access(executable_path, X_OK) == 0)
+        {
+            command_found = 1;
+            break;
+        }
+    }
+    if (!command_found)
+    {
+        return NULL;
+    }
+
+    struct cmd_hash_entry *entry = (struct cmd_hash_entry *)arena_alloc(&hash_arena, sizeof(struct cmd_hash_entry));
+    if (entry == NULL)
+    {
+        return NULL;
+    }
+    entry->name = arena_strndup(&hash_arena, program_name, strlen(program_name));
+    entry->path = arena_strndup(&hash_arena, executable_path, strlen(executable_path));
+    if (entry->name == NULL || entry->path == NULL)
+    {
+        return NULL;
+    }
+    entry->hits = used;
+    entry->next = cmd_hash_table[bucket];
+    cmd_hash_table[bucket] = entry;
+
+    // a shell of a server (-D) tells the server, so that the shells it forks later have it hashed
+    if (server_lookup_fd != -1)
+    {
+        write(server_lookup_fd, program_name, strlen(program_name));
+    }
+    return entry->path;
+}
+
+// lists the remembered programs in the same layout as bash's hash built-in
+void cmd_hash_print(void)
+{
+    int printed_header = 0;
+    for (int i = 0; i < CMD_HASH_BUCKETS; i++)
+    {
+        for (struct cmd_hash_entry *entry = cmd_hash_table[i]; entry != NULL; entry = entry->next)
+        {
+            if (!printed_header)
+            {
+                printf("hits\tcommand\n");
+                printed_header = 1;
+            }
+            printf("%4d\t%s\n", entry->hits, entry->path);
+        }
+    }
+    if (!printed_header)
+    {
+        printf("hash: hash table empty\n");
+    }
+    fflush(stdout);
+}
+
+// forgets every remembered program location; the entries are released with the hash arena
+void cmd_hash_clear(void)
+{
+    for (int i = 0; i < CMD_HASH_BUCKETS; i++)
+    {
+        cmd_hash_table[i] = NULL;
+    }
+    arena_reset(&hash_arena);
+}
+
+// true if the word is a pattern: it has a '*', a '?' or a '[' closed by a later ']'
+char glob_pattern(const char *word, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        if (word[i] == '*' || word[i] == '?')
+        {
+            return 1;
+        }
+        // the first character of a bracket expression may be ']' itself, as in "[]a]"
+        if (word[i] == '[' && i + 2 < length && memchr(word + i + 2, ']', length - i - 2) != NULL)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// adds the paths matching the pattern word to the arguments of cmd, sorted; a pattern that matches
+// nothing is added as it is, as in sh. returns 0 if allocation failed
+char command_add_glob(struct command *cmd, struct arena *arena, const char *word, size_t length)
+{
+    char pattern[PATH_MAX];
+    char path[PATH_MAX];
+    int before = cmd->argc;
+    if (length < sizeof(pattern))
+    {
+        memcpy(pattern, word, length);
+        pattern[length] = '\0';
+
+        // an absolute pattern is matched from the root
+        size_t start = (pattern[0] == '/');
+        path[0] = '/';
+        path[start] = '\0';
+        if (!glob_match(cmd, arena, pattern + start, path, start))
+        {
+            return 0;
+        }
+    }
+    return cmd->argc > before || command_add_arg(cmd, arena, word, length);
+}
+
+// matches the components of pattern below the directory path (of path_length characters, empty for
+// the working directory) and adds every complete match to cmd; returns 0 if allocation failed
+char glob_match(struct command *cmd, struct arena *arena, const char *pattern, char *path, size_t path_length)
+{
+    const char *slash = strchr(pattern, '/');
+    size_t length = slash ? (size_t)(slash - pattern) : strlen(pattern);
+    const char *rest = slash ? slash + 1 : NULL;
+    char component[NAME_MAX + 1];
+    if (length > NAME_MAX)
+    {
+        return 1;
+    }
+    memcpy(component, pattern, length);
+    component[length] = '\0';
+
+    // only a component with wildcards needs the directory listing
+    if (!glob_pattern(component, length))
+    {
+        if (path_length + length >= PATH_MAX)
+        {
+            return 1;
+        }
+        memcpy(path + path_length, component, length + 1);
+        return glob_match_next(cmd, arena, rest, path, path_length + length, 0);
+    }
+
+    path[path_length] = '\0';
+    struct glob_dir *dir = glob_listing(path);
+    if (dir == NULL)
+    {
+        return 0;
+    }
+    for (int i = 0; i < dir->count; i++)
+    {
+        size_t name_length = strlen(dir->names[i]);
+        if (path_length + name_length >= PATH_MAX || fnmatch(component, dir->names[i], FNM_PERIOD) != 0)
+        {
+            continue;
+        }
+        memcpy(path + path_length, dir->names[i], name_length + 1);
+        if (!glob_match_next(cmd, arena, rest, path, path_length + name_length, 1))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// carries a match of one component on to the rest of the pattern (NULL after the last component,
+// empty after a trailing '/' which only directories match); listed tells if the path was found in a
+// listing, otherwise it has to be checked. returns 0 if allocation failed
+char glob_match_next(struct command *cmd, struct arena *arena, const char *rest, char *path, size_t path_length, char listed)
+{
+    struct stat info;
+    if (rest == NULL)
+    {
+        return (!listed && lstat(path, &info) == -1) || command_add_arg(cmd, arena, path, path_length);
+    }
+    if (*rest == '\0')
+    {
+        if (path_length + 1 >= PATH_MAX || stat(path, &info) == -1 || !S_ISDIR(info.st_mode))
+        {
+            return 1;
+        }
+        memcpy(path + path_length, "/", 2);
+        return command_add_arg(cmd, arena, path, path_length + 1);
+    }
+    if (path_length + 1 >= PATH_MAX)
+    {
+        return 1;
+    }
+    path[path_length] = '/';
+    return glob_match(cmd, arena, rest, path, path_length + 1);
+}
+
+// returns the sorted names of directory path (the working directory if it is empty), scanning it
+// only if it is not cached yet: the cache is dropped with every line unless it is kept across lines
+// (-G), where a listing is used again while the directory has the same inode and mtime
+// a directory that cannot be read has no names. returns NULL if allocation failed
+struct glob_dir *glob_listing(const char *path)
+{
+    const char *name = path[0] != '\0' ? path : ".";
+    unsigned long bucket = hash_string(name) % GLOB_BUCKETS;
+    struct glob_dir *dir = glob_table[bucket];
+    while (dir != NULL && strcmp(dir->path, name) != 0)
+    {
+        dir = dir->next;
+    }
+    if (dir == NULL)
+    {
+        dir = (struct glob_dir *)malloc(sizeof(struct glob_dir));
+        if (dir == NULL || (dir->path = strdup(name)) == NULL)
+        {
+            free(dir);
+            return NULL;
+        }
+        dir->arena.blocks = NULL;
+        dir->names = NULL;
+        dir->count = dir->capacity = 0;
+        dir->scanned = 0;
+        dir->next = glob_table[bucket];
+        glob_table[bucket] = dir;
+    }
+    else if (!persistent_glob_cache)
+    {
+        // listed earlier on this line
+        return dir;
+    }
+
+    // a change within the timestamp granularity of the scan would keep the mtime, so a listing
+    // taken that close to the last change is not trusted again
+    struct stat info;
+    if (stat(name, &info) == -1)
+    {
+        info.st_ino = 0;
+    }
+    if (dir->scanned && info.st_ino == dir->inode && info.st_dev == dir->device &&
+        info.st_mtim.tv_sec == dir->mtime.tv_sec && info.st_mtim.tv_nsec == dir->mtime.tv_nsec &&
+        timespec_seconds(&dir->mtime, &dir->scan_time) > GLOB_RACY_SECONDS)
+    {
+        return dir;
+    }
+
+    unsigned long long scan_start = trace_clock();
+    deallocate_arena(&dir->arena);
+    dir->names = NULL;
+    dir->count = dir->capacity = 0;
+    dir->scanned = 0;
+    clock_gettime(CLOCK_REALTIME, &dir->scan_time);
+    DIR *stream = opendir(name);
+    char failed = 0;
+    struct dirent *entry;
+    while (stream != NULL && !failed && (entry = readdir(stream)) != NULL)
+    {
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+        {
+            failed = !completion_add(&dir->arena, &dir->names, &dir->count, &dir->capacity, entry->d_name, strlen(entry->d_name));
+        }
+    }
+    if (stream != NULL)
+    {
+        closedir(stream);
+    }
+    if (failed)
+    {
+        return NULL;
+    }
+
+    if (dir->count > 1)
+    {
+        qsort(dir->names, dir->count, sizeof(char *), compare_strings);
+    }
+    dir->inode = info.st_ino;
+    dir->device = info.st_dev;
+    dir->mtime = info.st_mtim;
+    dir->scanned = (stream != NULL);
+    trace_record(TRACE_GLOB, scan_start, trace_shell_pid, name);
+    return dir;
+}
+
+// drops every cached directory listing
+void glob_cache_clear(void)
+{
+    for (int i = 0; i < GLOB_BUCKETS; i++)
+    {
+        while (glob_table[i] != NULL)
+        {
+            struct glob_dir *dir = glob_table[i];
+            glob_table[i] = dir->next;
+            deallocate_arena(&dir->arena);
+            free(dir->path);
+            free(dir);
+        }
+    }
+}
+
+// djb2 hash of a name that is not NUL terminated, as hash_string
+unsigned long hash_name(const char *name, size_t length)
+{
+    unsigned long hash = 5381;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash = ((hash << 5) + hash) + (unsigned char)name[i];
+    }
+    return hash;
+}
+
+// length of the variable name ([A-Za-z_][A-Za-z0-9_]*) text starts with, 0 if none
+size_t variable_name_length(const char *text, size_t length)
+{
+    size_t name_length = 0;
+    while (name_length < length && (text[name_length] == '_' || isalpha((unsigned char)text[name_length]) ||
+                                    (name_length > 0 && isdigit((unsigned char)text[name_length]))))
+    {
+        name_length++;
+    }
+    return name_length;
+}
+
+// returns the entry of a variable, adding it on first use with its value from the environment
+// (if it is there); returns NULL if allocation failed
+struct variable *variable_find(const char *name, size_t length)
+{
+    unsigned long bucket = hash_name(name, length) % VARIABLE_BUCKETS;
+    for (struct variable *variable = variable_table[bucket]; variable != NULL; variable = variable->next)
+    {
+        if (variable->name_length == length && strncmp(variable->text, name, length) == 0)
+        {
+            return variable;
+        }
+    }
+
+    // a variable that is not set is remembered too, so the environment is only searched once
+    const char *inherited = NULL;
+    for (char **entry = environ; *entry != NULL && inherited == NULL; entry++)
+    {
+        if (strncmp(*entry, name, length) == 0 && (*entry)[length] == '=')
+        {
+            inherited = *entry;
+        }
+    }
+    struct variable *variable = (struct variable *)malloc(sizeof(struct variable));
+    if (variable == NULL ||
+        (variable->text = inherited ? strdup(inherited) : strndup(name, length)) == NULL)
+    {
+        free(variable);
+        return NULL;
+    }
+    variable->name_length = length;
+    variable->exported = (inherited != NULL);
+    variable->next = variable_table[bucket];
+    variable_table[bucket] = variable;
+    return variable;
+}
+
+// sets a variable and, if export is set, exports it; an exported variable goes into the environment
+// right away, so every launch engine passes it on. returns 0 if allocation failed
+char variable_set(const char *name, size_t name_length, const char *value, size_t value_length, char export)
+{
+    struct variable *variable = variable_find(name, name_length);
+    char *text = variable ? (char *)malloc(name_length + value_length + 2) : NULL;
+    if (text == NULL)
+    {
+        return 0;
+    }
+    memcpy(text, name, name_length);
+    text[name_length] = '=';
+    memcpy(text + name_length + 1, value, value_length);
+    text[name_length + 1 + value_length] = '\0';
+
+    // putenv keeps the text itself; the old text is out of the environment once it is replaced
+    variable->exported |= export;
+    if (variable->exported)
+    {
+        if (putenv(text) != 0)
+        {
+            free(text);
+            return 0;
+        }
+        environment_changes++;
+    }
+    free(variable->text);
+    variable->text = text;
+    return 1;
+}
+
+// writes the word with $NAME, ${NAME} and $? replaced by their values to out (if not NULL);
+// variables that are not set expand to nothing and a '$' that starts none of them is kept
+// returns the length of the expanded word
+size_t expand_word_into(const char *word, size_t length, char *out)
+{
+    size_t used = 0;
+    for (size_t i = 0; i < length; i++)
+    {
+        const char *name = word + i + 1;
+        size_t name_length = 0;
+        size_t reference = 0;           // characters after the '$' that make up the reference
+        char status[16];
+        const char *value = NULL;
+        size_t value_length = 0;
+        if (word[i] == '$' && i + 1 < length)
+        {
+            if (word[i + 1] == '?')
+            {
+                value_length = (size_t)snprintf(status, sizeof(status), "%d", last_status);
+                value = status;
+                reference = 1;
+            }
+            else if (word[i + 1] == '{')
+            {
+                name++;
+                name_length = variable_name_length(name, length - i - 2);
+                if (name_length > 0 && i + 2 + name_length < length && name[name_length] == '}')
+                {
+                    reference = name_length + 2;
+                }
+            }
+            else
+            {
+                name_length = variable_name_length(name, length - i - 1);
+                reference = name_length;
+            }
+        }
+        if (reference == 0)
+        {
+            if (out) { out[used] = word[i]; }
+            used++;
+            continue;
+        }
+
+        struct variable *variable = value ? NULL : variable_find(name, name_length);
+        if (variable != NULL && variable->text[name_length] == '=')
+        {
+            value = variable->text + name_length + 1;
+            value_length = strlen(value);
+        }
+        if (out && value_length > 0) { memcpy(out + used, value, value_length); }
+        used += value_length;
+        i += reference;
+    }
+    return used;
+}
+
+// copies the word into the arena with its variables expanded (see expand_word_into) and sets
+// length to the expanded length; returns NULL if allocation failed
+char *expand_word(struct arena *arena, const char *word, size_t *length)
+{
+    size_t expanded_length = expand_word_into(word, *length, NULL);
+    char *expanded = (char *)arena_alloc(arena, expanded_length + 1);
+    if (expanded == NULL)
+    {
+        return NULL;
+    }
+    expand_word_into(word, *length, expanded);
+    expanded[expanded_length] = '\0';
+    *length = expanded_length;
+    return expanded;
+}
+
+// environment of a command with assignments in front of it: the shell's environment with the assigned
+// variables replaced or added (the last assignment of a name wins), built in the line arena
+// returns NULL if allocation failed
+char **command_environment(struct command *cmd, struct arena *arena)
+{
+    int count = 0;
+    while (environ[count] != NULL)
+    {
+        count++;
+    }
+    char **environment = (char **)arena_alloc(arena, (count + cmd->num_assignments + 1) * sizeof(char *));
+    if (environment == NULL)
+    {
+        return NULL;
+    }
+
+    int used = 0;
+    for (int i = 0; i < count + cmd->num_assignments; i++)
+    {
+        char *entry = i < count ? environ[i] : cmd->assignments[i - count];
+        size_t name_length = strcspn(entry, "=") + 1;
+        char replaced = 0;
+        for (int j = (i < count ? 0 : i - count + 1); j < cmd->num_assignments && !replaced; j++)
+        {
+            replaced = strncmp(cmd->assignments[j], entry, name_length) == 0;
+        }
+        if (!replaced)
+        {
+            environment[used++] = entry;
+        }
+    }
+    environment[used] = NULL;
+    return environment;
+}
+
+// programs that run in the shell when a pipeline is only one of them
+const struct fast_builtin FAST_BUILTINS[] = {
+    { "echo", builtin_echo }, { "printf", builtin_printf }, { "test", builtin_test }, { "[", builtin_test },
+    { "true", builtin_true }, { "false", builtin_false }, { "pwd", builtin_pwd }, { NULL, NULL }
+};
+
+// looks a program name up in the table of fast built-ins; returns NULL if it has none (or -X)
+const struct fast_builtin *fast_builtin_find(const char *name)
+{
+    for (int i = 0; fast_builtins && FAST_BUILTINS[i].name != NULL; i++)
+    {
+        if (strcmp(name, FAST_BUILTINS[i].name) == 0)
+        {
+            return &FAST_BUILTINS[i];
+        }
+    }
+    return NULL;
+}
+
+// runs a fast built-in in the shell; the redirections of cmd are applied to the shell's own fds while
+// it runs (the originals are set aside and put back), so its output lands where the program's would
+// returns the exit status, FAST_BUILTIN_DECLINED if the program has to run instead (nothing was
+// written) and FAST_BUILTIN_SYSTEM_ERROR if a file could not be opened or an fd not be swapped
+int fast_builtin_run(const struct fast_builtin *builtin, struct command *cmd)
+{
+    int files[3];
+    int opened = open_command_files(cmd, files);
+    if (opened != 1)
+    {
+        // a missing input file was reported, as the program would have
+        return opened == -1 ? 1 : FAST_BUILTIN_SYSTEM_ERROR;
+    }
+
+    // same order as the fork engine: stdin, a 2>&1 given before '>', stdout, 2>&1, then the error file
+    int sources[5] = { files[STDIN_FILENO], cmd->error_before_output ? STDOUT_FILENO : -1, files[STDOUT_FILENO],
+                       cmd->error_to_output && !cmd->error_before_output ? STDOUT_FILENO : -1, files[STDERR_FILENO] };
+    int targets[5] = { STDIN_FILENO, STDERR_FILENO, STDOUT_FILENO, STDERR_FILENO, STDERR_FILENO };
+    int saved[3] = { -1, -1, -1 };
+    char swapped[3] = { 0, 0, 0 };
+    char failed = 0;
+    fflush(stdout);
+    for (int i = 0; i < 5 && !failed; i++)
+    {
+        int fd = targets[i];
+        if (sources[i] == -1)
+        {
+            continue;
+        }
+        if (!swapped[fd])
+        {
+            // an fd the shell has closed is saved as -1 and closed again afterwards
+            saved[fd] = fcntl(fd, F_DUPFD_CLOEXEC, STDERR_FILENO + 1);
+            failed = (saved[fd] == -1 && errno != EBADF);
+            swapped[fd] = !failed;
+        }
+        failed = failed || dup2(sources[i], fd) == -1;
+    }
+
+    // a reader that went away fails the write instead of killing the shell
+    int status = FAST_BUILTIN_SYSTEM_ERROR;
+    if (!failed)
+    {
+        struct sigaction ignore, previous;
+        memset(&ignore, 0, sizeof(ignore));
+        ignore.sa_handler = SIG_IGN;
+        sigaction(SIGPIPE, &ignore, &previous);
+        struct builtin_output output = { 0, 0, "" };
+        status = builtin->run(cmd->argc, cmd->args, &output);
+        if (status != FAST_BUILTIN_DECLINED && (!builtin_flush(&output) || output.error != 0))
+        {
+            status = output.error == EPIPE ? 128 + SIGPIPE : 1;
+        }
+        sigaction(SIGPIPE, &previous, NULL);
+    }
+
+    for (int fd = 0; fd < 3; fd++)
+    {
+        if (swapped[fd] && saved[fd] == -1)
+        {
+            close(fd);
+        }
+        else if (swapped[fd])
+        {
+            dup2(saved[fd], fd);
+            close(saved[fd]);
+        }
+    }
+    close_command_files(cmd, files);
+    return status;
+}
+
+// appends length bytes to the output of a fast built-in, which is written out whenever the buffer
+// fills; nothing is written if output is NULL (a built-in only checking its arguments)
+void builtin_write(struct builtin_output *output, const char *text, size_t length)
+{
+    while (output != NULL && length > 0 && output->error == 0)
+    {
+        size_t room = sizeof(output->data) - output->used;
+        size_t part = length < room ? length : room;
+        memcpy(output->data + output->used, text, part);
+        output->used += part;
+        text += part;
+        length -= part;
+        if (output->used == sizeof(output->data))
+        {
+            builtin_flush(output);
+        }
+    }
+}
+
+// writes the buffered output of a fast built-in to stdout
+// returns 0 if a write failed (its errno is kept in the output)
+char builtin_flush(struct builtin_output *output)
+{
+    size_t written = 0;
+    while (written < output->used && output->error == 0)
+    {
+        ssize_t length = write(STDOUT_FILENO, output->data + written, output->used - written);
+        if (length > 0)
+        {
+            written += (size_t)length;
+        }
+        else if (length == 0 || errno != EINTR)
+        {
+            output->error = length == 0 ? EIO : errno;
+        }
+    }
+    output->used = 0;
+    return output->error == 0;
+}
+
+// true if a fast built-in is asked for its help or version, which only the program can give
+char builtin_asks_help(int argc, char **args)
+{
+    return argc == 2 && (strcmp(args[1], "--help") == 0 || strcmp(args[1], "--version") == 0);
+}
+
+// writes the character of the backslash escape at text to output (see ESCAPE_ECHO and others)
+// returns the length of the escape, 0 for \c (which ends all output) and -1 for an escape only the
+// program handles
+int builtin_escape(const char *text, char mode, struct builtin_output *output)
+{
+    // pairs of escape letter and character; echo has no \"
+    const char *simple = mode == ESCAPE_ECHO ? "\\\\a\ab\be\033f\fn\nr\rt\tv\v" : "\\\\a\ab\be\033f\fn\nr\rt\tv\v\"\"";
+    const char *found = NULL;
+    for (const char *pair = simple; *pair != '\0' && found == NULL; pair += 2)
+    {
+        found = (*pair == text[1]) ? pair : NULL;
+    }
+
+    char value;
+    int length = 2;
+    if (text[1] == 'c')
+    {
+        return 0;
+    }
+    else if (found != NULL)
+    {
+        value = found[1];
+    }
+    else if (text[1] >= '0' && text[1] <= '7')
+    {
+        // up to three octal digits; echo and %b take them after a 0 (\0NNN)
+        int start = (mode != ESCAPE_FORMAT && text[1] == '0') ? 2 : 1;
+        int number = 0;
+        for (length = start; length < start + 3 && text[length] >= '0' && text[length] <= '7'; length++)
+        {
+            number = number * 8 + (text[length] - '0');
+        }
+        value = (char)number;
+    }
+    else if (text[1] == 'x' && isxdigit((unsigned char)text[2]))
+    {
+        int number = 0;
+        for (length = 2; length < 4 && isxdigit((unsigned char)text[length]); length++)
+        {
+            int digit = tolower((unsigned char)text[length]);
+            number = number * 16 + (isdigit(digit) ? digit - '0' : digit - 'a' + 10);
+        }
+        value = (char)number;
+    }
+    else if (mode != ESCAPE_ECHO && (text[1] == '\0' || text[1] == 'x' || text[1] == 'u' || text[1] == 'U'))
+    {
+        // printf warns about or decodes these
+        return -1;
+    }
+    else
+    {
+        // echo keeps an unknown escape as it is
+        length = text[1] != '\0' ? 2 : 1;
+        builtin_write(output, text, (size_t)length);
+        return length;
+    }
+    builtin_write(output, &value, 1);
+    return length;
+}
+
+// writes text with its backslash escapes interpreted (see builtin_escape)
+// returns 0 if \c ended the output, -1 if text has an escape only the program handles and 1 otherwise
+int builtin_write_escaped(struct builtin_output *output, const char *text, char mode)
+{
+    while (*text != '\0')
+    {
+        const char *backslash = strchr(text, '\\');
+        size_t plain = backslash ? (size_t)(backslash - text) : strlen(text);
+        builtin_write(output, text, plain);
+        text += plain;
+        if (backslash == NULL)
+        {
+            break;
+        }
+        int length = builtin_escape(text, mode, output);
+        if (length <= 0)
+        {
+            return length;
+        }
+        text += length;
+    }
+    return 1;
+}
+
+// echo [-neE] [string ...], as coreutils echo: leading words of only n, e and E are options
+int builtin_echo(int argc, char **args, struct builtin_output *output)
+{
+    if (builtin_asks_help(argc, args))
+    {
+        return FAST_BUILTIN_DECLINED;
+    }
+
+    char newline = 1;
+    char escapes = 0;
+    int first = 1;
+    while (first < argc && args[first][0] == '-' && args[first][1] != '\0' &&
+           strspn(args[first] + 1, "neE") == strlen(args[first] + 1))
+    {
+        for (const char *option = args[first] + 1; *option != '\0'; option++)
+        {
+            newline = newline && *option != 'n';
+            escapes = (*option == 'e') || (escapes && *option != 'E');
+        }
+        first++;
+    }
+
+    for (int i = first; i < argc; i++)
+    {
+        if (i > first)
+        {
+            builtin_write(output, " ", 1);
+        }
+        if (!escapes)
+        {
+            builtin_write(output, args[i], strlen(args[i]));
+        }
+        else if (builtin_write_escaped(output, args[i], ESCAPE_ECHO) == 0)
+        {
+            // \c: no further output, not even the newline
+            return 0;
+        }
+    }
+    if (newline)
+    {
+        builtin_write(output, "\n", 1);
+    }
+    return 0;
+}
+
+// true [ignored ...]
+int builtin_true(int argc, char **args, struct builtin_output *output)
+{
+    return builtin_asks_help(argc, args) ? FAST_BUILTIN_DECLINED : 0;
+}
+
+// false [ignored ...]
+int builtin_false(int argc, char **args, struct builtin_output *output)
+{
+    return builtin_asks_help(argc, args) ? FAST_BUILTIN_DECLINED : 1;
+}
+
+// pwd, without options (-L and -P are left to the program)
+int builtin_pwd(int argc, char **args, struct builtin_output *output)
+{
+    char directory[PATH_MAX];
+    if (argc > 1 || getcwd(directory, sizeof(directory)) == NULL)
+    {
+        return FAST_BUILTIN_DECLINED;
+    }
+    builtin_write(output, directory, strlen(directory));
+    builtin_write(output, "\n", 1);
+    return 0;
+}
+
+// printf format [argument ...]; the format is first run without output, so that anything the program
+// would warn about (or handle differently) is left to it before a byte is written
+int builtin_printf(int argc, char **args, struct builtin_output *output)
+{
+    if (argc < 2 || builtin_asks_help(argc, args) || printf_format(argc, args, NULL) == FAST_BUILTIN_DECLINED)
+    {
+        return FAST_BUILTIN_DECLINED;
+    }
+    return printf_format(argc, args, output);
+}
+
+// reads a numeric printf argument: a C integer constant (decimal, 0x hex or 0 octal) or, after a
+// quote, the code of a single character; returns 0 if it is not one
+char printf_integer(const char *text, long long *value)
+{
+    if (text[0] == '\'' || text[0] == '"')
+    {
+        *value = (unsigned char)text[1];
+        return (unsigned char)text[1] < 0x80 && (text[1] == '\0' || text[2] == '\0');
+    }
+    char *end;
+    errno = 0;
+    *value = strtoll(text, &end, 0);
+    return end != text && *end == '\0' && errno == 0;
+}
+
+// formats one directive of printf (spec holds "%[flags][width][.precision]", stars the values of its
+// '*'s) into text with snprintf, with the argument converted to the type the conversion wants
+// returns the length of the text, -1 if the argument is not valid for the conversion or too long
+int printf_directive(char *spec, size_t spec_length, const int *stars, int num_stars, char conversion, const char *argument, char *text, size_t size)
+{
+    long long integer = 0;
+    long double number = 0;
+    char *end;
+    int length = -1;
+    if (strchr("diouxX", conversion) != NULL)
+    {
+        // an empty argument is 0
+        if (argument[0] != '\0' && !printf_integer(argument, &integer))
+        {
+            return -1;
+        }
+        spec[spec_length++] = 'l';
+        spec[spec_length++] = 'l';
+    }
+    else if (strchr("eEfFgGaA", conversion) != NULL)
+    {
+        errno = 0;
+        number = argument[0] != '\0' ? strtold(argument, &end) : 0;
+        if (argument[0] != '\0' && (end == argument || *end != '\0' || errno != 0))
+        {
+            return -1;
+        }
+        spec[spec_length++] = 'L';
+    }
+    else if (conversion == 'c')
+    {
+        // the program writes a NUL for an empty argument
+        if (argument[0] == '\0')
+        {
+            return -1;
+        }
+    }
+    else if (conversion != 's')
+    {
+        return -1;
+    }
+    spec[spec_length++] = conversion;
+    spec[spec_length] = '\0';
+
+    // a union of the argument types would not do, snprintf needs each with its own type
+    switch (conversion)
+    {
+        case 'c':
+            length = num_stars == 2 ? snprintf(text, size, spec, stars[0], stars[1], argument[0]) :
+                     num_stars == 1 ? snprintf(text, size, spec, stars[0], argument[0]) :
+                                      snprintf(text, size, spec, argument[0]);
+            break;
+        case 's':
+            length = num_stars == 2 ? snprintf(text, size, spec, stars[0], stars[1], argument) :
+                     num_stars == 1 ? snprintf(text, size, spec, stars[0], argument) :
+                                      snprintf(text, size, spec, argument);
+            break;
+        case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+            length = num_stars == 2 ? snprintf(text, size, spec, stars[0], stars[1], integer) :
+                     num_stars == 1 ? snprintf(text, size, spec, stars[0], integer) :
+                                      snprintf(text, size, spec, integer);
+            break;
+        default:
+            length = num_stars == 2 ? snprintf(text, size, spec, stars[0], stars[1], number) :
+                     num_stars == 1 ? snprintf(text, size, spec, stars[0], number) :
+                                      snprintf(text, size, spec, number);
+    }
+    return (length < 0 || (size_t)length >= size) ? -1 : length;
+}
+
+// runs the printf format over its arguments, again while arguments are left; writes nothing if
+// output is NULL. returns 0, or FAST_BUILTIN_DECLINED for what only the program handles
+int printf_format(int argc, char **args, struct builtin_output *output)
+{
+    const char *format = args[1];
+    int next = 2;
+    do
+    {
+        int first = next;
+        for (const char *c = format; *c != '\0'; )
+        {
+            if (*c == '\\')
+            {
+                int length = builtin_escape(c, ESCAPE_FORMAT, output);
+                if (length <= 0)
+                {
+                    return length == 0 ? 0 : FAST_BUILTIN_DECLINED;
+                }
+                c += length;
+                continue;
+            }
+            if (*c != '%' || c[1] == '%')
+            {
+                size_t plain = (*c == '%') ? 1 : strcspn(c, "%\\");
+                builtin_write(output, c, plain);
+                c += (*c == '%') ? 2 : plain;
+                continue;
+            }
+
+            // %[flags][width][.precision]conversion, each '*' takes an argument
+            char spec[PRINTF_SPEC_SIZE];
+            size_t spec_length = 0;
+            int stars[2];
+            int num_stars = 0;
+            spec[spec_length++] = *c++;
+            while (*c != '\0' && strchr("-+ #0", *c) != NULL && spec_length < PRINTF_SPEC_SIZE / 2)
+            {
+                spec[spec_length++] = *c++;
+            }
+            for (int part = 0; part < 2; part++)
+            {
+                if (part == 1 && *c != '.')
+                {
+                    break;
+                }
+                if (part == 1)
+                {
+                    spec[spec_length++] = *c++;
+                }
+                if (*c == '*')
+                {
+                    long long value = 0;
+                    if (next < argc && (!printf_integer(args[next], &value) || value < -PRINTF_WIDTH_MAX || value > PRINTF_WIDTH_MAX))
+                    {
+                        return FAST_BUILTIN_DECLINED;
+                    }
+                    next += (next < argc);
+                    stars[num_stars++] = (int)value;
+                    spec[spec_length++] = *c++;
+                    continue;
+                }
+                size_t digits = strspn(c, "0123456789");
+                if (digits > 4 || (digits > 0 && atoi(c) > PRINTF_WIDTH_MAX))
+                {
+                    return FAST_BUILTIN_DECLINED;
+                }
+                memcpy(spec + spec_length, c, digits);
+                spec_length += digits;
+                c += digits;
+            }
+            if (*c == '\0')
+            {
+                return FAST_BUILTIN_DECLINED;
+            }
+
+            // missing arguments are empty (0 for numbers)
+            char conversion = *c++;
+            const char *argument = next < argc ? args[next++] : "";
+            if (conversion == 'b' && spec_length == 1)
+            {
+                int result = builtin_write_escaped(output, argument, ESCAPE_ARGUMENT);
+                if (result <= 0)
+                {
+                    return result == 0 ? 0 : FAST_BUILTIN_DECLINED;
+                }
+                continue;
+            }
+            if (conversion == 's' && spec_length == 1)
+            {
+                builtin_write(output, argument, strlen(argument));
+                continue;
+            }
+            char text[PRINTF_WIDTH_MAX * 2 + 64];
+            int length = printf_directive(spec, spec_length, stars, num_stars, conversion, argument, text, sizeof(text));
+            if (length == -1)
+            {
+                return FAST_BUILTIN_DECLINED;
+            }
+            builtin_write(output, text, (size_t)length);
+        }
+
+        // the program warns about arguments a format without directives leaves over
+        if (next == first)
+        {
+            return next < argc ? FAST_BUILTIN_DECLINED : 0;
+        }
+    } while (next < argc);
+    return 0;
+}
+
+// test expression and [ expression ]: the POSIX rules for up to four arguments; longer expressions
+// and anything the program would report as an error are left to it
+int builtin_test(int argc, char **args, struct builtin_output *output)
+{
+    int count = argc - 1;
+    if (strcmp(args[0], "[") == 0)
+    {
+        if (builtin_asks_help(argc, args) || count == 0 || strcmp(args[count], "]") != 0)
+        {
+            return FAST_BUILTIN_DECLINED;
+        }
+        count--;
+    }
+    return test_expression(count, args + 1);
+}
+
+// evaluates count arguments of test; returns 0 (true), 1 (false) or FAST_BUILTIN_DECLINED
+int test_expression(int count, char **args)
+{
+    int result = FAST_BUILTIN_DECLINED;
+    if (count == 0)
+    {
+        return 1;
+    }
+    if (count == 1)
+    {
+        return args[0][0] == '\0';
+    }
+    if (count == 3)
+    {
+        // a binary operator in the middle wins over '!' and parentheses
+        result = test_binary(args[0], args[1], args[2]);
+        if (result == FAST_BUILTIN_DECLINED && strcmp(args[0], "(") == 0 && strcmp(args[2], ")") == 0)
+        {
+            result = test_expression(1, args + 1);
+        }
+    }
+    if (count == 4 && strcmp(args[0], "(") == 0 && strcmp(args[3], ")") == 0)
+    {
+        result = test_expression(2, args + 1);
+    }
+    if (result == FAST_BUILTIN_DECLINED && count <= 4 && strcmp(args[0], "!") == 0)
+    {
+        result = test_expression(count - 1, args + 1);
+        return result == FAST_BUILTIN_DECLINED ? result : !result;
+    }
+    if (count == 2)
+    {
+        result = test_unary(args[0], args[1]);
+    }
+    return result;
+}
+
+// unary test operators on strings and files; returns 0 (true), 1 (false) or FAST_BUILTIN_DECLINED
+int test_unary(const char *operator, const char *operand)
+{
+    if (operator[0] != '-' || operator[1] == '\0' || operator[2] != '\0')
+    {
+        return FAST_BUILTIN_DECLINED;
+    }
+
+    char option = operator[1];
+    struct stat info;
+    long long fd;
+    switch (option)
+    {
+        case 'n':
+            return operand[0] == '\0';
+        case 'z':
+            return operand[0] != '\0';
+        case 'r':
+            return faccessat(AT_FDCWD, operand, R_OK, AT_EACCESS) != 0;
+        case 'w':
+            return faccessat(AT_FDCWD, operand, W_OK, AT_EACCESS) != 0;
+        case 'x':
+            return faccessat(AT_FDCWD, operand, X_OK, AT_EACCESS) != 0;
+        case 'L':
+        case 'h':
+            return !(lstat(operand, &info) == 0 && S_ISLNK(info.st_mode));
+        case 't':
+            if (!test_integer(operand, &fd))
+            {
+                return FAST_BUILTIN_DECLINED;
+            }
+            return !(fd >= 0 && fd <= INT_MAX && isatty((int)fd));
+    }
+    if (strchr("efdsbcpSgukOG", option) == NULL)
+    {
+        return FAST_BUILTIN_DECLINED;
+    }
+    if (stat(operand, &info) != 0)
+    {
+        return 1;
+    }
+    switch (option)
+    {
+        case 'f': return !S_ISREG(info.st_mode);
+        case 'd': return !S_ISDIR(info.st_mode);
+        case 's': return !(info.st_size > 0);
+        case 'b': return !S_ISBLK(info.st_mode);
+        case 'c': return !S_ISCHR(info.st_mode);
+        case 'p': return !S_ISFIFO(info.st_mode);
+        case 'S': return !S_ISSOCK(info.st_mode);
+        case 'g': return !(info.st_mode & S_ISGID);
+        case 'u': return !(info.st_mode & S_ISUID);
+        case 'k': return !(info.st_mode & S_ISVTX);
+        case 'O': return info.st_uid != geteuid();
+        case 'G': return info.st_gid != getegid();
+    }
+    return 0;
+}
+
+// binary test operators on strings, integers and files; returns 0 (true), 1 (false) or
+// FAST_BUILTIN_DECLINED if operator is none of them (or an integer is malformed)
+int test_binary(const char *left, const char *operator, const char *right)
+{
+    const char *integer_operators[] = { "-eq", "-ne", "-lt", "-le", "-gt", "-ge", NULL };
+    for (int i = 0; integer_operators[i] != NULL; i++)
+    {
+        long long a, b;
+        if (strcmp(operator, integer_operators[i]) != 0)
+        {
+            continue;
+        }
+        if (!test_integer(left, &a) || !test_integer(right, &b))
+        {
+            return FAST_BUILTIN_DECLINED;
+        }
+        char results[] = { a == b, a != b, a < b, a <= b, a > b, a >= b };
+        return !results[i];
+    }
+
+    if (strcmp(operator, "=") == 0 || strcmp(operator, "==") == 0)
+    {
+        return strcmp(left, right) != 0;
+    }
+    else if (strcmp(operator, "!=") == 0)
+    {
+        return strcmp(left, right) == 0;
+    }
+    else if (strcmp(operator, "-a") == 0)
+    {
+        return !(left[0] != '\0' && right[0] != '\0');
+    }
+    else if (strcmp(operator, "-o") == 0)
+    {
+        return !(left[0] != '\0' || right[0] != '\0');
+    }
+    else if (strcmp(operator, "-ef") != 0 && strcmp(operator, "-nt") != 0 && strcmp(operator, "-ot") != 0)
+    {
+        return FAST_BUILTIN_DECLINED;
+    }
+
+    // for -nt and -ot a file that exists is newer than one that does not
+    struct stat left_info, right_info;
+    char left_exists = stat(left, &left_info) == 0;
+    char right_exists = stat(right, &right_info) == 0;
+    if (operator[1] == 'e')
+    {
+        return !(left_exists && right_exists && left_info.st_dev == right_info.st_dev && left_info.st_ino == right_info.st_ino);
+    }
+    int order = (left_exists - right_exists);
+    if (left_exists && right_exists)
+    {
+        order = (left_info.st_mtim.tv_sec > right_info.st_mtim.tv_sec) - (left_info.st_mtim.tv_sec < right_info.st_mtim.tv_sec);
+        order = order != 0 ? order : (left_info.st_mtim.tv_nsec > right_info.st_mtim.tv_nsec) - (left_info.st_mtim.tv_nsec < right_info.st_mtim.tv_nsec);
+    }
+    return operator[1] == 'n' ? !(order > 0) : !(order < 0);
+}
+
+// reads an integer operand of test (blanks around it are allowed); returns 0 if it is not one
+char test_integer(const char *text, long long *value)
+{
+    char *end;
+    errno = 0;
+    *value = strtoll(text, &end, 10);
+    while (isblank((unsigned char)*end))
+    {
+        end++;
+    }
+    return end != text && *end == '\0' && errno == 0;
+}
+
+// gives an empty arena the static storage as its first block
+void arena_preallocate(struct arena *arena, union arena_storage *storage)
+{
+    struct arena_block *block = (struct arena_block *)storage->bytes;
+    block->next = NULL;
+    block->size = sizeof(storage->bytes) - sizeof(struct arena_block);
+    block->used = 0;
+    block->preallocated = 1;
+    arena->blocks = block;
+}
+
+// hands out size bytes of the arena (aligned for any of the shell's structures);
+// returns NULL if allocation failed
+void *arena_alloc(struct arena *arena, size_t size)
+{
+    size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    struct arena_block *block = arena->blocks;
+    if (block == NULL || block->size - block->used < size)
+    {
+        // start a new block; oversized requests get a block of their own
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = (struct arena_block *)malloc(sizeof(struct arena_block) + block_size);
+        if (block == NULL)
+        {
+            return NULL;
+        }
+        block->next = arena->blocks;
+        block->size = block_size;
+        block->used = 0;
+        block->preallocated = 0;
+        arena->blocks = block;
+    }
+    void *ptr = block->data + block->used;
+    block->used += size;
+    return ptr;
+}
+
+// returns an arena array with room for at least count + 1 elements, copying the count elements
+// of array if it had to grow; returns NULL if allocation failed
+void *arena_grow_array(struct arena *arena, void *array, int count, int *capacity, size_t element_size)
+{
+    if (count < *capacity)
+    {
+        return array;
+    }
+    int new_capacity = *capacity ? *capacity * 2 : 4;
+    while (new_capacity <= count)
+    {
+        new_capacity *= 2;
+    }
+    void *grown = arena_alloc(arena, new_capacity * element_size);
+    if (grown == NULL)
+    {
+        return NULL;
+    }
+    if (count > 0)
+    {
+        memcpy(grown, array, count * element_size);
+    }
+    *capacity = new_capacity;
+    return grown;
+}
+
+// copies length characters of str into the arena as a NUL terminated string
+char *arena_strndup(struct arena *arena, const char *str, size_t length)
+{
+    char *copy = (char *)arena_alloc(arena, length + 1);
+    if (copy != NULL)
+    {
+        memcpy(copy, str, length);
+        copy[length] = '\0';
+    }
+    return copy;
+}
+
+// releases everything allocated from the arena; the newest block is kept for reuse
+void arena_reset(struct arena *arena)
+{
+    struct arena_block *block = arena->blocks;
+    if (block == NULL)
+    {
+        return;
+    }
+    struct arena_block *old = block->next;
+    while (old != NULL)
+    {
+        struct arena_block *next = old->next;
+        if (!old->preallocated)
+        {
+            free(old);
+        }
+        old = next;
+    }
+    block->next = NULL;
+    block->used = 0;
+}
+
+// turns the line editor on for an interactive shell on a terminal (unless TERM is dumb) and loads
+// the history from $WISH_HISTORY (default ~/.wish_history)
+void line_editor_init(char **shell_path, int num_path)
+{
+    char *term = getenv("TERM");
+    if (!isatty(STDOUT_FILENO) || (term != NULL && strcmp(term, "dumb") == 0) ||
+        tcgetattr(STDIN_FILENO, &editor_termios) == -1)
+    {
+        return;
+    }
+    line_editor = 1;
+    completion_update_path(shell_path, num_path);
+
+    char path[PATH_MAX];
+    char *file = getenv("WISH_HISTORY");
+    char *home = getenv("HOME");
+    if (file == NULL || *file == '\0')
+    {
+        if (home == NULL || snprintf(path, sizeof(path), "%s/.wish_history", home) >= (int)sizeof(path))
+        {
+            return;
+        }
+        file = path;
+    }
+    char *size = getenv("WISH_HISTORY_SIZE");
+    long limit = size != NULL ? strtol(size, NULL, 10) : 0;
+    history_load(file, limit > 0 && limit <= INT_MAX / 2 ? (int)limit : HISTORY_SIZE);
+}
+
+// reads a line from the terminal in raw mode: editing keys, history (Up/Down, Ctrl-R) and tab
+// completion; background jobs finishing meanwhile are reported above the line
+// returns the length of the line, which ends with a newline as with getline, or -1 at the end of input
+ssize_t line_editor_read(const char *prompt, char **buffer, size_t *size, struct job_table *jobs)
+{
+    struct line_editor editor = { buffer, size, 0, 0, prompt, history.count, NULL, 0 };
+    if (!editor_set(&editor, ""))
+    {
+        return -1;
+    }
+
+    // lines run with the terminal as the shell found it
+    struct termios raw = editor_termios;
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    fflush(stdout);
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+    editor_refresh(&editor);
+
+    ssize_t result = -2;
+    int next_key = EDITOR_KEY_NONE;
+    while (result == -2)
+    {
+        int key = next_key != EDITOR_KEY_NONE ? next_key : editor_read_key(&editor, jobs);
+        next_key = EDITOR_KEY_NONE;
+        char tab = 0;
+        switch (key)
+        {
+            case EDITOR_KEY_EOF:
+                result = -1;
+                break;
+            case '\r':
+            case '\n':
+                result = (ssize_t)editor.length;
+                break;
+            case 4:     // Ctrl-D: end of input on an empty line
+                if (editor.length == 0)
+                {
+                    result = -1;
+                    break;
+                }
+                // fall through
+            case EDITOR_KEY_DELETE:
+                editor_delete(&editor, editor.cursor, editor_next_char(&editor, editor.cursor, 1));
+                break;
+            case 127:   // Backspace
+            case 8:     // Ctrl-H
+                editor_delete(&editor, editor_next_char(&editor, editor.cursor, -1), editor.cursor);
+                break;
+            case 1:     // Ctrl-A
+            case EDITOR_KEY_HOME:
+                editor.cursor = 0;
+                break;
+            case 5:     // Ctrl-E
+            case EDITOR_KEY_END:
+                editor.cursor = editor.length;
+                break;
+            case 2:     // Ctrl-B
+            case EDITOR_KEY_LEFT:
+                editor.cursor = editor_next_char(&editor, editor.cursor, -1);
+                break;
+            case 6:     // Ctrl-F
+            case EDITOR_KEY_RIGHT:
+                editor.cursor = editor_next_char(&editor, editor.cursor, 1);
+                break;
+            case EDITOR_KEY_WORD_LEFT:
+                editor.cursor = editor_next_word(&editor, editor.cursor, -1);
+                break;
+            case EDITOR_KEY_WORD_RIGHT:
+                editor.cursor = editor_next_word(&editor, editor.cursor, 1);
+                break;
+            case 11:    // Ctrl-K: delete to the end of the line
+                editor_delete(&editor, editor.cursor, editor.length);
+                break;
+            case 21:    // Ctrl-U: delete to the start of the line
+                editor_delete(&editor, 0, editor.cursor);
+                break;
+            case 23:    // Ctrl-W: delete the word before the cursor
+                editor_delete(&editor, editor_next_word(&editor, editor.cursor, -1), editor.cursor);
+                break;
+            case 12:    // Ctrl-L
+                write(STDOUT_FILENO, "\x1b[H\x1b[2J", 7);
+                break;
+            case 3:     // Ctrl-C: the line is dropped
+                write(STDOUT_FILENO, "^C\r\n", 4);
+                editor_set(&editor, "");
+                editor.history_position = history.count;
+                break;
+            case 16:    // Ctrl-P
+            case EDITOR_KEY_UP:
+                editor_history(&editor, -1);
+                break;
+            case 14:    // Ctrl-N
+            case EDITOR_KEY_DOWN:
+                editor_history(&editor, 1);
+                break;
+            case 18:    // Ctrl-R: the key that ends the search is handled as usual
+                next_key = editor_search(&editor, jobs);
+                break;
+            case '\t':
+                editor_complete(&editor, editor.completed);
+                tab = 1;
+                break;
+            default:
+                // printable characters (bytes of UTF-8 sequences included), other controls are ignored
+                if (key >= 32 && key < 256)
+                {
+                    char byte = (char)key;
+                    editor_insert(&editor, &byte, 1);
+                }
+        }
+        editor.completed = tab;
+        if (result == -2)
+        {
+            editor_refresh(&editor);
+        }
+    }
+
+    write(STDOUT_FILENO, "\r\n", 2);
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &editor_termios);
+    free(editor.pending);
+    if (result == -1)
+    {
+        return -1;
+    }
+    history_add(*buffer, editor.length);
+    (*buffer)[editor.length] = '\n';
+    (*buffer)[editor.length + 1] = '\0';
+    return result + 1;
+}
+
+// waits for the next key; background jobs that finish meanwhile are reported and the line is
+// drawn again below them. escape sequences of the cursor keys are returned as EDITOR_KEY_*
+int editor_read_key(struct line_editor *editor, struct job_table *jobs)
+{
+    struct pollfd fds[2] = { { STDIN_FILENO, POLLIN, 0 }, { sigchld_pipe[0], POLLIN, 0 } };
+    while (1)
+    {
+        // the history search index is built a chunk at a time while the user is idle
+        int ready = poll(fds, 2, history_update_index(0) ? -1 : 0);
+        if (ready == 0)
+        {
+            history_update_index(HISTORY_INDEX_CHUNK);
+            continue;
+        }
+        if (ready == -1)
+        {
+            if (errno == EINTR) { continue; }
+            return EDITOR_KEY_EOF;
+        }
+        if (fds[1].revents & POLLIN)
+        {
+            job_table_poll(jobs);
+            write(STDOUT_FILENO, "\r\x1b[K", 4);
+            job_table_notify(jobs, 1);
+            editor_refresh(editor);
+        }
+        if (fds[0].revents)
+        {
+            break;
+        }
+    }
+
+    int key = editor_read_byte(-1);
+    if (key != 27)
+    {
+        return key;
+    }
+
+    // a lone escape is ignored; Alt-b and Alt-f move by words
+    int next = editor_read_byte(50);
+    if (next == 'b' || next == 'f')
+    {
+        return next == 'b' ? EDITOR_KEY_WORD_LEFT : EDITOR_KEY_WORD_RIGHT;
+    }
+    if (next != '[' && next != 'O')
+    {
+        return EDITOR_KEY_NONE;
+    }
+
+    // CSI: numeric parameters up to the final byte, e.g. "3~" (Delete) or "1;5C" (Ctrl-Right)
+    int number = 0;
+    int modifier = 0;
+    int final;
+    while ((final = editor_read_byte(50)) >= '0' && final <= ';')
+    {
+        if (final == ';')
+        {
+            modifier = 1;
+        }
+        else if (!modifier)
+        {
+            number = number * 10 + (final - '0');
+        }
+    }
+    switch (final)
+    {
+        case 'A': return EDITOR_KEY_UP;
+        case 'B': return EDITOR_KEY_DOWN;
+        case 'C': return modifier ? EDITOR_KEY_WORD_RIGHT : EDITOR_KEY_RIGHT;
+        case 'D': return modifier ? EDITOR_KEY_WORD_LEFT : EDITOR_KEY_LEFT;
+        case 'H': return EDITOR_KEY_HOME;
+        case 'F': return EDITOR_KEY_END;
+        case '~':
+            if (number == 1 || number == 7) { return EDITOR_KEY_HOME; }
+            if (number == 4 || number == 8) { return EDITOR_KEY_END; }
+            if (number == 3) { return EDITOR_KEY_DELETE; }
+    }
+    return EDITOR_KEY_NONE;
+}
+
+// reads a byte of the terminal, waiting at most timeout ms (-1 waits for ever)
+// returns EDITOR_KEY_EOF at the end of input and EDITOR_KEY_NONE on a timeout
+int editor_read_byte(int timeout)
+{
+    struct pollfd input = { STDIN_FILENO, POLLIN, 0 };
+    unsigned char byte;
+    while (1)
+    {
+        int ready = poll(&input, 1, timeout);
+        if (ready == 0)
+        {
+            return EDITOR_KEY_NONE;
+        }
+        ssize_t length = ready > 0 ? read(STDIN_FILENO, &byte, 1) : -1;
+        if (length == 1)
+        {
+            return byte;
+        }
+        if (length == 0 || errno != EINTR)
+        {
+            return EDITOR_KEY_EOF;
+        }
+    }
+}
+
+// draws the prompt and the line in place, scrolled sideways so that the cursor is on screen
+void editor_refresh(struct line_editor *editor)
+{
+    struct winsize window;
+    size_t width = (ioctl(STDOUT_FILENO, TIOCGWINSZ, &window) == 0 && window.ws_col > 0) ? window.ws_col : 80;
+    const char *line = *editor->line;
+    size_t prompt_length = strlen(editor->prompt);
+    size_t prompt_columns = editor_columns(editor->prompt, prompt_length);
+
+    // the last column is left free so the terminal never wraps
+    size_t room = width > prompt_columns + 1 ? width - prompt_columns - 1 : 1;
+    size_t start = 0;
+    while (editor_columns(line + start, editor->cursor - start) > room)
+    {
+        start = editor_next_char(editor, start, 1);
+    }
+    size_t end = start;
+    size_t columns = 0;
+    while (end < editor->length && columns < room && end - start < EDITOR_OUTPUT_SIZE / 2)
+    {
+        end = editor_next_char(editor, end, 1);
+        columns++;
+    }
+    size_t cursor_columns = prompt_columns + editor_columns(line + start, editor->cursor - start);
+
+    char output[EDITOR_OUTPUT_SIZE];
+    int used = snprintf(output, sizeof(output), "\r%.*s", EDITOR_OUTPUT_SIZE / 4, editor->prompt);
+    memcpy(output + used, line + start, end - start);
+    used += (int)(end - start);
+    used += snprintf(output + used, sizeof(output) - used, "\x1b[K\r");
+    if (cursor_columns > 0)
+    {
+        used += snprintf(output + used, sizeof(output) - used, "\x1b[%zuC", cursor_columns);
+    }
+    write(STDOUT_FILENO, output, used);
+}
+
+// columns taken by text on the terminal: every character but the continuation bytes of UTF-8
+size_t editor_columns(const char *text, size_t length)
+{
+    size_t columns = 0;
+    for (size_t i = 0; i < length; i++)
+    {
+        columns += ((text[i] & 0xC0) != 0x80);
+    }
+    return columns;
+}
+
+// offset of the character after (direction 1) or before (-1) position
+size_t editor_next_char(struct line_editor *editor, size_t position, int direction)
+{
+    const char *line = *editor->line;
+    if (direction > 0)
+    {
+        if (position < editor->length) { position++; }
+        while (position < editor->length && (line[position] & 0xC0) == 0x80) { position++; }
+    }
+    else
+    {
+        if (position > 0) { position--; }
+        while (position > 0 && (line[position] & 0xC0) == 0x80) { position--; }
+    }
+    return position;
+}
+
+// offset of the end of the next word (direction 1) or start of the previous one (-1)
+size_t editor_next_word(struct line_editor *editor, size_t position, int direction)
+{
+    const char *line = *editor->line;
+    if (direction > 0)
+    {
+        while (position < editor->length && line[position] == ' ') { position++; }
+        while (position < editor->length && line[position] != ' ') { position++; }
+    }
+    else
+    {
+        while (position > 0 && line[position - 1] == ' ') { position--; }
+        while (position > 0 && line[position - 1] != ' ') { position--; }
+    }
+    return position;
+}
+
+// inserts text at the cursor, growing the command buffer (room is kept for the newline and the
+// NUL terminator); returns 0 if allocation failed
+char editor_insert(struct line_editor *editor, const char *text, size_t length)
+{
+    if (editor->length + length + 2 > *editor->size)
+    {
+        size_t size = *editor->size ? *editor->size : 128;
+        while (editor->length + length + 2 > size)
+        {
+            size *= 2;
+        }
+        char *line = (char *)realloc(*editor->line, size);
+        if (line == NULL)
+        {
+            return 0;
+        }
+        *editor->line = line;
+        *editor->size = size;
+    }
+    char *line = *editor->line;
+    memmove(line + editor->cursor + length, line + editor->cursor, editor->length - editor->cursor);
+    memcpy(line + editor->cursor, text, length);
+    editor->cursor += length;
+    editor->length += length;
+    line[editor->length] = '\0';
+    return 1;
+}
+
+// removes the bytes [from, to) of the line
+void editor_delete(struct line_editor *editor, size_t from, size_t to)
+{
+    if (from >= to)
+    {
+        return;
+    }
+    char *line = *editor->line;
+    memmove(line + from, line + to, editor->length - to + 1);
+    editor->length -= to - from;
+    editor->cursor = from;
+}
+
+// replaces the line with text, the cursor goes to its end; returns 0 if allocation failed
+char editor_set(struct line_editor *editor, const char *text)
+{
+    editor->length = editor->cursor = 0;
+    if (*editor->line != NULL)
+    {
+        (*editor->line)[0] = '\0';
+    }
+    return editor_insert(editor, text, strlen(text));
+}
+
+// shows the next older (direction -1) or newer (1) history entry; the line being typed is kept
+// and comes back after the newest entry
+void editor_history(struct line_editor *editor, int direction)
+{
+    int position = editor->history_position + direction;
+    if (position < 0 || position > history.count)
+    {
+        return;
+    }
+    if (editor->history_position == history.count)
+    {
+        free(editor->pending);
+        editor->pending = strndup(*editor->line, editor->length);
+    }
+    editor->history_position = position;
+    if (position == history.count)
+    {
+        editor_set(editor, editor->pending ? editor->pending : "");
+    }
+    else
+    {
+        editor_set(editor, history.entries[position]);
+    }
+}
+
+// reverse incremental search (Ctrl-R): the newest entry containing the query is shown while it is
+// typed and Ctrl-R moves on to older ones. Ctrl-G and Ctrl-C give the line back as it was, any
+// other key keeps the match and is returned to be handled as usual (Enter runs it)
+int editor_search(struct line_editor *editor, struct job_table *jobs)
+{
+    char query[EDITOR_QUERY_SIZE];
+    char prompt[EDITOR_QUERY_SIZE + 32];
+    size_t query_length = 0;
+    int match = history.count;      // entry shown, history.count while nothing matched yet
+    char failed = 0;
+    char *original = strndup(*editor->line, editor->length);
+    const char *saved_prompt = editor->prompt;
+    query[0] = '\0';
+    editor->prompt = prompt;
+
+    int key;
+    while (1)
+    {
+        snprintf(prompt, sizeof(prompt), "(%sreverse-i-search)`%s': ", failed ? "failed " : "", query);
+        editor_refresh(editor);
+
+        key = editor_read_key(editor, jobs);
+        int from = -1;
+        if (key == 18)
+        {
+            from = match;                   // older than the match shown
+        }
+        else if ((key == 127 || key == 8) && query_length > 0)
+        {
+            query[--query_length] = '\0';
+            from = history.count;           // a shorter query starts over from the newest entry
+        }
+        else if (key >= 32 && key < 256 && query_length + 1 < sizeof(query))
+        {
+            query[query_length++] = (char)key;
+            query[query_length] = '\0';
+            from = match < history.count ? match + 1 : history.count;  // the match shown may still do
+        }
+        else if (key == 127 || key == 8)
+        {
+            continue;
+        }
+        else
+        {
+            break;
+        }
+
+        int found = query_length > 0 ? history_search(query, from) : -1;
+        failed = (found == -1 && query_length > 0);
+        if (found != -1)
+        {
+            match = found;
+            editor_set(editor, history.entries[match]);
+            editor->cursor = (size_t)(strstr(history.entries[match], query) - history.entries[match]);
+        }
+    }
+
+    editor->prompt = saved_prompt;
+    if (key == 7 || key == 3)
+    {
+        editor_set(editor, original ? original : "");
+        key = EDITOR_KEY_NONE;
+    }
+    else if (match < history.count)
+    {
+        editor->history_position = match;
+    }
+    free(original);
+    return key;
+}
+
+// completes the word before the cursor: in command position with the built-ins and the programs of
+// the shell path (from the completion index), otherwise with file names. The common part of the
+// candidates is inserted; if there is none, list prints every candidate
+void editor_complete(struct line_editor *editor, char list)
+{
+    const char *line = *editor->line;
+    size_t word = editor->cursor;
+    while (word > 0 && strchr(" \t&|<>", line[word - 1]) == NULL)
+    {
+        word--;
+    }
+    size_t before = word;
+    while (before > 0 && (line[before - 1] == ' ' || line[before - 1] == '\t'))
+    {
+        before--;
+    }
+    const char *prefix = line + word;
+    size_t prefix_length = editor->cursor - word;
+    char *slash = (char *)memrchr(prefix, '/', prefix_length);
+    char command = (before == 0 || line[before - 1] == '&' || line[before - 1] == '|') && slash == NULL;
+
+    struct arena arena = { NULL };
+    char **candidates = NULL;
+    int count = 0;
+    int capacity = 0;
+    char failed = 0;
+    if (command)
+    {
+        for (int i = 0; BUILTIN_COMMANDS[i] != NULL; i++)
+        {
+            if (strncmp(BUILTIN_COMMANDS[i], prefix, prefix_length) == 0)
+            {
+                failed |= !completion_add(&arena, &candidates, &count, &capacity, BUILTIN_COMMANDS[i], strlen(BUILTIN_COMMANDS[i]));
+            }
+        }
+        for (int i = 0; i < num_completion_dirs; i++)
+        {
+            struct completion_dir *dir = &completion_dirs[i];
+            if (!completion_scan(dir))
+            {
+                continue;
+            }
+            // the names are sorted: find the first one not below the prefix
+            int low = 0;
+            int high = dir->count;
+            while (low < high)
+            {
+                int middle = (low + high) / 2;
+                if (strncmp(dir->names[middle], prefix, prefix_length) < 0) { low = middle + 1; }
+                else { high = middle; }
+            }
+            for (int j = low; j < dir->count && strncmp(dir->names[j], prefix, prefix_length) == 0; j++)
+            {
+                failed |= !completion_add(&arena, &candidates, &count, &capacity, dir->names[j], strlen(dir->names[j]));
+            }
+        }
+    }
+    else
+    {
+        // file names of the directory part of the word; directories get a trailing slash
+        char directory[PATH_MAX];
+        size_t directory_length = slash ? (size_t)(slash - prefix) + 1 : 0;
+        snprintf(directory, sizeof(directory), "%.*s", (int)directory_length, prefix);
+        DIR *stream = opendir(directory_length ? directory : ".");
+        struct dirent *entry;
+        while (stream != NULL && (entry = readdir(stream)) != NULL)
+        {
+            const char *name = entry->d_name;
+            size_t name_length = strlen(name);
+            if (strncmp(name, prefix + directory_length, prefix_length - directory_length) != 0 ||
+                strcmp(name, ".") == 0 || strcmp(name, "..") == 0 ||
+                (name[0] == '.' && prefix_length == directory_length))
+            {
+                continue;
+            }
+            struct stat info;
+            char is_directory = (entry->d_type == DT_DIR) ||
+                                ((entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN) &&
+                                 fstatat(dirfd(stream), name, &info, 0) == 0 && S_ISDIR(info.st_mode));
+            char *candidate = (char *)arena_alloc(&arena, directory_length + name_length + 2);
+            if (candidate == NULL)
+            {
+                failed = 1;
+                break;
+            }
+            snprintf(candidate, directory_length + name_length + 2, "%s%s%s", directory, name, is_directory ? "/" : "");
+            failed |= !completion_add(&arena, &candidates, &count, &capacity, candidate, strlen(candidate));
+        }
+        if (stream != NULL)
+        {
+            closedir(stream);
         }
+    }
 
-        // rout stdout to file
-        if (dup2(fd, STDOUT_FILENO) == -1) 
+    // the same program may be in several directories of the path
+    if (count > 1)
+    {
+        qsort(candidates, count, sizeof(char *), compare_strings);
+        int unique = 1;
+        for (int i = 1; i < count; i++)
         {
-            deallocate_string(buffer);
-            deallocate_shell_path(shell_path, num_path);
-            close(fd);
-            deallocate_string(&filename_final);
-            shell_system_error(ERROR_MESSAGE);
+            if (strcmp(candidates[i], candidates[unique - 1]) != 0)
+            {
+                candidates[unique++] = candidates[i];
+            }
         }
-        close(fd);
-        deallocate_string(&filename_final);
+        count = unique;
     }
 
-    // continue getting command args
-    char *token = strtok(*buffer, " ");
-    while (token) 
+    size_t common = count > 0 ? strlen(candidates[0]) : 0;
+    for (int i = 1; i < count; i++)
     {
-        args[i++] = token;
-        token = strtok(NULL, " ");
+        size_t j = 0;
+        while (j < common && candidates[i][j] == candidates[0][j]) { j++; }
+        common = j;
     }
-    args[i] = NULL;  // NULL terminate the args array
 
-    char executable_path[512];
-    int command_found = 0;
+    if (failed || count == 0)
+    {
+        write(STDOUT_FILENO, "\a", 1);
+    }
+    else if (common > prefix_length)
+    {
+        editor_insert(editor, candidates[0] + prefix_length, common - prefix_length);
+        if (count == 1 && candidates[0][common - 1] != '/')
+        {
+            editor_insert(editor, " ", 1);
+        }
+    }
+    else if (list)
+    {
+        write(STDOUT_FILENO, "\r\n", 2);
+        for (int i = 0; i < count; i++)
+        {
+            dprintf(STDOUT_FILENO, "%s%s", candidates[i], i + 1 < count ? "  " : "\r\n");
+        }
+    }
+    deallocate_arena(&arena);
+}
 
-    // make valid program path string given shell path and program name
-    for(i = 0; i < *num_path; i++) 
+// loads the history file and keeps it open for appending; lines of other shells show up at the
+// next start. A file grown past limit lines by a quarter is trimmed to the newest limit of them, so
+// neither the file nor the start-up read grow without bound. Without a readable file the shell runs
+// with an empty history
+void history_load(const char *file, int limit)
+{
+    history.fd = open(file, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    struct stat info;
+    if (history.fd == -1 || fstat(history.fd, &info) == -1 || info.st_size == 0)
+    {
+        return;
+    }
+
+    // the file is read in one go and split in place; the entries point into it
+    char *data = (char *)arena_alloc(&history_arena, info.st_size + 1);
+    ssize_t length = data ? pread(history.fd, data, info.st_size, 0) : -1;
+    if (length <= 0)
+    {
+        return;
+    }
+    data[length] = '\0';
+    for (char *entry = data; entry < data + length; )
     {
-        snprintf(executable_path, sizeof(executable_path), "%s/%s", (*shell_path)[i], args[0]);
-        if(access(executable_path, X_OK) == 0) 
+        char *newline = (char *)memchr(entry, '\n', data + length - entry);
+        if (newline == NULL)
         {
-            command_found = 1;
-            break;
+            newline = data + length;
+        }
+        *newline = '\0';
+        if (newline > entry && !history_append(entry))
+        {
+            return;
         }
+        entry = newline + 1;
+    }
+    if (history.count > limit + limit / 4)
+    {
+        history_trim(limit, data + length, length);
     }
+}
+
+// keeps the newest limit entries of the history and rewrites the file with them in place, followed by
+// the lines other shells appended since the first loaded bytes were read; end is the end of
+// the loaded data, whose entries were split in place. The file lock keeps their appends out meanwhile
+void history_trim(int limit, const char *end, off_t loaded)
+{
+    memmove(history.entries, history.entries + history.count - limit, limit * sizeof(char *));
+    history.count = limit;
 
-    if (!command_found) 
+    // the kept entries are the tail of the loaded data, with their newlines turned into NULs
+    size_t kept = end - history.entries[0];
+    struct stat info;
+    int flags = fcntl(history.fd, F_GETFL);
+    if (flags == -1 || flock(history.fd, LOCK_EX) == -1)
     {
-        shell_error(ERROR_MESSAGE);
-        deallocate_string(buffer);
-        deallocate_shell_path(shell_path, num_path);
-        _exit(0); 
+        return;
+    }
+    char *text = NULL;
+    size_t appended = 0;
+    if (fstat(history.fd, &info) == 0 && info.st_size >= loaded &&
+        (text = (char *)malloc(kept + 1 + (info.st_size - loaded))) != NULL)
+    {
+        memcpy(text, history.entries[0], kept);
+        for (size_t i = 0; i < kept; i++)
+        {
+            if (text[i] == '\0') { text[i] = '\n'; }
+        }
+        if (kept > 0 && text[kept - 1] != '\n') { text[kept++] = '\n'; }
+        appended = info.st_size - loaded;
     }
 
-    /* IMPORTANT: child's copy of buffer and shell_path will not be deallocated manually if execv runs */
-    /* Valgrind may this as a "still reachable" memory leak even if the OS will cleanly reclaim the child's memory */
-    /* May need to create Valgrind suppresion file for this case */
-    execv(executable_path, args);
+    // a positioned write would still append while the file is in append mode
+    if (text != NULL && pread(history.fd, text + kept, appended, loaded) == (ssize_t)appended &&
+        fcntl(history.fd, F_SETFL, flags & ~O_APPEND) == 0)
+    {
+        size_t written = 0;
+        while (written < kept + appended)
+        {
+            ssize_t length = pwrite(history.fd, text + written, kept + appended - written, written);
+            if (length <= 0 && !(length == -1 && errno == EINTR))
+            {
+                break;
+            }
+            written += length > 0 ? (size_t)length : 0;
+        }
+        if (written == kept + appended)
+        {
+            ftruncate(history.fd, written);
+        }
+        fcntl(history.fd, F_SETFL, flags);
+    }
+    free(text);
+    flock(history.fd, LOCK_UN);
+}
 
-    // if execv returns, there was an error
-    deallocate_string(buffer);
-    deallocate_shell_path(shell_path, num_path);
-    shell_system_error(ERROR_MESSAGE);
+// adds entry (kept as is) to the history in memory; returns 0 if allocation failed
+char history_append(char *entry)
+{
+    if (history.count == history.capacity)
+    {
+        int capacity = history.capacity ? history.capacity * 2 : 256;
+        char **entries = (char **)realloc(history.entries, capacity * sizeof(char *));
+        if (entries == NULL)
+        {
+            return 0;
+        }
+        history.entries = entries;
+        history.capacity = capacity;
+    }
+    history.entries[history.count++] = entry;
+    return 1;
 }
 
-// run a single process
-void cmd_process(char **buffer, int *count, int pipes[][2], pid_t children[], char ***shell_path, int *num_path, FILE **fp)
+// remembers a line read by the editor and appends it to the history file; blank lines and
+// repeats of the previous line are left out
+void history_add(const char *line, size_t length)
 {
-    // open a pipe
-    if (pipe(pipes[*count]) == -1)
+    size_t blank = 0;
+    while (blank < length && isspace((unsigned char)line[blank]))
     {
-        attempt_close_batch(fp);
-        deallocate_string(buffer);
-        deallocate_shell_path(shell_path, num_path);
-        system_error(ERROR_MESSAGE);
+        blank++;
+    }
+    if (blank == length ||
+        (history.count > 0 && strlen(history.entries[history.count - 1]) == length &&
+         strncmp(history.entries[history.count - 1], line, length) == 0))
+    {
+        return;
     }
 
-    // attempt fork
-    pid_t child = fork();
-    if (child == -1)
+    char *entry = arena_strndup(&history_arena, line, length);
+    if (entry == NULL || !history_append(entry) || history.fd == -1)
     {
-        attempt_close_batch(fp);
-        deallocate_string(buffer);
-        deallocate_shell_path(shell_path, num_path);
-        system_error(ERROR_MESSAGE);
+        return;
     }
+    // a single write, so lines of shells sharing the file do not interleave; the lock waits for a
+    // shell trimming the file
+    struct iovec parts[2] = { { entry, length }, { "\n", 1 } };
+    flock(history.fd, LOCK_EX);
+    writev(history.fd, parts, 2);
+    flock(history.fd, LOCK_UN);
+}
 
-    if (child == 0)
+// newest entry older than before that contains query, -1 if there is none. Queries of three or more
+// bytes only look at the entries holding the query's rarest trigram, so the search stays instant
+// with a long history; what the idle prompt did not index yet is indexed first
+int history_search(const char *query, int before)
+{
+    size_t length = strlen(query);
+
+    // short queries and an index that could not be built scan the entries
+    if (length < 3 || !history_update_index(history.count))
     {
-        // close child's copy of file stream
-        attempt_close_batch(fp);
+        for (int i = before - 1; i >= 0; i--)
+        {
+            if (strstr(history.entries[i], query) != NULL)
+            {
+                return i;
+            }
+        }
+        return -1;
+    }
 
-        // close reading end pipe of child
-        close(pipes[*count][0]);
+    struct trigram_list *rarest = NULL;
+    for (size_t i = 0; i + 2 < length; i++)
+    {
+        unsigned int trigram = (unsigned char)query[i] << 16 | (unsigned char)query[i + 1] << 8 | (unsigned char)query[i + 2];
+        struct trigram_list *list = trigram_list_find(trigram, 0);
+        if (list == NULL)
+        {
+            return -1;
+        }
+        if (rarest == NULL || list->count < rarest->count)
+        {
+            rarest = list;
+        }
+    }
 
-        // make copy of buffer for safe tokenization
-        char* buffer_copy = (char *)malloc(strlen(*buffer) + 1);
-        strcpy(buffer_copy, *buffer);
-        char *program_name = strtok(buffer_copy, " ");
+    // the list is in ascending order: find the first entry not older than before
+    int low = 0;
+    int high = rarest->count;
+    while (low < high)
+    {
+        int middle = (low + high) / 2;
+        if (rarest->entries[middle] < before) { low = middle + 1; }
+        else { high = middle; }
+    }
+    for (int i = low - 1; i >= 0; i--)
+    {
+        if (strstr(history.entries[rarest->entries[i]], query) != NULL)
+        {
+            return rarest->entries[i];
+        }
+    }
+    return -1;
+}
 
-        // check which command-running method to do
-        // deallocate buffer copy until after checking program name
-        if (check_builtin_cmd(program_name))
+// adds up to limit entries that are not in the search index yet to it
+// returns 1 if every entry is indexed, 0 otherwise (or if the index could not be built)
+char history_update_index(int limit)
+{
+    for (int i = 0; i < limit && !history.index_failed && history.indexed < history.count; i++)
+    {
+        if (history_index_entry(history.indexed))
         {
-            deallocate_string(&buffer_copy);    // deallocate copy here because we exit immediately if "EXIT" cmd
-            run_builtin_cmd(buffer, pipes[*count], shell_path, num_path);
+            history.indexed++;
         }
         else
         {
-            deallocate_string(&buffer_copy);    // deallocate copy here because execv replaces the child process
-            run_extern_cmd(buffer, shell_path, num_path);
+            history.index_failed = 1;
         }
+    }
+    return !history.index_failed && history.indexed == history.count;
+}
 
-        deallocate_string(buffer);
-        deallocate_shell_path(shell_path, num_path);
-        close(pipes[*count][1]);    // close write end pipe of child
-        _exit(0);
+// adds entry id to the lists of the trigrams it contains; returns 0 if allocation failed
+char history_index_entry(int id)
+{
+    const unsigned char *text = (const unsigned char *)history.entries[id];
+    for (size_t i = 0; text[i] && text[i + 1] && text[i + 2]; i++)
+    {
+        struct trigram_list *list = trigram_list_find(text[i] << 16 | text[i + 1] << 8 | text[i + 2], 1);
+        if (list == NULL)
+        {
+            return 0;
+        }
+        // a trigram repeated in the entry is listed once
+        if (list->count > 0 && list->entries[list->count - 1] == id)
+        {
+            continue;
+        }
+        if (list->count == list->capacity)
+        {
+            int capacity = list->capacity ? list->capacity * 2 : 4;
+            int *entries = (int *)realloc(list->entries, capacity * sizeof(int));
+            if (entries == NULL)
+            {
+                return 0;
+            }
+            list->entries = entries;
+            list->capacity = capacity;
+        }
+        list->entries[list->count++] = id;
     }
-    else
+    return 1;
+}
+
+// finds the list of trigram in the search index, adding an empty one if create is set (the table
+// grows to keep at most half of its slots used); returns NULL if there is none or allocation failed
+struct trigram_list *trigram_list_find(unsigned int trigram, char create)
+{
+    if (create && (history.num_trigrams + 1) * 2 > history.trigrams_capacity)
+    {
+        int capacity = history.trigrams_capacity ? history.trigrams_capacity * 2 : TRIGRAM_TABLE_INIT_SIZE;
+        struct trigram_list *trigrams = (struct trigram_list *)calloc(capacity, sizeof(struct trigram_list));
+        if (trigrams == NULL)
+        {
+            return NULL;
+        }
+        for (int i = 0; i < history.trigrams_capacity; i++)
+        {
+            if (history.trigrams[i].trigram != 0)
+            {
+                unsigned int slot = (history.trigrams[i].trigram * 2654435761u) & (capacity - 1);
+                while (trigrams[slot].trigram != 0)
+                {
+                    slot = (slot + 1) & (capacity - 1);
+                }
+                trigrams[slot] = history.trigrams[i];
+            }
+        }
+        free(history.trigrams);
+        history.trigrams = trigrams;
+        history.trigrams_capacity = capacity;
+    }
+    if (history.trigrams_capacity == 0)
+    {
+        return NULL;
+    }
+
+    unsigned int mask = history.trigrams_capacity - 1;
+    unsigned int slot = (trigram * 2654435761u) & mask;
+    while (history.trigrams[slot].trigram != 0)
+    {
+        if (history.trigrams[slot].trigram == trigram)
+        {
+            return &history.trigrams[slot];
+        }
+        slot = (slot + 1) & mask;
+    }
+    if (!create)
+    {
+        return NULL;
+    }
+    history.trigrams[slot].trigram = trigram;
+    history.num_trigrams++;
+    return &history.trigrams[slot];
+}
+
+// keeps the completion index in step with a new shell path: directories staying in the path keep
+// what was scanned, the others are dropped and new ones are scanned when completion first needs them
+void completion_update_path(char **paths, int count)
+{
+    struct completion_dir *dirs = count > 0 ? (struct completion_dir *)calloc(count, sizeof(struct completion_dir)) : NULL;
+    for (int i = 0; dirs != NULL && i < count; i++)
+    {
+        for (int j = 0; j < num_completion_dirs && dirs[i].path == NULL; j++)
+        {
+            if (completion_dirs[j].path != NULL && strcmp(completion_dirs[j].path, paths[i]) == 0)
+            {
+                dirs[i] = completion_dirs[j];
+                completion_dirs[j].path = NULL;
+            }
+        }
+        // a directory that cannot be remembered is left out of completion
+        if (dirs[i].path == NULL)
+        {
+            dirs[i].path = strdup(paths[i]);
+        }
+    }
+
+    for (int j = 0; j < num_completion_dirs; j++)
     {
-        close(pipes[*count][1]);    // close write end pipe of parent
-        children[*count] = child;   // update child process list
-        (*count)++;     // increment amount of command seen/executed
+        free(completion_dirs[j].path);
+        deallocate_arena(&completion_dirs[j].arena);
     }
+    free(completion_dirs);
+    completion_dirs = dirs;
+    num_completion_dirs = dirs ? count : 0;
 }
 
-// parse multiple processes and attempts to run them
-void cmd_parse_processes(char **buffer, char ***shell_path, int *num_path, FILE **fp)
+// scans the executables of dir unless it did not change since the last scan (same mtime)
+// returns 0 if the directory cannot be read
+char completion_scan(struct completion_dir *dir)
 {
-    char* token;
-    int command_count = 0;
-    int pipes[MAX_PARALLEL_COMMANDS][2];
-    pid_t children[MAX_PARALLEL_COMMANDS];
+    struct stat info;
+    if (dir->path == NULL || stat(dir->path, &info) == -1)
+    {
+        return 0;
+    }
+    if (dir->scanned && info.st_mtim.tv_sec == dir->mtime.tv_sec && info.st_mtim.tv_nsec == dir->mtime.tv_nsec)
+    {
+        return 1;
+    }
+    DIR *stream = opendir(dir->path);
+    if (stream == NULL)
+    {
+        return 0;
+    }
+
+    deallocate_arena(&dir->arena);
+    dir->names = NULL;
+    dir->count = dir->capacity = 0;
+    dir->scanned = 0;
+    char failed = 0;
+    struct dirent *entry;
+    while (!failed && (entry = readdir(stream)) != NULL)
+    {
+        // the file type of the entry spares a stat for most files
+        struct stat file;
+        if (entry->d_name[0] == '.' || entry->d_type == DT_DIR ||
+            (entry->d_type != DT_REG &&
+             (fstatat(dirfd(stream), entry->d_name, &file, 0) == -1 || !S_ISREG(file.st_mode))) ||
+            faccessat(dirfd(stream), entry->d_name, X_OK, 0) == -1)
+        {
+            continue;
+        }
+        failed = !completion_add(&dir->arena, &dir->names, &dir->count, &dir->capacity, entry->d_name, strlen(entry->d_name));
+    }
+    closedir(stream);
+    if (failed)
+    {
+        return 0;
+    }
 
-    // we already know that the buffer only has commands with '&' due to if else in "int main()"
-    token = strtok(*buffer, "&");
-    while (token != NULL)
+    qsort(dir->names, dir->count, sizeof(char *), compare_strings);
+    dir->mtime = info.st_mtim;
+    dir->scanned = 1;
+    return 1;
+}
+
+// appends a copy of name to an arena array of candidates; returns 0 if allocation failed
+char completion_add(struct arena *arena, char ***candidates, int *count, int *capacity, const char *name, size_t length)
+{
+    char **grown = (char **)arena_grow_array(arena, *candidates, *count, capacity, sizeof(char *));
+    if (grown == NULL || (grown[*count] = arena_strndup(arena, name, length)) == NULL)
     {
-        remove_lead_and_trailing_whitespaces(&token);
-        cmd_process(&token, &command_count, pipes, children, shell_path, num_path, fp);
-        token = strtok(NULL, "&");
+        return 0;
     }
+    *candidates = grown;
+    (*count)++;
+    return 1;
+}
 
-    wait_and_check_child_exit_status(command_count, children, buffer, shell_path, num_path, fp);
-    check_child_message_and_close_pipes(command_count, pipes, buffer, shell_path, num_path);
+// qsort comparison of strings
+int compare_strings(const void *first, const void *second)
+{
+    return strcmp(*(char * const *)first, *(char * const *)second);
 }
 
 // deallocates and nullifies a string
@@ -556,60 +7543,180 @@ void deallocate_string(char **buffer)
     *buffer = NULL;
 }
 
-// deallocates the shell path/added start for maybe use with modify path?
+// deallocates the shell path and the command hash together with their arenas
 void deallocate_shell_path(char ***shell_path, int *num_path)
 {
-    for (int i = 0; i < *num_path; i++)
-    {
-        free((*shell_path)[i]);
-        (*shell_path)[i] = NULL;
-    }
-    free(*shell_path);
+    cmd_hash_clear();
+    deallocate_arena(&hash_arena);
+    deallocate_arena(&path_arena);
     *shell_path = NULL;
     *num_path = 0;
 }
 
-// attempts to close batch file if opened
-void attempt_close_batch(FILE **fp)
+// deallocates every block of the arena
+void deallocate_arena(struct arena *arena)
 {
-    if (*fp != NULL)
+    while (arena->blocks != NULL)
     {
-        fclose(*fp);
+        struct arena_block *next = arena->blocks->next;
+        if (!arena->blocks->preallocated)
+        {
+            free(arena->blocks);
+        }
+        arena->blocks = next;
     }
 }
 
-// check child exit status and cleanly deallocate if child requested to exit or serious system error occured in child
-void wait_and_check_child_exit_status(int command_count, pid_t children[], char **buffer, char ***shell_path, int *num_path, FILE **fp)
+// deallocates the children list, pipeline timers, cache fills and background jobs of the job table
+void deallocate_job_table(struct job_table *jobs)
 {
-    for (int i = 0; i < command_count; i++)
+    free(jobs->background);
+    jobs->background = NULL;
+    jobs->num_background = jobs->background_capacity = 0;
+    if (jobs->children != job_table_storage)
+    {
+        free(jobs->children);
+    }
+    jobs->children = NULL;
+    jobs->count = jobs->capacity = 0;
+    free(jobs->timers);
+    jobs->timers = NULL;
+    jobs->num_timers = 0;
+    free(jobs->captures);
+    jobs->captures = NULL;
+    jobs->num_captures = jobs->captures_capacity = 0;
+    for (int i = 0; i < jobs->num_fills; i++)
     {
-        // wait for each child and get their statuses
-        int child_status;
-        waitpid(children[i], &child_status, 0);
+        free(jobs->fills[i].material);
+    }
+    free(jobs->fills);
+    jobs->fills = NULL;
+    jobs->num_fills = 0;
+}
 
-        // terminate whole program if serious system errors such as pipe/allocation error happened in child
-        // exit gracefully if exit command is requested
-        if (WIFEXITED(child_status))
+// deallocates the shell variables
+void deallocate_variable_table(void)
+{
+    // the environment may still point at the texts; nothing reads it once the shell is exiting
+    for (int i = 0; i < VARIABLE_BUCKETS; i++)
+    {
+        while (variable_table[i] != NULL)
         {
-            if (WEXITSTATUS(child_status) == CHILD_SYSTEM_ERROR)
-            {
-                attempt_close_batch(fp);
-                deallocate_string(buffer);
-                deallocate_shell_path(shell_path, num_path);
-                exit(1);
-            }
-            else if (WEXITSTATUS(child_status) == CHILD_EXIT_REQUEST)
+            struct variable *next = variable_table[i]->next;
+            free(variable_table[i]->text);
+            free(variable_table[i]);
+            variable_table[i] = next;
+        }
+    }
+}
+
+// deallocates the history, its search index and the completion index
+void deallocate_line_editor(void)
+{
+    for (int i = 0; i < history.trigrams_capacity; i++)
+    {
+        free(history.trigrams[i].entries);
+    }
+    free(history.trigrams);
+    history.trigrams = NULL;
+    history.trigrams_capacity = history.num_trigrams = history.indexed = 0;
+    history.index_failed = 0;
+    free(history.entries);
+    history.entries = NULL;
+    history.count = history.capacity = 0;
+    deallocate_arena(&history_arena);
+    if (history.fd != -1)
+    {
+        close(history.fd);
+        history.fd = -1;
+    }
+    completion_update_path(NULL, 0);
+}
+
+// attempts to close batch file if opened
+void attempt_close_batch(struct batch_file *batch)
+{
+    if (batch->fd != -1)
+    {
+        // stdin is left open for the programs that read it
+        if (batch->fd != STDIN_FILENO)
+        {
+            close(batch->fd);
+        }
+        batch->fd = -1;
+    }
+    if (batch->buffer != NULL && batch->buffer != batch_buffer)
+    {
+        free(batch->buffer);
+    }
+    batch->buffer = NULL;
+    batch->start = batch->end = 0;
+    if (batch->data != NULL)
+    {
+        munmap(batch->data, batch->size);
+        batch->data = NULL;
+    }
+    if (batch->compiled != NULL)
+    {
+        munmap(batch->compiled, batch->compiled_size);
+        batch->compiled = NULL;
+    }
+}
+
+// wait for the remaining children of the foreground lines (and of the background jobs if include_background
+// is set) and cleanly deallocate if serious system error occured in child
+void wait_and_check_child_exit_status(struct job_table *jobs, char include_background, char **buffer, char ***shell_path, int *num_path, struct batch_file *batch)
+{
+    // stopped jobs would never finish; they are hung up and continued as a terminal would do
+    if (include_background)
+    {
+        for (int i = 0; i < jobs->num_background; i++)
+        {
+            if (jobs->background[i].state == JOB_STOPPED)
             {
-                attempt_close_batch(fp);
-                deallocate_string(buffer);
-                deallocate_shell_path(shell_path, num_path);
-                exit(0);
+                kill(-jobs->background[i].pgid, SIGHUP);
+                kill(-jobs->background[i].pgid, SIGCONT);
             }
         }
     }
+
+    // wait for each child (in the order they finish) and get their statuses
+    while (include_background ? jobs->count > 0 : jobs->foreground > 0)
+    {
+        job_table_reap_any(jobs, 0);
+    }
+
+    // terminate whole program if serious system errors such as pipe/allocation error happened in child
+    if (jobs->child_system_error)
+    {
+        attempt_close_batch(batch);
+        deallocate_string(buffer);
+        deallocate_shell_path(shell_path, num_path);
+        deallocate_job_table(jobs);
+        trace_finish();
+        exit(1);
+    }
     return;
 }
 
+// exit gracefully when the exit built-in is requested
+void exit_shell_request(struct job_table *jobs, char **buffer, char ***shell_path, int *num_path, struct batch_file *batch)
+{
+    if (startup_report)
+    {
+        startup_print();
+    }
+    attempt_close_batch(batch);
+    deallocate_string(buffer);
+    deallocate_shell_path(shell_path, num_path);
+    deallocate_job_table(jobs);
+    deallocate_line_editor();
+    deallocate_variable_table();
+    glob_cache_clear();
+    trace_finish();
+    exit(0);
+}
+
 // displays shell system error message and exits with 1 status in child
 // used for allocating, fork, piping, file methods failure in child process
 void shell_system_error(const char* message)
@@ -622,6 +7729,7 @@ void shell_system_error(const char* message)
 void system_error(const char *message)
 {
     write(STDERR_FILENO, message, strlen(message)); 
+    trace_finish();
     exit(1);
 }
 